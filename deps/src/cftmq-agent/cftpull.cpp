@@ -1,8 +1,17 @@
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <list>
+#include <map>
+#include <vector>
 #include "stompc.h"
+#include "md5.h"
 
 enum { max_chunks=10000, max_len=2000 * 1024 * 1024 };
 
@@ -16,6 +25,12 @@ namespace cfg
     std::string queue="test";
 
     std::string workdir="./";
+
+    int max_open=64;            // максимальное количество одновременно открытых серий (LRU)
+
+    int flush_every=1;          // сбрасывать статус на диск не реже чем раз в N фрагментов серии
+
+    bool sync=true;             // fdatasync перед ACK
 }
 
 class alrm
@@ -25,17 +40,6 @@ public:
     ~alrm(void) { alarm(0); }
 };
 
-class file
-{
-public:
-    FILE* fp;
-
-    file(FILE* _fp):fp(_fp) {}
-    ~file(void) { close(); }
-
-    void close(void) { if(fp) { fclose(fp); fp=NULL; } }
-};
-
 struct chunk_info
 {
     std::string seq;
@@ -47,9 +51,77 @@ struct chunk_info
     std::string dgst;
     std::string data;
 
+    chunk_info(void):id(0),total(0),offset(0),size(0),size_total(0) {}
+
     bool init(const std::string& seq_id,const std::string& chunk_id,const std::string& chunk_range,const std::string& chunk_dgst);
 };
 
+// состояние принимаемой серии фрагментов
+// статусный файл содержит в себе максимальное кол-во фрагментов (из первого фрагмента),
+// количество успешно принятых и битовую маску принятых фрагментов.
+// начинается файл с символа с кодом 0x02 (STX — start of text), заканчивается 0x04 (EOT — end of transmission)
+// общий размер файла в байтах = STX + chunks_total + chunks + bitmap + EOT
+class sequence
+{
+public:
+    enum { bitmap_offset=9 };
+
+    std::string seq;
+    int dfd;                                // файл для временного хранения данных серии (.part~)
+    int sfd;                                // файл для временного хранения информации о принятых фрагментах (.stat~)
+    u_int32_t total;
+    u_int32_t size_total;
+    u_int32_t received;
+    std::vector<u_int32_t> bitmap;
+
+    int dirty_from,dirty_to;                // диапазон измененных юнитов битовой маски (в памяти, еще не на диске)
+    int pending;                            // количество фрагментов, принятых после последнего сброса статуса
+    bool data_dirty;                        // данные записаны, но fdatasync еще не было
+
+    sequence(void):dfd(-1),sfd(-1),total(0),size_total(0),received(0),dirty_from(-1),dirty_to(-1),pending(0),data_dirty(false) {}
+
+    ~sequence(void) { close(); }
+
+    bool open(const chunk_info& c);
+
+    bool has(int id) const { return (bitmap[(id-1)/32]<<((id-1)%32))&0x80000000; }
+
+    void set(int id);
+
+    int flush(void);
+
+    void close(void)
+    {
+        if(dfd!=-1) { ::close(dfd); dfd=-1; }
+        if(sfd!=-1) { ::close(sfd); sfd=-1; }
+    }
+};
+
+// открытые серии: поиск по seq-id, вытеснение по давности использования
+class engine
+{
+protected:
+    typedef std::list<sequence*> lru_t;
+
+    lru_t lru;                              // в начале - последние использованные
+    std::map<std::string,lru_t::iterator> index;
+
+    // серии, которые надо сбросить на диск перед очередным ACK
+    std::list<sequence*> dirty;
+
+    sequence* get(const chunk_info& c,int& rc);
+
+    void drop(sequence* s);
+public:
+    ~engine(void);
+
+    // принять фрагмент: <0 - ошибка, 0 - принят, 1 - серия собрана
+    int onchunk(chunk_info& c);
+
+    // сделать все принятое долговременным (вызывается перед ACK)
+    int flush(void);
+};
+
 static void __sig_handler(int n) { }
 
 stomp::connection con;
@@ -81,6 +153,43 @@ static int logout(void)
     return 0;
 }
 
+static bool pwrite_all(int fd,const char* p,size_t len,off_t offset)
+{
+    while(len>0)
+    {
+        ssize_t n=pwrite(fd,p,len,offset);
+
+        if(n==(ssize_t)-1 && errno==EINTR)
+            continue;
+
+        if(n<=0)
+            return false;
+
+        p+=n; len-=n; offset+=n;
+    }
+
+    return true;
+}
+
+static std::string md5_hex(const std::string& s)
+{
+    static const char digits[]="0123456789abcdef";
+
+    MD5_CTX ctx;
+    unsigned char md[16];
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx,(const unsigned char*)s.data(),s.length());
+    MD5_Final(md,&ctx);
+
+    std::string hex; hex.reserve(sizeof(md)*2);
+
+    for(size_t i=0;i<sizeof(md);i++)
+        { hex+=digits[md[i]>>4]; hex+=digits[md[i]&0x0f]; }
+
+    return hex;
+}
+
 bool chunk_info::init(const std::string& seq_id,const std::string& chunk_id,const std::string& chunk_range,const std::string& chunk_dgst)
 {
 // seq-id:12345
@@ -105,162 +214,310 @@ bool chunk_info::init(const std::string& seq_id,const std::string& chunk_id,cons
 
     dgst=chunk_dgst;
 
-/*
-    fprintf(stderr,"      seq: %s\n",seq.c_str());
-    fprintf(stderr,"      id: %i\n",id);
-    fprintf(stderr,"      total: %i\n",total);
-    fprintf(stderr,"      offset: %i\n",offset);
-    fprintf(stderr,"      size: %i\n",size);
-    fprintf(stderr,"      size_total: %i\n",size_total);
-    fprintf(stderr,"      dgst: %s\n",dgst.c_str());
-*/
+    for(std::string::iterator it=dgst.begin();it!=dgst.end();++it)
+        *it=tolower(*it);
 
     return true;
 }
 
-static int onchunk(chunk_info& c)
+bool sequence::open(const chunk_info& c)
 {
-    if(c.seq.empty() || c.id<1 || c.id>c.total || c.total<1 || c.total>max_chunks || c.offset<0 || c.size<1 || c.size_total<1 ||
-        c.offset+c.size>c.size_total || c.size_total>max_len || c.data.size()!=c.size)
-            return -1;
+    std::string dpath=cfg::workdir+c.seq+".part~";
+    std::string spath=cfg::workdir+c.seq+".stat~";
 
-    std::string dpath=cfg::workdir+c.seq+".part~";  // файл для временного хранения данных серии
-    std::string spath=cfg::workdir+c.seq+".stat~";  // файл для временного хранения информации о принятых фрагментах
+    seq=c.seq;
+    total=c.total;
+    size_total=c.size_total;
+    received=0;
 
-    file dfp(fopen(dpath.c_str(),"r+"));
+    int units=c.total/32;
+    if(c.total%32)
+        units++;
 
-    if(!dfp.fp)    // первый фрагмент, файла пока нет
-    {
-        dfp.fp=fopen(dpath.c_str(),"w+");
+    bitmap.assign(units,0);
 
-        if(dfp.fp) // создаем новый временный файл и раздвигаем его
-        {
-            fseek(dfp.fp,c.size_total-1,SEEK_SET);
-            fputc(0,dfp.fp); fflush(dfp.fp);
-        }
-    }else
-    {
-        fseek(dfp.fp,0,SEEK_END);
-        if(c.size_total!=ftell(dfp.fp)) // максимальная длина во всех фрагментах не должна меняться
-            return -1;
-    }
-
-    if(!dfp.fp)
-        return -2;
+    dfd=::open(dpath.c_str(),O_RDWR|O_CREAT,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 
-    // текущее количество успешно принятых фрагментов (что б понять когда весь файл готов)
-    u_int32_t chunks_received=0;
+    if(dfd==-1)
+        return false;
 
-    // создаем файл для хранения текущего статуса загрузки
-    // статусный файл содержит в себе максимальное кол-во фрагментов (из первого фрагмента),
-    // количество успешно принятых и битовую маску принятых фрагментов.
-    // начинается файл с символа с кодом 0x02 (STX — start of text), заканчивается 0x04 (EOT — end of transmission)
-    // общий размер файла в байтах = STX + chunks_total + chunks + bitmap + EOT
+    struct stat st;
 
+    if(fstat(dfd,&st))
+        return false;
 
-    file sfp(fopen(spath.c_str(),"r+"));
-    if(!sfp.fp)
+    if(!st.st_size)
     {
-        sfp.fp=fopen(spath.c_str(),"w+");
+        // первый фрагмент, раздвигаем файл без записи данных
+        if(ftruncate(dfd,c.size_total))
+            return false;
+    }else if(st.st_size!=c.size_total)  // максимальная длина во всех фрагментах не должна меняться
+        return false;
 
-        if(sfp.fp)
-        {
-            // вычисляем кличетво 32-х битных юнитов для хранения битовой маски принятых фрагментов (округляем в большую сторону)
-            int units=c.total/32;
-            if(c.total%32)
-                units++;
+    sfd=::open(spath.c_str(),O_RDWR|O_CREAT,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 
-            // инициализируем новый файл
-            fputc(0x02,sfp.fp);
+    if(sfd==-1)
+        return false;
 
-            u_int32_t nn=c.total; fwrite((char*)&nn,sizeof(nn),1,sfp.fp); nn=0;
+    if(fstat(sfd,&st))
+        return false;
 
-            for(int i=0;i<units+1;i++)
-                fwrite((char*)&nn,sizeof(nn),1,sfp.fp);
+    std::string s; s.resize(bitmap_offset+units*sizeof(u_int32_t)+1);
 
-            fputc(0x04,sfp.fp);
-            fflush(sfp.fp);
-        }
+    if(!st.st_size)
+    {
+        // новый статусный файл
+        s[0]=0x02;
+        u_int32_t nn=c.total; memcpy(&s[1],&nn,sizeof(nn));
+        s[s.length()-1]=0x04;
+
+        if(!pwrite_all(sfd,s.data(),s.length(),0))
+            return false;
     }else
     {
         // проверяем файл на валидность и убеждаемся что общее количество фрагментов не изменилось
-        if(fgetc(sfp.fp)!=0x02)
-            return -3;
+        if(st.st_size!=(off_t)s.length() || pread(sfd,&s[0],s.length(),0)!=(ssize_t)s.length() ||
+            s[0]!=0x02 || s[s.length()-1]!=0x04)
+                return false;
+
+        u_int32_t nn=0; memcpy(&nn,&s[1],sizeof(nn));
 
-        u_int32_t nn=0;
-        if(fread((char*)&nn,1,sizeof(nn),sfp.fp)!=sizeof(nn) || nn!=c.total)
-            return -3;
+        if(nn!=(u_int32_t)c.total)
+            return false;
 
-        if(fread((char*)&chunks_received,1,sizeof(chunks_received),sfp.fp)!=sizeof(chunks_received))
-            return -3;
+        memcpy(&received,&s[5],sizeof(received));
+
+        if(units>0)
+            memcpy(&bitmap[0],&s[bitmap_offset],units*sizeof(u_int32_t));
     }
 
-    if(!sfp.fp)
-        return -3;
+    return true;
+}
+
+void sequence::set(int id)
+{
+    int unit=(id-1)/32;
+
+    bitmap[unit]|=0x80000000>>(id-1)%32;
 
-    // битовая маска
-    u_int32_t bitmap=0; int bitmap_offset=0;
+    if(dirty_from==-1 || unit<dirty_from)
+        dirty_from=unit;
+    if(unit>dirty_to)
+        dirty_to=unit;
 
-    // смотрим есть ли у нас уже такой фрагмент
+    received++;
+    pending++;
+    data_dirty=true;
+}
+
+int sequence::flush(void)
+{
+    // сначала данные, потом статус - статус не должен опережать данные на диске
+    if(data_dirty)
     {
+        if(cfg::sync && fdatasync(dfd))
+            return -4;
+
+        data_dirty=false;
+    }
 
-        // сдвигаемся к нужному юниту (9 это смещение битовой маски от начала)
-        if(fseek(sfp.fp,(c.id-1)/32+9,SEEK_SET) || fread((char*)&bitmap,1,sizeof(bitmap),sfp.fp)!=sizeof(bitmap))
-            return -3;
+    if(!pending)
+        return 0;
 
-        if((bitmap<<=(c.id-1)%32)&0x80000000) // фрагмент уже есть, пропускаем
-        {
-            printf("** %s/%i alredy is exist\n",c.seq.c_str(),c.id);
+    if(!pwrite_all(sfd,(const char*)&received,sizeof(received),5))
+        return -5;
+
+    if(dirty_from!=-1 && !pwrite_all(sfd,(const char*)&bitmap[dirty_from],(dirty_to-dirty_from+1)*sizeof(u_int32_t),
+        bitmap_offset+dirty_from*sizeof(u_int32_t)))
+            return -5;
 
-            return 0;
-        }else           // фрагмента нет, взводим бит
-            bitmap|=0x80000000>>(c.id-1)%32;
+    if(cfg::sync && fdatasync(sfd))
+        return -5;
 
-        // сохраняем позицию для записи битовой маски
-        bitmap_offset=ftell(sfp.fp)-4;
+    dirty_from=dirty_to=-1;
+    pending=0;
+
+    return 0;
+}
+
+sequence* engine::get(const chunk_info& c,int& rc)
+{
+    std::map<std::string,lru_t::iterator>::iterator it=index.find(c.seq);
+
+    if(it!=index.end())
+    {
+        // поднимаем в начало LRU
+        lru.splice(lru.begin(),lru,it->second);
+
+        sequence* s=lru.front();
+
+        if(s->total!=(u_int32_t)c.total || s->size_total!=(u_int32_t)c.size_total)
+            { rc=-1; return NULL; }
+
+        return s;
     }
 
-    // пишем фрагмент
+    // вытесняем давно не использовавшиеся серии
+    while(lru.size()>=(size_t)cfg::max_open)
     {
-        if(fseek(dfp.fp,c.offset,SEEK_SET))
-            return -4;
+        sequence* s=lru.back();
 
-        int l=0;
+        if(s->flush())
+            { fprintf(stderr,"** unable to save stat of %s\n",s->seq.c_str()); rc=-5; return NULL; }
 
-        while(l<c.data.length())
-        {
-            int n=fwrite(c.data.c_str()+l,1,c.data.length()-l,dfp.fp);
+        drop(s);
+    }
 
-            if(n<=0)
-                break;
+    sequence* s=new sequence;
 
-            l+=n;
-        }
+    if(!s->open(c))
+        { delete s; rc=-3; return NULL; }
 
-        if(l!=c.data.length() || fflush(dfp.fp))  // ошибка записи
-            return -4;
+    lru.push_front(s);
+    index[s->seq]=lru.begin();
+
+    return s;
+}
+
+void engine::drop(sequence* s)
+{
+    std::map<std::string,lru_t::iterator>::iterator it=index.find(s->seq);
+
+    if(it!=index.end())
+        { lru.erase(it->second); index.erase(it); }
+
+    dirty.remove(s);
+
+    delete s;
+}
+
+engine::~engine(void)
+{
+    // при завершении статус сбрасывается независимо от cfg::flush_every: подтвержденные фрагменты брокер
+    // повторно не пришлет, без статуса серия не соберется
+    for(std::list<sequence*>::iterator it=dirty.begin();it!=dirty.end();++it)
+        if((*it)->flush())
+            fprintf(stderr,"** unable to save stat of %s\n",(*it)->seq.c_str());
+
+    while(!lru.empty())
+        drop(lru.back());
+}
+
+int engine::onchunk(chunk_info& c)
+{
+    if(c.seq.empty() || c.seq.find('/')!=std::string::npos || c.id<1 || c.id>c.total || c.total<1 || c.total>max_chunks ||
+        c.offset<0 || c.size<1 || c.size_total<1 || c.offset+c.size>c.size_total || c.size_total>max_len || (int)c.data.size()!=c.size)
+            return -1;
+
+    // фрагмент с заявленным дайджестом проверяем до записи
+    if(!c.dgst.empty() && c.dgst!=md5_hex(c.data))
+        return -6;
+
+    int rc=0;
+
+    sequence* s=get(c,rc);
+
+    if(!s)
+        return rc;
+
+    if(s->has(c.id))    // фрагмент уже есть, пропускаем
+    {
+        printf("** %s/%i alredy is exist\n",c.seq.c_str(),c.id);
+
+        return 0;
     }
 
-    chunks_received++;
+    // пишем фрагмент
+    if(!pwrite_all(s->dfd,c.data.data(),c.data.length(),c.offset))
+        return -4;
 
-    if(fseek(sfp.fp,5,SEEK_SET) || fwrite((char*)&chunks_received,1,sizeof(chunks_received),sfp.fp)!=sizeof(chunks_received) ||
-        fseek(sfp.fp,bitmap_offset,SEEK_SET) || fwrite((char*)&bitmap,1,sizeof(bitmap),sfp.fp)!=sizeof(bitmap) || fflush(sfp.fp))
-            { fprintf(stderr,"** unable to save stat of %s/%i\n",c.seq.c_str(),c.id); return -5; }
+    s->set(c.id);
 
-    if(chunks_received==c.total)                // файл готов
+    if(s->received==s->total)   // файл готов
     {
-        sfp.close(); dfp.close();
+        if(cfg::sync && fdatasync(s->dfd))
+            return -4;
+
+        std::string dpath=cfg::workdir+s->seq+".part~";
+        std::string spath=cfg::workdir+s->seq+".stat~";
+        std::string path=cfg::workdir+s->seq;
+
+        drop(s);
 
         unlink(spath.c_str());
-        rename(dpath.c_str(),(cfg::workdir+c.seq).c_str());
+        rename(dpath.c_str(),path.c_str());
+
         return 1;
     }
 
+    if(s->pending==1)
+        dirty.push_back(s);
+
     return 0;
 }
 
+int engine::flush(void)
+{
+    int rc=0;
+
+    for(std::list<sequence*>::iterator it=dirty.begin();it!=dirty.end();)
+    {
+        sequence* s=*it;
+
+        // при cfg::flush_every>1 статус серии накапливается в памяти, но данные все равно синхронизируются
+        if(s->pending<cfg::flush_every)
+        {
+            if(s->data_dirty && cfg::sync && fdatasync(s->dfd))
+                rc=-4;
+            else
+                s->data_dirty=false;
+
+            ++it;
+            continue;
+        }
+
+        int n=s->flush();
+
+        if(n)
+            { fprintf(stderr,"** unable to save stat of %s\n",s->seq.c_str()); rc=n; ++it; continue; }
+
+        it=dirty.erase(it);
+    }
+
+    return rc;
+}
+
 int main(int argc,char** argv)
 {
+    int opt;
+    while((opt=getopt(argc,argv,"h?a:u:p:q:d:T:L:F:n"))>0)
+        switch(opt)
+        {
+        case 'h':
+        case '?':
+            fprintf(stderr,"USAGE: ./cftpull [-a host:port] [-u username] [-p passcode] [-q queue] [-d workdir] [-T timeout] [-L max_open] [-F flush_every] [-n]\n"
+                "-L   max number of simultaneously open sequences (default %i)\n"
+                "-F   save status of a sequence every N chunks (default %i); with N>1 chunks are ACKed before\n"
+                "     their status is on disk, a crash loses up to N-1 of them per sequence (clean exit saves all)\n"
+                "-n   no fdatasync before ACK\n",cfg::max_open,cfg::flush_every);
+            exit(0);
+        case 'a': cfg::addr=optarg; break;
+        case 'u': cfg::username=optarg; break;
+        case 'p': cfg::passcode=optarg; break;
+        case 'q': cfg::queue=optarg; break;
+        case 'd': cfg::workdir=optarg; if(!cfg::workdir.empty() && cfg::workdir[cfg::workdir.length()-1]!='/') cfg::workdir+='/'; break;
+        case 'T': cfg::timeout=atoi(optarg); break;
+        case 'L': cfg::max_open=atoi(optarg); break;
+        case 'F': cfg::flush_every=atoi(optarg); break;
+        case 'n': cfg::sync=false; break;
+        }
+
+    if(cfg::max_open<1)
+        cfg::max_open=1;
+
+    if(cfg::flush_every<1)
+        cfg::flush_every=1;
+
     struct sigaction sig;
     sig.sa_handler=__sig_handler;
     sigfillset(&sig.sa_mask);
@@ -281,6 +538,8 @@ int main(int argc,char** argv)
     {
         fprintf(stderr,"** connected, waiting...\n");
 
+        engine e;
+
         stomp::frame f;
 
         while(con.recv(f))
@@ -299,7 +558,7 @@ int main(int argc,char** argv)
             {
                 c.data.swap(f.data);
 
-                int rc=onchunk(c);
+                int rc=e.onchunk(c);
 
                 if(rc<0)
                     printf("** msg %s is rejected (%i)\n",msg_id.c_str(),rc);
@@ -307,6 +566,10 @@ int main(int argc,char** argv)
                     printf("** msg %s is ready\n",msg_id.c_str());
             }
 
+            // ACK только после того как принятое легло на диск
+            if(e.flush())
+                break;
+
             {
                 alrm a(cfg::timeout);
 
@@ -1,41 +1,426 @@
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <list>
 #include "stompc.h"
+#include "md5.h"
 
-enum { max_num=50 };
+// брокер держит не более 32 ответов в очереди на отправку клиенту, окно должно быть меньше
+enum { max_window=16, max_chunks=10000, max_len=2000 * 1024 * 1024 };
 
-int main(void)
+namespace cfg
 {
+    int timeout=5;
+
+    std::string addr="127.0.0.1:40090";
+    std::string username="admin";
+    std::string passcode="";
+    std::string queue="test";
+
+    std::string filename="-";
+    std::string seq_id;
+
+    int chunk_size=1024*1024;
+
+    int window=4;               // количество фрагментов, отправленных без подтверждения
+
+    int max_num=0;              // передается брокеру в max-num (0 - без ограничения)
+
+    int high_mark=0;            // при queue-size выше этого значения отправка притормаживается (0 - не тормозить)
+
+    int retries=10;             // количество повторов фрагмента после ERROR
+
+    bool verb=false;
+}
+
+class alrm
+{
+public:
+    alrm(int n) { alarm(n); }
+    ~alrm(void) { alarm(0); }
+};
+
+// фрагмент, ожидающий подтверждения
+struct chunk
+{
+    int id;
+    off_t offset;
+    std::string data;
+    std::string dgst;
+    std::string receipt;
+    int retries;
+
+    chunk(void):id(0),offset(0),retries(0) {}
+};
+
+static void __sig_handler(int n) { }
+
+stomp::connection con;
+
+static int login(void)
+{
+    alrm a(cfg::timeout);
+
+    if(!con.connect(cfg::addr))
+        { fprintf(stderr,"** unable to establish connection\n"); return -1; }
+
+    if(!con.login(cfg::username,cfg::passcode))
+        { fprintf(stderr,"** access denied\n"); return -2; }
+
+    return 0;
+}
+
+static int logout(void)
+{
+    alrm a(cfg::timeout);
+
+    con.logout();
+
+    con.close();
+
+    return 0;
+}
+
+static std::string to_hex(const unsigned char* p,int len)
+{
+    static const char digits[]="0123456789abcdef";
+
+    std::string hex; hex.reserve(len*2);
+
+    for(int i=0;i<len;i++)
+        { hex+=digits[p[i]>>4]; hex+=digits[p[i]&0x0f]; }
+
+    return hex;
+}
+
+// прочитать очередной фрагмент, дайджест считается по мере чтения
+static int read_chunk(int fd,chunk& c,int size)
+{
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+
+    c.data.resize(size);
+
+    int l=0;
+
+    while(l<size)
+    {
+        ssize_t n=read(fd,&c.data[l],size-l);
+
+        if(n==(ssize_t)-1 && errno==EINTR)
+            continue;
+
+        if(n<=0)
+            break;
+
+        MD5_Update(&ctx,(const unsigned char*)c.data.data()+l,n);
+
+        l+=n;
+    }
+
+    c.data.resize(l);
+
+    unsigned char md[16];
+    MD5_Final(md,&ctx);
+
+    c.dgst=to_hex(md,sizeof(md));
+
+    return l;
+}
+
+// получатель (cftpull) должен знать общий размер заранее, поэтому поток без размера
+// (pipe) сначала сбрасывается во временный файл
+static int open_source(off_t& length)
+{
+    int fd=cfg::filename=="-"?dup(fileno(stdin)):open(cfg::filename.c_str(),O_RDONLY);
+
+    if(fd==-1)
+        { fprintf(stderr,"** file '%s' is not found\n",cfg::filename.c_str()); return -1; }
+
+    struct stat st;
+
+    if(!fstat(fd,&st) && S_ISREG(st.st_mode))
+        { length=st.st_size; return fd; }
+
+    char tmp[]="/tmp/cftpush.XXXXXX";
+
+    int tfd=mkstemp(tmp);
+
+    if(tfd==-1)
+        { close(fd); return -1; }
+
+    unlink(tmp);
+
+    length=0;
+
+    char buf[64*1024];
+
+    for(;;)
+    {
+        ssize_t n=read(fd,buf,sizeof(buf));
+
+        if(n==(ssize_t)-1 && errno==EINTR)
+            continue;
+
+        if(n<=0)
+            break;
+
+        if(write(tfd,buf,n)!=n)
+            { close(fd); close(tfd); return -1; }
+
+        length+=n;
+    }
+
+    close(fd);
+
+    lseek(tfd,0,SEEK_SET);
+
+    return tfd;
+}
+
+static bool send_chunk(stomp::frame& f,chunk& c,int total,off_t length)
+{
+    char buf[256];
+
+    sprintf(buf,"%i/%i",c.id,total);
+    f.hdrs["chunk-id"]=buf;
+
+    sprintf(buf,"%lu-%lu/%lu",(unsigned long)c.offset,(unsigned long)(c.offset+c.data.length())-1,(unsigned long)length);
+    f.hdrs["chunk-range"]=buf;
+
+    f.hdrs["chunk-dgst"]=c.dgst;
+    f.hdrs["receipt"]=c.receipt;
+
+    if(cfg::verb)
+        fprintf(stderr,"** chunk %i/%i, range %s\n",c.id,total,buf);
+
+    // тело меняем местами, что бы не копировать фрагмент
+    f.data.swap(c.data);
+
+    bool rc;
+
+    {
+        alrm a(cfg::timeout);
+
+        rc=con.send(f);
+    }
+
+    f.data.swap(c.data);
+
+    return rc;
+}
+
+static int push(void)
+{
+    off_t length=0;
+
+    int fd=open_source(length);
+
+    if(fd==-1)
+        return -1;
+
+    if(length<1 || length>max_len)
+        { fprintf(stderr,"** invalid length: %lu\n",(unsigned long)length); close(fd); return -1; }
+
+    int total=length/cfg::chunk_size;
+    if(length%cfg::chunk_size)
+        total++;
+
+    if(total>max_chunks)
+        { fprintf(stderr,"** too many chunks: %i, increase chunk size\n",total); close(fd); return -1; }
+
+    if(cfg::seq_id.empty())
+    {
+        char buf[64]; sprintf(buf,"%lu%u",(unsigned long)time(NULL),(unsigned)getpid());
+        cfg::seq_id=buf;
+    }
+
+    fprintf(stderr,"** seq-id: %s, length: %lu, chunks: %i\n",cfg::seq_id.c_str(),(unsigned long)length,total);
+
+    // заголовки собираются один раз, для каждого фрагмента меняются только значения
     stomp::frame f("SEND");
-    f.data.resize(10 * 1024 * 1024,'$');
-    f.hdrs["destination"]="test";
-    f.hdrs["seq-id"]="12345";
+    f.hdrs["destination"]=cfg::queue;
+    f.hdrs["seq-id"]=cfg::seq_id;
+
+    if(cfg::max_num>0)
+        { char buf[64]; sprintf(buf,"%i",cfg::max_num); f.hdrs["max-num"]=buf; }
+
+    std::list<chunk> window;
+
+    int next_id=1;
+    off_t offset=0;
+
+    int delay=0;                // текущая пауза перед отправкой (мс), растет пока брокер сигнализирует о заполнении
 
-    stomp::connection c;
+    stomp::frame r;
 
-    if(c.connect("127.0.0.1:40090"))
+    while(next_id<=total || !window.empty())
     {
-        if(c.login("admin",""))
+        int limit=delay>0?1:cfg::window;
+
+        // дозаполняем окно
+        if(next_id<=total && (int)window.size()<limit)
+        {
+            if(delay>0)
+                usleep(delay*1000);
+
+            window.push_back(chunk());
+
+            chunk& c=window.back();
+
+            c.id=next_id++;
+            c.offset=offset;
+
+            char buf[64]; sprintf(buf,"%i",c.id); c.receipt=buf;
+
+            int size=length-offset>cfg::chunk_size?cfg::chunk_size:length-offset;
+
+            if(read_chunk(fd,c,size)!=size)
+                { fprintf(stderr,"** unable to read chunk %i\n",c.id); close(fd); return -1; }
+
+            offset+=size;
+
+            if(!send_chunk(f,c,total,length))
+                { fprintf(stderr,"** unable to send chunk %i\n",c.id); close(fd); return -1; }
+
+            continue;
+        }
+
+        // окно заполнено (или все отправлено) - ждем подтверждения
+        {
+            alrm a(cfg::timeout);
+
+            if(!con.recv(r))
+                { fprintf(stderr,"** connection lost\n"); close(fd); return -1; }
+        }
+
+        if(r.command=="RECEIPT")
         {
-            for(int i=1;i<=max_num;i++)
-            {
-                char buf[256]; int n=sprintf(buf,"%i/%i",i,max_num);
+            const std::string& id=r.hdrs["receipt-id"];
 
-                f.hdrs["chunk-id"]=buf;
-printf("chunk-id: %s\n",buf);
+            std::list<chunk>::iterator it=window.begin();
 
-                int offset=(i-1)*f.data.size();
+            while(it!=window.end() && it->receipt!=id)
+                ++it;
 
-                n=sprintf(buf,"%i-%i/%i",offset,(int)(offset+f.data.size())-1,(int)(f.data.size()*max_num));
+            if(it==window.end())
+                continue;
 
-                f.hdrs["chunk-range"]=buf;
-printf("chunk-range: %s\n",buf);
+            window.erase(it);
 
-                if(!c.send(f))
-                    break;
-            }
+            // обратная связь от брокера: очередь назначения переполняется - снижаем темп
+            int queue_size=atoi(r.hdrs["queue-size"].c_str());
+
+            if(cfg::high_mark>0 && queue_size>=cfg::high_mark)
+                delay=delay?(delay*2>1000?1000:delay*2):10;
+            else
+                delay=0;
+        }else if(r.command=="ERROR")
+        {
+            // ERROR не содержит receipt-id, ответы приходят в порядке отправки
+            if(window.empty())
+                continue;
 
-            c.logout();
+            // переносим фрагмент в конец окна и отправляем повторно
+            window.splice(window.end(),window,window.begin());
+
+            chunk& c=window.back();
+
+            if(++c.retries>cfg::retries)
+                { fprintf(stderr,"** chunk %i is rejected: %s\n",c.id,r.data.c_str()); close(fd); return -1; }
+
+            if(cfg::verb)
+                fprintf(stderr,"** chunk %i: %s, retry %i\n",c.id,r.data.c_str(),c.retries);
+
+            delay=delay?(delay*2>1000?1000:delay*2):10;
+
+            usleep(delay*1000);
+
+            if(!send_chunk(f,c,total,length))
+                { fprintf(stderr,"** unable to send chunk %i\n",c.id); close(fd); return -1; }
         }
     }
 
+    close(fd);
+
     return 0;
 }
+
+int main(int argc,char** argv)
+{
+    int opt;
+    while((opt=getopt(argc,argv,"h?va:u:p:q:s:C:W:M:Q:R:T:"))>0)
+        switch(opt)
+        {
+        case 'h':
+        case '?':
+            fprintf(stderr,"USAGE: ./cftpush [-v] [-a host:port] [-u username] [-p passcode] [-q queue] [-s seq_id] [-C chunk_size] [-W window] [-M max_num] [-Q high_mark] [-R retries] [-T timeout] [file|-]\n"
+                "-W   number of unacknowledged chunks (1..%i, default %i)\n"
+                "-M   max-num for the destination queue\n"
+                "-Q   slow down while destination queue-size is above this value\n",max_window,cfg::window);
+            exit(0);
+        case 'v': cfg::verb=true; break;
+        case 'a': cfg::addr=optarg; break;
+        case 'u': cfg::username=optarg; break;
+        case 'p': cfg::passcode=optarg; break;
+        case 'q': cfg::queue=optarg; break;
+        case 's': cfg::seq_id=optarg; break;
+        case 'C': cfg::chunk_size=atoi(optarg); break;
+        case 'W': cfg::window=atoi(optarg); break;
+        case 'M': cfg::max_num=atoi(optarg); break;
+        case 'Q': cfg::high_mark=atoi(optarg); break;
+        case 'R': cfg::retries=atoi(optarg); break;
+        case 'T': cfg::timeout=atoi(optarg); break;
+        }
+
+    if(argc-optind>0)
+        cfg::filename=argv[optind];
+
+    if(cfg::chunk_size<1)
+        cfg::chunk_size=1024*1024;
+
+    if(cfg::window<1)
+        cfg::window=1;
+    else if(cfg::window>max_window)
+        cfg::window=max_window;
+
+    struct sigaction sig;
+    sig.sa_handler=__sig_handler;
+    sigfillset(&sig.sa_mask);
+    sig.sa_flags=0;
+
+    sigaction(SIGALRM,&sig,NULL);
+    sigaction(SIGINT,&sig,NULL);
+    sigaction(SIGQUIT,&sig,NULL);
+    sigaction(SIGTERM,&sig,NULL);
+
+    sig.sa_handler=SIG_IGN;
+    sigaction(SIGPIPE,&sig,NULL);
+    sigaction(SIGHUP,&sig,NULL);
+
+    int rc=-1;
+
+    fprintf(stderr,"** trying to establish connection...\n");
+
+    if(!login())
+    {
+        fprintf(stderr,"** connected\n");
+
+        rc=push();
+
+        fprintf(stderr,"** disconnecting...\n");
+
+        logout();
+    }
+
+    fprintf(stderr,rc?"** not sent\n":"** sent\n");
+
+    return rc?1:0;
+}
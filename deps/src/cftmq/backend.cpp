@@ -0,0 +1,526 @@
+#include "backend.h"
+#include <unistd.h>
+#include <string.h>
+#include <map>
+#include <kchashdb.h>
+
+#ifdef WITH_LMDB
+#include <lmdb.h>
+#endif
+
+#ifdef WITH_LEVELDB
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#endif
+
+namespace persist
+{
+    // Kyoto Cabinet (HashDB, TreeDB)
+    class kc_backend : public backend
+    {
+    protected:
+        kyotocabinet::BasicDB* db;
+    public:
+        kc_backend(kyotocabinet::BasicDB* _db):db(_db) {}
+
+        ~kc_backend(void) { close(false); delete db; }
+
+        bool open(const std::string& path, bool _sync)
+        {
+            if (!db->open(path, kyotocabinet::BasicDB::OWRITER|kyotocabinet::BasicDB::OCREATE)) {
+                return false;
+            }
+            sync = _sync;
+            location = path;
+            return true;
+        }
+
+        void close(bool _remove)
+        {
+            if (location.empty()) {
+                return;
+            }
+            db->close();
+            if (_remove) {
+                unlink(location.c_str());
+            }
+            location.clear();
+        }
+
+        int get(const char* key, size_t klen, char* buf, size_t max)
+            { return db->get(key, klen, buf, max); }
+
+        bool get(const std::string& key, std::string& value)
+            { return db->get(key, &value); }
+
+        bool set(const char* key, size_t klen, const char* value, size_t vlen)
+            { return db->set(key, klen, value, vlen); }
+
+        bool add(const char* key, size_t klen, const char* value, size_t vlen)
+            { return db->add(key, klen, value, vlen); }
+
+        bool remove(const std::string& key)
+            { return db->remove(key); }
+
+        bool begin(void)
+            { return db->begin_transaction(sync); }
+
+        bool end(bool commit)
+            { return db->end_transaction(commit); }
+
+        bool compact(int64_t step)
+        {
+            // освободившееся после удаления место HashDB и TreeDB возвращают в оборот только при дефрагментации
+            if (kyotocabinet::HashDB* h = dynamic_cast<kyotocabinet::HashDB*>(db)) {
+                return h->defrag(step);
+            }
+            if (kyotocabinet::TreeDB* t = dynamic_cast<kyotocabinet::TreeDB*>(db)) {
+                return t->defrag(step);
+            }
+            return true;
+        }
+
+        bool iterate(visitor& v)
+        {
+            kyotocabinet::DB::Cursor* cur = db->cursor();
+            if (!cur) {
+                return false;
+            }
+
+            cur->jump();
+
+            std::string key;
+            while (cur->get_key(&key, true)) {
+                v.visit(key.data(), key.length());
+            }
+
+            delete cur;
+
+            return true;
+        }
+    };
+
+#ifdef WITH_LMDB
+    // LMDB: все операции брокера идут из одного потока, поэтому держим одну пишущую транзакцию (begin/end)
+    // и одну читающую, которая переиспользуется через mdb_txn_reset/mdb_txn_renew
+    class lmdb_backend : public backend
+    {
+    protected:
+        MDB_env* env;
+        MDB_dbi dbi;
+        MDB_txn* txn;       // текущая пишущая транзакция
+        MDB_txn* rtxn;      // читающая транзакция вне begin/end
+        size_t mapsize;     // заданный размер отображения (0 - по умолчанию)
+
+        // максимальный размер БД: адресное пространство резервируется, место на диске - по мере заполнения
+        size_t map_size(void) { return mapsize ? mapsize : sizeof(size_t) > 4 ? (size_t) 64 << 30 : (size_t) 1 << 30; }
+
+        // транзакция для чтения: внутри begin/end - пишущая (видит свои изменения), иначе - читающая
+        MDB_txn* read_txn(void)
+        {
+            if (txn) {
+                return txn;
+            }
+            if (!rtxn) {
+                if (mdb_txn_begin(env, NULL, MDB_RDONLY, &rtxn)) {
+                    rtxn = NULL;
+                }
+            } else if (mdb_txn_renew(rtxn)) {
+                mdb_txn_abort(rtxn);
+                rtxn = NULL;
+            }
+            return rtxn;
+        }
+
+        void read_done(MDB_txn* t)
+        {
+            if (t == rtxn) {
+                mdb_txn_reset(rtxn);
+            }
+        }
+
+        // запись вне begin/end выполняется в отдельной транзакции
+        bool put(const char* key, size_t klen, const char* value, size_t vlen, unsigned int flags)
+        {
+            MDB_val k = { klen, (void*) key }, v = { vlen, (void*) value };
+
+            if (txn) {
+                return !mdb_put(txn, dbi, &k, &v, flags);
+            }
+
+            MDB_txn* t;
+            if (mdb_txn_begin(env, NULL, 0, &t)) {
+                return false;
+            }
+            if (mdb_put(t, dbi, &k, &v, flags)) {
+                mdb_txn_abort(t);
+                return false;
+            }
+            return !mdb_txn_commit(t);
+        }
+    public:
+        lmdb_backend(void):env(NULL),dbi(0),txn(NULL),rtxn(NULL),mapsize(0) {}
+
+        ~lmdb_backend(void) { close(false); }
+
+        void set_map_size(size_t n) { mapsize = n; }
+
+        bool open(const std::string& path, bool _sync)
+        {
+            if (mdb_env_create(&env)) {
+                env = NULL;
+                return false;
+            }
+
+            // без sync теряются только последние транзакции при сбое ОС, как у Kyoto Cabinet без hard транзакций
+            unsigned int flags = MDB_NOSUBDIR | MDB_NOTLS;
+            if (!_sync) {
+                flags |= MDB_NOSYNC | MDB_NOMETASYNC;
+            }
+
+            MDB_txn* t = NULL;
+            if (
+                mdb_env_set_mapsize(env, map_size())
+                || mdb_env_open(env, path.c_str(), flags, 0664)
+                || mdb_txn_begin(env, NULL, 0, &t)
+            ) {
+                mdb_env_close(env);
+                env = NULL;
+                return false;
+            }
+
+            if (mdb_dbi_open(t, NULL, 0, &dbi) || mdb_txn_commit(t)) {
+                mdb_env_close(env);
+                env = NULL;
+                return false;
+            }
+
+            sync = _sync;
+            location = path;
+            return true;
+        }
+
+        void close(bool _remove)
+        {
+            if (!env) {
+                return;
+            }
+            if (txn) {
+                mdb_txn_abort(txn);
+                txn = NULL;
+            }
+            if (rtxn) {
+                mdb_txn_abort(rtxn);
+                rtxn = NULL;
+            }
+            mdb_env_close(env);
+            env = NULL;
+
+            if (_remove) {
+                unlink(location.c_str());
+                unlink((location + "-lock").c_str());
+            }
+            location.clear();
+        }
+
+        int get(const char* key, size_t klen, char* buf, size_t max)
+        {
+            MDB_txn* t = read_txn();
+            if (!t) {
+                return -1;
+            }
+
+            MDB_val k = { klen, (void*) key }, v;
+            int rc = -1;
+
+            // значение лежит в странице отображенного файла и копируется сразу в буфер вызывающего
+            if (!mdb_get(t, dbi, &k, &v)) {
+                memcpy(buf, v.mv_data, v.mv_size < max ? v.mv_size : max);
+                rc = v.mv_size;
+            }
+
+            read_done(t);
+
+            return rc;
+        }
+
+        bool get(const std::string& key, std::string& value)
+        {
+            MDB_txn* t = read_txn();
+            if (!t) {
+                return false;
+            }
+
+            MDB_val k = { key.length(), (void*) key.data() }, v;
+            bool rc = false;
+
+            if (!mdb_get(t, dbi, &k, &v)) {
+                value.assign((const char*) v.mv_data, v.mv_size);
+                rc = true;
+            }
+
+            read_done(t);
+
+            return rc;
+        }
+
+        bool set(const char* key, size_t klen, const char* value, size_t vlen)
+            { return put(key, klen, value, vlen, 0); }
+
+        bool add(const char* key, size_t klen, const char* value, size_t vlen)
+            { return put(key, klen, value, vlen, MDB_NOOVERWRITE); }
+
+        bool remove(const std::string& key)
+        {
+            MDB_val k = { key.length(), (void*) key.data() };
+
+            if (txn) {
+                return !mdb_del(txn, dbi, &k, NULL);
+            }
+
+            MDB_txn* t;
+            if (mdb_txn_begin(env, NULL, 0, &t)) {
+                return false;
+            }
+            if (mdb_del(t, dbi, &k, NULL)) {
+                mdb_txn_abort(t);
+                return false;
+            }
+            return !mdb_txn_commit(t);
+        }
+
+        bool begin(void)
+        {
+            if (!env || txn) {
+                return false;
+            }
+            if (mdb_txn_begin(env, NULL, 0, &txn)) {
+                txn = NULL;
+                return false;
+            }
+            return true;
+        }
+
+        bool end(bool commit)
+        {
+            if (!txn) {
+                return false;
+            }
+
+            MDB_txn* t = txn;
+            txn = NULL;
+
+            if (!commit) {
+                mdb_txn_abort(t);
+                return true;
+            }
+
+            return !mdb_txn_commit(t);
+        }
+
+        bool iterate(visitor& v)
+        {
+            MDB_txn* t = read_txn();
+            if (!t) {
+                return false;
+            }
+
+            MDB_cursor* cur;
+            if (mdb_cursor_open(t, dbi, &cur)) {
+                read_done(t);
+                return false;
+            }
+
+            MDB_val k, d;
+            for (int op = MDB_FIRST; !mdb_cursor_get(cur, &k, &d, (MDB_cursor_op) op); op = MDB_NEXT) {
+                v.visit((const char*) k.mv_data, k.mv_size);
+            }
+
+            mdb_cursor_close(cur);
+            read_done(t);
+
+            return true;
+        }
+    };
+#endif /* WITH_LMDB */
+
+#ifdef WITH_LEVELDB
+    // LevelDB: транзакций нет, изменения между begin и end копятся в WriteBatch и пишутся атомарно,
+    // чтения внутри транзакции видят еще не записанные изменения через pending
+    class leveldb_backend : public backend
+    {
+    protected:
+        leveldb::DB* db;
+        leveldb::WriteBatch batch;
+        bool in_transaction;
+
+        // изменения текущей транзакции (value.first == false - ключ удален)
+        std::map<std::string, std::pair<bool, std::string> > pending;
+
+        leveldb::WriteOptions write_options(void)
+        {
+            leveldb::WriteOptions o;
+            o.sync = sync;
+            return o;
+        }
+    public:
+        leveldb_backend(void):db(NULL),in_transaction(false) {}
+
+        ~leveldb_backend(void) { close(false); }
+
+        bool open(const std::string& path, bool _sync)
+        {
+            leveldb::Options options;
+            options.create_if_missing = true;
+
+            if (!leveldb::DB::Open(options, path, &db).ok()) {
+                db = NULL;
+                return false;
+            }
+
+            sync = _sync;
+            location = path;
+            return true;
+        }
+
+        void close(bool _remove)
+        {
+            if (!db) {
+                return;
+            }
+            delete db;
+            db = NULL;
+            in_transaction = false;
+            pending.clear();
+            batch.Clear();
+
+            if (_remove) {
+                leveldb::DestroyDB(location, leveldb::Options());
+            }
+            location.clear();
+        }
+
+        int get(const char* key, size_t klen, char* buf, size_t max)
+        {
+            std::string value;
+            if (!get(std::string(key, klen), value)) {
+                return -1;
+            }
+            memcpy(buf, value.data(), value.length() < max ? value.length() : max);
+            return value.length();
+        }
+
+        bool get(const std::string& key, std::string& value)
+        {
+            if (in_transaction) {
+                std::map<std::string, std::pair<bool, std::string> >::iterator it = pending.find(key);
+                if (it != pending.end()) {
+                    if (!it->second.first) {
+                        return false;
+                    }
+                    value = it->second.second;
+                    return true;
+                }
+            }
+            return db->Get(leveldb::ReadOptions(), key, &value).ok();
+        }
+
+        bool set(const char* key, size_t klen, const char* value, size_t vlen)
+        {
+            leveldb::Slice k(key, klen), v(value, vlen);
+
+            if (!in_transaction) {
+                return db->Put(write_options(), k, v).ok();
+            }
+
+            batch.Put(k, v);
+            pending[k.ToString()] = std::make_pair(true, v.ToString());
+            return true;
+        }
+
+        bool add(const char* key, size_t klen, const char* value, size_t vlen)
+        {
+            std::string tmp;
+            if (get(std::string(key, klen), tmp)) {
+                return false;
+            }
+            return set(key, klen, value, vlen);
+        }
+
+        bool remove(const std::string& key)
+        {
+            if (!in_transaction) {
+                return db->Delete(write_options(), key).ok();
+            }
+
+            batch.Delete(key);
+            pending[key] = std::make_pair(false, std::string());
+            return true;
+        }
+
+        bool begin(void)
+        {
+            if (!db || in_transaction) {
+                return false;
+            }
+            in_transaction = true;
+            return true;
+        }
+
+        bool end(bool commit)
+        {
+            if (!in_transaction) {
+                return false;
+            }
+
+            bool rc = true;
+            if (commit) {
+                rc = db->Write(write_options(), &batch).ok();
+            }
+
+            in_transaction = false;
+            pending.clear();
+            batch.Clear();
+
+            return rc;
+        }
+
+        bool iterate(visitor& v)
+        {
+            leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+            if (!it) {
+                return false;
+            }
+
+            for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                v.visit(it->key().data(), it->key().size());
+            }
+
+            bool rc = it->status().ok();
+            delete it;
+
+            return rc;
+        }
+    };
+#endif /* WITH_LEVELDB */
+
+    backend* backend::create(const std::string& type)
+    {
+        if (type == "HashDB") {
+            return new kc_backend(new kyotocabinet::HashDB);
+        } else if (type == "TreeDB") {
+            return new kc_backend(new kyotocabinet::TreeDB);
+        }
+#ifdef WITH_LMDB
+        if (type == "LMDB") {
+            return new lmdb_backend;
+        }
+#endif
+#ifdef WITH_LEVELDB
+        if (type == "LevelDB") {
+            return new leveldb_backend;
+        }
+#endif
+        return NULL;
+    }
+}
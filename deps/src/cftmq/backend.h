@@ -0,0 +1,79 @@
+#ifndef __BACKEND_H
+#define __BACKEND_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+
+namespace persist
+{
+    // обход ключей хранилища (backend::iterate)
+    class visitor
+    {
+    public:
+        virtual ~visitor(void) {}
+
+        virtual void visit(const char* key,size_t klen)=0;
+    };
+
+    // движок хранения ключ-значение, на котором построены persist::storage и persist::queue
+    // (тип задается параметром db_type):
+    //   HashDB, TreeDB - Kyoto Cabinet
+    //   LMDB           - отображаемый в память B+tree, один писатель; значения копируются прямо из отображенных
+    //                    страниц, размер отображения - db_lmdb_mapsize (make LMDB=1)
+    //   LevelDB        - LSM дерево, выгоден на всплесках записи; путь к БД - каталог (make LEVELDB=1)
+    class backend
+    {
+    protected:
+        bool sync;
+
+        std::string location;
+    public:
+        backend(void):sync(false) {}
+
+        virtual ~backend(void) {}
+
+        // создать движок по имени типа (NULL - неизвестный тип или движок не включен при сборке)
+        static backend* create(const std::string& type);
+
+        // предельный размер БД, задается до open (LMDB; 0 - по умолчанию, остальным движкам не нужен)
+        virtual void set_map_size(size_t n) {}
+
+        // открыть (создать) БД, sync - принудительная синхронизация с диском при завершении каждой транзакции
+        virtual bool open(const std::string& path,bool sync)=0;
+
+        // закрыть БД (при необходимости с удалением ее файлов)
+        virtual void close(bool _remove=false)=0;
+
+        // прочитать значение в буфер, возвращает полный размер значения, -1 - нет такого ключа
+        virtual int get(const char* key,size_t klen,char* buf,size_t max)=0;
+
+        // прочитать значение
+        virtual bool get(const std::string& key,std::string& value)=0;
+
+        // записать значение
+        virtual bool set(const char* key,size_t klen,const char* value,size_t vlen)=0;
+
+        // записать значение, только если такого ключа еще нет
+        virtual bool add(const char* key,size_t klen,const char* value,size_t vlen)=0;
+
+        // удалить ключ
+        virtual bool remove(const std::string& key)=0;
+
+        // транзакция: изменения между begin и end(true) применяются атомарно, end(false) их отменяет
+        virtual bool begin(void)=0;
+        virtual bool end(bool commit)=0;
+
+        // обойти все ключи в порядке хранения
+        virtual bool iterate(visitor& v)=0;
+
+        // шаг дефрагментации файла после удаления записей (step - объем работы, вне транзакции);
+        // LMDB переиспользует свободные страницы сам, LevelDB уплотняет данные в фоне
+        virtual bool compact(int64_t step) { return true; }
+
+        bool set(const std::string& key,const std::string& value)
+            { return set(key.data(),key.length(),value.data(),value.length()); }
+    };
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Перевод персист-базы cftmq на упорядоченные ключи (см. persist::storage::convert_keys)
+ *
+ * Элементы очередей в старых БД хранятся под ключами с позицией в little-endian, в TreeDB соседние
+ * элементы очереди оказываются в разных листьях дерева. После перевода позиции записаны в big-endian
+ * вслед за индексом очереди, кольца становятся растущими очередями.
+ *
+ * Брокер должен быть остановлен. Перевод выполняется одной транзакцией: при сбое БД остается в старом виде.
+ *
+ * ./cftmq-convert -c cftmq.cfg           путь и тип БД из конфигурации брокера (persist_db, db_type, spool)
+ * ./cftmq-convert [-t TreeDB] queue.db
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "persist.h"
+#include "config.h"
+
+int main(int argc, char** argv)
+{
+    std::string cfg_path, path, type = "TreeDB";
+    bool help = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:h?")) > 0) {
+        switch (opt) {
+            case 'c': cfg_path = optarg; break;
+            case 't': type = optarg; break;
+            default: help = true; break;
+        }
+    }
+
+    if (!cfg_path.empty()) {
+        if (cfg::load(cfg_path)) {
+            fprintf(stderr, "can't load config file '%s'\n", cfg_path.c_str());
+            return 1;
+        }
+        path = cfg::p["persist_db"];
+        if (!cfg::p["db_type"].empty()) {
+            type = cfg::p["db_type"];
+        }
+        // путь к БД в конфигурации задается относительно spool
+        if (!path.empty() && path[0] != '/' && !cfg::p["spool"].empty()) {
+            std::string spool = cfg::p["spool"];
+            if (spool[spool.length() - 1] != '/') {
+                spool += '/';
+            }
+            path = spool + path;
+        }
+    } else if (optind < argc) {
+        path = argv[optind];
+    }
+
+    if (help || path.empty()) {
+        fprintf(stderr,
+            "Convert cftmq persist database to ordered (big-endian) queue keys\n\n"
+            "USAGE: ./cftmq-convert -c config_path\n"
+            "       ./cftmq-convert [-t db_type] db_path\n"
+            "-c   take persist_db and db_type from the broker config\n"
+            "-t   database type: TreeDB (default), HashDB, LMDB, LevelDB\n\n"
+            "Stop the broker first.\n");
+        return 1;
+    }
+
+    if (access(path.c_str(), F_OK)) {
+        fprintf(stderr, "'%s' not found\n", path.c_str());
+        return 1;
+    }
+
+    persist::storage s;
+    if (!s.open(path, type, 1)) {
+        fprintf(stderr, "can't open '%s' as %s\n", path.c_str(), type.c_str());
+        return 1;
+    }
+
+    if (s.ordered_keys()) {
+        printf("'%s' already uses ordered keys\n", path.c_str());
+        s.close();
+        return 0;
+    }
+
+    timeval tv0, tv1;
+    gettimeofday(&tv0, NULL);
+
+    long n = s.convert_keys();
+
+    gettimeofday(&tv1, NULL);
+    s.close();
+
+    if (n < 0) {
+        fprintf(stderr, "'%s' conversion failed, database left unchanged\n", path.c_str());
+        return 1;
+    }
+
+    printf(
+        "'%s': %ld messages converted in %.1f sec\n", path.c_str(), n,
+        (tv1.tv_sec - tv0.tv_sec) + (tv1.tv_usec - tv0.tv_usec) / 1e6
+    );
+
+    return 0;
+}
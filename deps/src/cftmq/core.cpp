@@ -17,6 +17,11 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <syslog.h>
+#ifdef __FreeBSD__
+#include <sys/uio.h>
+#else
+#include <sys/sendfile.h>
+#endif
 
 // Класс с методами ядра
 
@@ -34,6 +39,24 @@ namespace engine
         ((engine::core*)arg)->onsignal((int) fd);
     }
 
+	// Коллбэк таймера фонового удаления осиротевших элементов
+    void event_reclaim_callback_fn(evutil_socket_t fd, short events, void* arg)
+	{
+        ((engine::core*)arg)->onreclaim();
+    }
+
+	// Коллбэк таймера переноса колец в растущие очереди
+    void event_migrate_callback_fn(evutil_socket_t fd, short events, void* arg)
+	{
+        ((engine::core*)arg)->onmigrate();
+    }
+
+	// Коллбэк обработки придержанных фреймов
+    void event_resume_callback_fn(evutil_socket_t fd, short events, void* arg)
+	{
+        ((engine::core*)arg)->onresume();
+    }
+
 	// Коллбэк на входящее соединение
     void event_accept_callback_fn(evutil_socket_t fd, short events, void* arg)
 	{
@@ -46,6 +69,20 @@ namespace engine
         ((engine::connection*)arg)->parent->parent->onevent(fd, (engine::connection*) arg, events);
     }
 
+	// Отправка фрагмента файла в сокет без копирования через память процесса
+    static ssize_t send_file(int sock, int fd, off_t offset, size_t length)
+	{
+#ifdef __FreeBSD__
+        off_t sent = 0;
+        if (sendfile(fd, sock, offset, length, NULL, &sent, 0) == -1 && !sent) {
+            return -1;
+        }
+        return sent;
+#else
+        return sendfile(sock, fd, &offset, length);
+#endif
+    }
+
 	// Метод открывает логирование
     void openlog(const char* ident, const char* facility)
 	{
@@ -194,6 +231,10 @@ int engine::core::init(void)
     event_assign(&sig_usr2, evb,SIGUSR2, EV_SIGNAL|EV_PERSIST, event_signal_callback_fn, this);
     event_add(&sig_usr2, NULL);
 
+    evtimer_assign(&reclaim_ev, evb, event_reclaim_callback_fn, this);
+    evtimer_assign(&migrate_ev, evb, event_migrate_callback_fn, this);
+    evtimer_assign(&resume_ev, evb, event_resume_callback_fn, this);
+
     signal(SIGCHLD, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
@@ -203,15 +244,110 @@ int engine::core::init(void)
 // Метод открывает персист-базу
 int engine::core::open_persist_db(const std::string& path)
 {
+    pdb.set_map_size(db_lmdb_mapsize);
+
     if (!pdb.open(path, db_type, db_max_queue_size, false)) {
         return -1;
     }
 
-    log("open '%s' as persist queue", path.c_str());
+    log("open '%s' as persist queue (%s)", path.c_str(), db_type.c_str());
+
+    // крупные сообщения - в отдельных файлах, в БД только ссылки на них
+    if (!pdb.open_blobs(db_blob_dir, db_blob_threshold)) {
+        log("can't open '%s' as message file directory", db_blob_dir.c_str());
+        return -1;
+    }
+
+    if (!pdb.ordered_keys()) {
+        log("'%s' uses unordered queue keys, stop the broker and run cftmq-convert to speed up TreeDB", path.c_str());
+    }
+
+    // остатки сброшенных очередей и колец удаляются в фоне, порциями между итерациями цикла событий
+    if (db_reclaim_batch > 0) {
+        long n = pdb.scan_orphans();
+        if (n > 0) {
+            log("'%s': %li orphaned records found, reclaiming", path.c_str(), n);
+        }
+
+        timeval tv = { 0, 0 };
+        evtimer_add(&reclaim_ev, &tv);
+    }
+
+    // перенос колец, начатый до остановки брокера, продолжается с того же места
+    if (pdb.migrate_pending()) {
+        log("'%s': unfinished ring migration found, resuming", path.c_str());
+
+        timeval tv = { 0, 0 };
+        evtimer_add(&migrate_ev, &tv);
+    }
 
     return 0;
 }
 
+// Очередная порция фонового удаления осиротевших элементов
+void engine::core::onreclaim(void)
+{
+    int n = pdb.reclaim(db_reclaim_batch);
+
+    if (n < 0) {
+        log("reclaim failed");
+    } else {
+        reclaimed += n;
+    }
+
+    // пока есть работа - следующая порция на следующей итерации цикла событий, иначе проверки все реже
+    // (до раза в reclaim_idle_max секунд); новую работу (конец переноса колец) подталкивает kick_reclaim
+    timeval tv = { 0, 0 };
+    if (n >= 0 && pdb.reclaim_pending()) {
+        reclaim_idle = 0;
+    } else {
+        if (reclaimed) {
+            log("%llu orphaned records reclaimed", (unsigned long long) reclaimed);
+            reclaimed = 0;
+        }
+        reclaim_idle = reclaim_idle ? reclaim_idle * 2 : 1;
+        if (reclaim_idle > reclaim_idle_max) {
+            reclaim_idle = reclaim_idle_max;
+        }
+        tv.tv_sec = reclaim_idle;
+    }
+
+    evtimer_add(&reclaim_ev, &tv);
+}
+
+// Метод запускает фоновое удаление сразу (появились диапазоны к освобождению)
+void engine::core::kick_reclaim(void)
+{
+    if (db_reclaim_batch > 0) {
+        reclaim_idle = 0;
+        timeval tv = { 0, 0 };
+        evtimer_add(&reclaim_ev, &tv);
+    }
+}
+
+// Очередная порция переноса колец в растущие очереди (SYSTEM cmd=migrate)
+void engine::core::onmigrate(void)
+{
+    int n = pdb.migrate(db_migrate_batch);
+
+    if (n < 0) {
+        log("migrate failed");
+    } else {
+        migrated += n;
+    }
+
+    // следующая порция на следующей итерации цикла событий, после ошибки - через секунду
+    if (pdb.migrate_pending()) {
+        timeval tv = { n < 0 ? 1 : 0, 0 };
+        evtimer_add(&migrate_ev, &tv);
+    } else {
+        log("%llu ring records migrated", (unsigned long long) migrated);
+        migrated = 0;
+        unthrottle();
+        kick_reclaim();
+    }
+}
+
 // Метод открывает базу пользователей
 int engine::core::open_users_db(const std::string& path)
 {
@@ -245,6 +381,7 @@ void engine::core::done(void)
     }
 	// Закрытие сессий
     for (std::map<u_int32_t, connection*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        unsubscribe(it->second);
         it->second->close();
     }
 
@@ -259,6 +396,9 @@ void engine::core::done(void)
     event_del(&sig_hup);
     event_del(&sig_usr1);
     event_del(&sig_usr2);
+    event_del(&reclaim_ev);
+    event_del(&migrate_ev);
+    event_del(&resume_ev);
 
     event_base_free(evb);
     evb = NULL;
@@ -271,15 +411,210 @@ void engine::core::done(void)
 // Метод сбрасывает событие
 void engine::core::event_reset(connection* c, short event)
 {
+    c->want_event = event;
+
+    // у приостановленного отправителя придержано слишком много - не читаем, пока очередь назначения не разгрузится
+    if (held_full(c)) {
+        event &= ~EV_READ;
+    }
+
     if (event == c->last_event) {
         return;
     }
     c->last_event = event;
     event_del(&c->ev);
+
+    if (!event) {
+        return;
+    }
+
     event_assign(&c->ev, evb, c->fd, event|EV_PERSIST, event_callback_fn, c);
     event_add(&c->ev, NULL);
 }
 
+// Метод задает пороги заполнения очереди
+void engine::core::set_watermark(const std::string& qname, u_int32_t high, u_int32_t low)
+{
+    watermark w;
+
+    w.high = high;
+    // если нижний порог не задан или некорректен, берем 3/4 от верхнего
+    w.low = (low > 0 && low < high) ? low : high - high / 4;
+
+    if (qname.empty()) {
+        default_watermark = w;
+    } else {
+        watermarks[qname] = w;
+    }
+}
+
+// Метод возвращает пороги заполнения для очереди
+const engine::watermark& engine::core::get_watermark(const std::string& qname)
+{
+    std::map<std::string, watermark>::const_iterator it = watermarks.find(qname);
+
+    if (it != watermarks.end()) {
+        return it->second;
+    }
+
+    return default_watermark;
+}
+
+// Метод приостанавливает чтение от отправителя
+void engine::core::throttle(const std::string& qname, connection* c)
+{
+    if (!c->throttled.insert(qname).second) {
+        // уже приостановлен из-за этой очереди
+        return;
+    }
+
+    throttled[qname].push_back(c);
+
+    if (c->throttled.size() == 1) {
+        log(
+            "throttle '%s' on '%s' (sid=%u, addr='%s')",
+            c->identity.c_str(), qname.c_str(), c->session, c->addr.c_str()
+        );
+        event_reset(c, c->want_event);
+    }
+}
+
+// Метод возобновляет чтение от отправителей, если очередь опустилась ниже нижнего порога
+void engine::core::unthrottle(const std::string& qname, persist::queue& q)
+{
+    std::map<std::string, std::list<connection*> >::iterator it = throttled.find(qname);
+
+    if (it == throttled.end()) {
+        return;
+    }
+
+    if (q.size() > get_watermark(qname).low) {
+        return;
+    }
+
+    std::list<connection*> lst;
+    lst.swap(it->second);
+    throttled.erase(it);
+
+    for (std::list<connection*>::iterator i = lst.begin(); i != lst.end(); ++i) {
+        connection* p = *i;
+
+        p->throttled.erase(qname);
+
+        if (p->throttled.empty()) {
+            log(
+                "resume '%s' on '%s' (sid=%u, addr='%s')",
+                p->identity.c_str(), qname.c_str(), p->session, p->addr.c_str()
+            );
+
+            // придержанные фреймы - на следующей итерации цикла событий, не внутри обработки чужого фрейма
+            if (!p->held.empty()) {
+                resumed.insert(p->session);
+                timeval tv = { 0, 0 };
+                evtimer_add(&resume_ev, &tv);
+            }
+        }
+    }
+}
+
+// Метод проверяет нижний порог всех очередей с приостановленными отправителями (очереди меняются не только чтением подписок)
+void engine::core::unthrottle(void)
+{
+    std::list<std::string> names;
+
+    for (std::map<std::string, std::list<connection*> >::iterator it = throttled.begin(); it != throttled.end(); ++it) {
+        names.push_back(it->first);
+    }
+
+    for (std::list<std::string>::iterator it = names.begin(); it != names.end(); ++it) {
+        persist::queue q;
+        if (pdb.find_queue_by_name(*it, q)) {
+            unthrottle(*it, q);
+        }
+    }
+}
+
+// Метод удаляет отправителя из списков приостановленных
+void engine::core::unthrottle(connection* c)
+{
+    for (std::set<std::string>::iterator it = c->throttled.begin(); it != c->throttled.end(); ++it) {
+        std::map<std::string, std::list<connection*> >::iterator i = throttled.find(*it);
+
+        if (i != throttled.end()) {
+            i->second.remove(c);
+
+            if (i->second.empty()) {
+                throttled.erase(i);
+            }
+        }
+    }
+
+    c->throttled.clear();
+    c->held.clear();
+    c->held_bytes = 0;
+    resumed.erase(c->session);
+}
+
+// Метод придерживает фрейм приостановленного отправителя
+void engine::core::hold(connection* c, const std::string& command, const std::list<std::string>& headers, std::string& data)
+{
+    c->held.push_back(held_frame());
+
+    held_frame& f = c->held.back();
+    f.command = command;
+    f.headers = headers;
+    f.data.swap(data);
+
+    c->held_bytes += f.data.length();
+
+    // придержано много - дальше отправителя сдерживает TCP
+    if (held_full(c)) {
+        event_reset(c, c->want_event);
+    }
+}
+
+// Метод обрабатывает придержанные фреймы, пока отправитель снова не упрется в переполненную очередь
+void engine::core::resume(connection* c)
+{
+    c->resuming = true;
+
+    // как и при разборе из сокета: ошибка обработки закрывает соединение, после ответа с закрытием
+    // остальные фреймы не обрабатываются
+    while (c->throttled.empty() && !c->held.empty() && !c->eof && !c->closing) {
+        held_frame f;
+        std::swap(f, c->held.front());
+        c->held.pop_front();
+        c->held_bytes -= f.data.length();
+
+        if (onstomp(f.command, f.headers, f.data, c)) {
+            c->eof = true;
+        }
+    }
+
+    c->resuming = false;
+
+    if (c->eof) {
+        close(c);
+    } else {
+        event_reset(c, c->want_event);
+    }
+}
+
+// Метод обрабатывает придержанные фреймы отправителей, возобновленных unthrottle (таймер resume_ev)
+void engine::core::onresume(void)
+{
+    std::set<u_int32_t> lst;
+    lst.swap(resumed);
+
+    for (std::set<u_int32_t>::iterator it = lst.begin(); it != lst.end(); ++it) {
+        std::map<u_int32_t, connection*>::iterator i = sessions.find(*it);
+
+        if (i != sessions.end()) {
+            resume(i->second);
+        }
+    }
+}
+
 // Метод прослушивает входящее соединение
 int engine::core::listen(const std::string& addr)
 {
@@ -425,7 +760,8 @@ int engine::core::__onevent(int fd, engine::connection* p, short events)
 {
     if (events & EV_READ) {
         // не стоит читать от одного клиента до бесконечности, ограничимся 4к (4*1024)
-        for (int i = 0; i < 4 && !p->eof; i++) {
+        // у приостановленного отправителя, придержавшего слишком много SEND, больше не читаем, даже если в сокете что-то есть
+        for (int i = 0; i < 4 && !p->eof && !held_full(p); i++) {
             char buf[1024];
             ssize_t n = read(fd, buf, sizeof(buf));
             if (n == (ssize_t) - 1) {
@@ -445,7 +781,7 @@ int engine::core::__onevent(int fd, engine::connection* p, short events)
     if (!p->eof && events & EV_WRITE) {
         bool again = false;
         while(!again && !p->eof) {
-            if (p->buffer.empty()) {
+            if (p->buffer.empty() && p->blob_fd == -1) {
                 u_int32_t flags = 0;
 
                 if (p->queue_out.pop_back(p->buffer, &flags)) {
@@ -453,6 +789,19 @@ int engine::core::__onevent(int fd, engine::connection* p, short events)
                     if (flags & flag_close_after_finish) {
                         p->close_after_finish = true;
                     }
+
+                    if (persist::blobs::is_ref(p->buffer)) {
+                        // сообщение в файле: отдаем его через sendfile, из buffer остается только завершающий '\0'
+                        p->blob_sent = 0;
+                        p->blob_fd = pdb.open_blob(p->buffer, p->blob_length);
+                        p->buffer.clear();
+
+                        if (p->blob_fd == -1) {
+                            log("message file is missing, close connection to '%s'", p->addr.c_str());
+                            p->buffer = "ERROR\ncontent-type:text/plain\n\nMessage is lost\n";
+                            p->close_after_finish = true;
+                        }
+                    }
                 } else {
                     // ничего нет - засыпаем для этого клиента до пинка
                     event_reset(p, EV_READ);
@@ -460,6 +809,27 @@ int engine::core::__onevent(int fd, engine::connection* p, short events)
                 }
             }
 
+            while(!p->eof && p->blob_fd != -1 && p->blob_sent < p->blob_length) {
+                ssize_t n = send_file(p->fd, p->blob_fd, p->blob_sent, p->blob_length - p->blob_sent);
+                if (n == (ssize_t) -1) {
+                    if (errno == EAGAIN) {
+                        again = true;
+                        break;
+                    } else {
+                        p->eof = true;
+                    }
+                } else if (!n) {
+                    // файл короче, чем записано в ссылке
+                    p->eof = true;
+                } else {
+                    p->blob_sent += n;
+                }
+            }
+
+            if (again || p->eof) {
+                break;
+            }
+
             const char* ptr = p->buffer.c_str();
 
             int length = p->buffer.length() + 1;
@@ -485,6 +855,10 @@ int engine::core::__onevent(int fd, engine::connection* p, short events)
             if (p->bytes_sent >= length) {
                 // сообщение отправленно полностью
                 p->buffer.clear();
+                if (p->blob_fd != -1) {
+                    ::close(p->blob_fd);
+                    p->blob_fd = -1;
+                }
                 if (p->close_after_finish) {
                     // если была команда закрыть соединение - закрываем, в противном случае
                     // возвращаемся и смотрим нет ли еще сообщений
@@ -516,6 +890,11 @@ int engine::core::post_reply(engine::connection* c, const std::string& data, boo
 
     std::string s(data);
 
+    // после такого ответа фреймы клиента больше не обрабатываются (придержанные - resume)
+    if (close_after_finish) {
+        c->closing = true;
+    }
+
     if (c->queue_out.push_front(s, flags)) {
         event_reset(c, EV_READ | EV_WRITE);
     }
@@ -532,16 +911,19 @@ bool engine::core::subscribe(const std::string& qname, connection* c, persist::q
         return false;
     }
 
-    std::map<std::string,persist::queue>::const_iterator it = c->subs.find(qname);
+    std::map<std::string,persist::readahead>::const_iterator it = c->subs.find(qname);
 
-    if (it! = c->subs.end()) {
+    if (it != c->subs.end()) {
         // уже подписан
         return false;
     }
 
-    c->subs[qname] = q;
+    c->subs[qname].attach(q);
     subs[qname].push_back(c);
 
+    // в очереди может быть накопившееся
+    c->set_ready(qname);
+
     if (_q) {
         *_q = q;
     }
@@ -554,25 +936,88 @@ void engine::core::close(connection* p)
 {
     log("close connection to '%s'", p->addr.c_str());
     unsubscribe(p);
+    unthrottle(p);
     p->close();
-    delete p;
     sessions.erase(p->session);
+    delete p;
+}
+
+// Метод отмечает очередь непустой у всех ее подписчиков
+void engine::core::set_ready(const std::string& qname)
+{
+    std::map<std::string, std::list<connection*> >::iterator it = subs.find(qname);
+
+    if (it == subs.end()) {
+        return;
+    }
+
+    for (std::list<connection*>::iterator i = it->second.begin(); i != it->second.end(); ++i) {
+        (*i)->set_ready(qname);
+    }
+}
+
+// Метод отдает очередное сообщение подписки клиенту, если тот готов его принять
+bool engine::core::deliver(const std::string& qname, connection* c)
+{
+    std::map<std::string,persist::readahead>::iterator it = c->subs.find(qname);
+    std::string s;
+
+    if (c->st != st_ready || it == c->subs.end() || !it->second.pop(s, db_readahead, db_readahead_bytes)) {
+        return false;
+    }
+
+    unthrottle(qname, it->second.get_queue());
+    c->inflight = qname;
+
+    if (c->queue_out.push_front(s)) {
+        event_reset(c, EV_READ | EV_WRITE);
+        c->st = st_wait_for_ack;
+    }
+
+    return true;
+}
+
+// Метод будит простаивающих подписчиков очереди (ACK от них не придет, а в очереди снова есть сообщения)
+void engine::core::wakeup(const std::string& qname)
+{
+    std::map<std::string, std::list<connection*> >::iterator it = subs.find(qname);
+
+    if (it == subs.end()) {
+        return;
+    }
+
+    for (std::list<connection*>::iterator i = it->second.begin(); i != it->second.end(); ++i) {
+        deliver(qname, *i);
+    }
 }
 
 // Метод отписки от очереди
 bool engine::core::unsubscribe(const std::string& qname, connection* c)
 {
-    std::map<std::string,persist::queue>::iterator it = c->subs.find(qname);
+    std::map<std::string,persist::readahead>::iterator it = c->subs.find(qname);
 
     if (it == c->subs.end()) {
         // не подписан
         return false;
     }
 
+    // неподтвержденные сообщения упреждающего чтения возвращаются в очередь
+    it->second.release();
+    unthrottle(qname, it->second.get_queue());
+    if (c->inflight == qname) {
+        c->inflight.clear();
+    }
+
     c->subs.erase(it);
+    c->ready.remove(qname);
+    c->ready_set.erase(qname);
     // не очень оптимально при большом количестве подписчиков (чего никогда не будет)
     subs[qname].remove(c);
 
+    // возвращенные сообщения достанутся другим подписчикам
+    set_ready(qname);
+    wakeup(qname);
+
     return true;
 }
 
@@ -580,14 +1025,21 @@ bool engine::core::unsubscribe(const std::string& qname, connection* c)
 bool engine::core::unsubscribe(connection* c)
 {
     for (
-        std::map<std::string, persist::queue>::iterator it = c->subs.begin();
+        std::map<std::string, persist::readahead>::iterator it = c->subs.begin();
         it != c->subs.end();
         ++it
     ) {
+        it->second.release();
+        unthrottle(it->first, it->second.get_queue());
         subs[it->first].remove(c);
+        set_ready(it->first);
+        wakeup(it->first);
     }
 
     c->subs.clear();
+    c->inflight.clear();
+    c->ready.clear();
+    c->ready_set.clear();
 
     return true;
 }
@@ -602,6 +1054,16 @@ int engine::core::onstomp(
     connection* c = (connection*) ctx;
     std::map<std::string, std::string> hdr;
 
+    // от приостановленного отправителя SEND (и все последующее, чтобы не нарушить порядок) придерживаем
+    // до разгрузки очереди; ACK обрабатываем сразу - отправитель может быть и подписчиком
+    if (
+        c->st != st_wait_for_login && !c->resuming && command != "ACK"
+        && (!c->held.empty() || (command == "SEND" && !c->throttled.empty()))
+    ) {
+        hold(c, command, headers, data);
+        return 0;
+    }
+
     // парсим заголовки в мэп hdr
     for (
         std::list<std::string>::const_iterator it = headers.begin();
@@ -761,7 +1223,7 @@ int engine::core::onstomp(
 
             char temp[256];
             int n = snprintf(
-                emp, sizeof(temp),
+                temp, sizeof(temp),
                 "reply-to:%s%u\nmessage-id:%s\nsource:%s\nsource-ip:%s\ncontent-length:%lu\n",
                 sid_tag, c->session, (mid = getmessid()).c_str(), c->identity.c_str(), c->addr.c_str(),
                 data.length()
@@ -797,6 +1259,17 @@ int engine::core::onstomp(
 						// ищем очередь (если ее нет, то она создается)
 						// кладем сообщение на долговременное хранение и забываем про него
 						ok = q.push_front(s, max_num, &cur_num);
+
+						// подписчики заберут сообщение после подтверждения текущего
+						if (ok) {
+							set_ready(destination);
+						}
+
+						// очередь достигла верхнего порога (или переполнена) - перестаем читать от отправителя
+						const watermark& w = get_watermark(destination);
+						if (w.high > 0 && (ok ? (u_int32_t) cur_num : q.size()) >= w.high) {
+							throttle(destination, c);
+						}
 					}
 				}
 			}
@@ -817,18 +1290,36 @@ int engine::core::onstomp(
         // что именно подтвердили не важно т.к. мы отдаем сообщения только поштучно
         if (c->st == st_wait_for_ack) {
             c->st = st_ready;
+
+            // подтверждено сообщение из подписки - его можно удалять из БД
+            if (!c->inflight.empty()) {
+                std::map<std::string,persist::readahead>::iterator it = c->subs.find(c->inflight);
+                if (it != c->subs.end()) {
+                    it->second.ack();
+                }
+                c->inflight.clear();
+            }
+
             std::string s;
             if (!c->queue.pop_back(s)) {
-                // сначала ищем в приватной очереди сессии
-                for (
-                    std::map<std::string,persist::queue>::iterator it = c->subs.begin();
-                    t != c->subs.end();
-                    ++it
-                ) {
-                    if (it->second.pop_back(s)) {
-                        // если там пусто, то бежим по всем подпискам пока не найдем где-нибудь чего-нибудь
+                // сначала ищем в приватной очереди сессии, если там пусто - по кругу среди подписок,
+                // в очередях которых есть сообщения (опустевшие выбывают до следующей записи в очередь)
+                while (!c->ready.empty()) {
+                    std::string qname;
+                    qname.swap(c->ready.front());
+                    c->ready.pop_front();
+
+                    std::map<std::string,persist::readahead>::iterator it = c->subs.find(qname);
+
+                    if (it != c->subs.end() && it->second.pop(s, db_readahead, db_readahead_bytes)) {
+                        unthrottle(it->first, it->second.get_queue());
+                        c->inflight = it->first;
+                        // в конец круга, следующей будет другая подписка
+                        c->ready.push_back(qname);
                         break;
                     }
+
+                    c->ready_set.erase(qname);
                 }
             }
 
@@ -878,15 +1369,9 @@ int engine::core::onstomp(
                         c->identity.c_str(), destination.c_str(), c->session, c->addr.c_str()
                     );
 
-                    if (c->st == st_ready) {
-                        // если готов принимать сообщения, то сразу заглядываем в эту очередь
-                        // и выгребаем очередное сообщение
-                        std::string s;
-                        if (q.pop_back(s) && c->queue_out.push_front(s)) {
-                            event_reset(c, EV_READ | EV_WRITE);
-                            c->st = st_wait_for_ack;
-                        }
-                    }
+                    // если готов принимать сообщения, то сразу заглядываем в эту очередь
+                    // и выгребаем очередное сообщение
+                    deliver(destination, c);
                 }
             }
 
@@ -933,7 +1418,40 @@ int engine::core::onstomp(
             } else if (cmd == "count") {
                 ss << pdb.size() << '\n';
             } else if (cmd == "size") {
+                // arg - список очередей через запятую, если не задан - все очереди
                 const std::string& arg = hdr["arg"];
+                if (arg.empty()) {
+                    pdb.list_sizes(ss);
+                }
+                for(std::string::size_type p1 = 0, p2; p1 != std::string::npos; p1 = p2) {
+                    std::string name;
+                    p2 = arg.find(',', p1);
+                    if (p2 != std::string::npos) {
+                        name = arg.substr(p1, p2 - p1);
+                        p2++;
+                    } else {
+                        name = arg.substr(p1);
+                    }
+                    if (!name.empty()) {
+                        // несуществующая очередь не создается, ее размер 0
+                        persist::queue q;
+                        pdb.find_queue_by_name(name, q);
+                        ss << name << ' ' << q.size() << '\n';
+                    }
+                }
+            } else if (cmd == "migrate") {
+                // перевод очередей-колец из старых БД в растущие очереди (без остановки брокера): очереди ставятся
+                // в список, элементы переносятся в фоне порциями между итерациями цикла событий (onmigrate)
+                // arg - список очередей через запятую, если не задан - все очереди
+                std::string arg = hdr["arg"];
+                if (arg.empty()) {
+                    std::stringstream names;
+                    pdb.list(names);
+                    std::string name;
+                    while (std::getline(names, name)) {
+                        arg += name + ',';
+                    }
+                }
                 for(std::string::size_type p1 = 0, p2; p1 != std::string::npos; p1 = p2) {
                     std::string name;
                     p2 = arg.find(',', p1);
@@ -945,11 +1463,17 @@ int engine::core::onstomp(
                     }
                     if (!name.empty()) {
                         persist::queue q;
-                        if (pdb.get_queue_by_name(name,q)) {
-                            ss << name << ' ' << q.size() << '\n';
+                        if (pdb.get_queue_by_name(name, q)) {
+                            int n = q.migrate();
+                            log("migrate '%s': %i", name.c_str(), n);
+                            ss << name << ' ' << n << '\n';
                         }
                     }
                 }
+                if (pdb.migrate_pending() && !evtimer_pending(&migrate_ev, NULL)) {
+                    timeval tv = { 0, 0 };
+                    evtimer_add(&migrate_ev, &tv);
+                }
             }
 
             post_reply(c, ss.str(), false);
@@ -9,6 +9,7 @@
 #include <sstream>
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <event2/event.h>
 #include <event2/event_struct.h>
@@ -72,6 +73,14 @@ namespace engine
         st_wait_for_ack         = 3                                             // ожидание подтверждения последнего сообщения
     };
 
+    // фрейм, придержанный у приостановленного отправителя до разгрузки очереди
+    struct held_frame
+    {
+        std::string command;
+        std::list<std::string> headers;
+        std::string data;
+    };
+
     class connection
     {
     public:
@@ -80,6 +89,7 @@ namespace engine
         stomp::parser proto;                                                    // парсер STOMP
 
         short last_event;                                                       // кэш что б лишний раз не переустанавливать события
+        short want_event;                                                       // события, запрошенные последним event_reset (без учета приостановки)
 
         int st;                                                                 // состояние сессии
         int fd;                                                                 // сокет клиента
@@ -91,21 +101,45 @@ namespace engine
 
         std::string buffer;                                                     // текущее отправляемое сообщение
         int bytes_sent;                                                         // количество отправленных из buffer данных
+        int blob_fd;                                                            // файл отправляемого сообщения, вынесенного из БД (-1 - нет), из buffer - только завершающий '\0'
+        off_t blob_sent;                                                        // отправлено из файла (sendfile)
+        off_t blob_length;                                                      // длина сообщения в файле
         bool close_after_finish;                                                // после отправки текущего сообщения завершить сессию
         bool eof;                                                               // закрыть соединение при первой возможноти
 
         u_int32_t perm;                                                         // права доступа
 
-        std::map<std::string,persist::queue> subs;                              // на какие очереди подписан клиент (key=имя очереди, value=пара: id подписки, очередь)
+        std::map<std::string,persist::readahead> subs;                          // на какие очереди подписан клиент (key=имя очереди, value=очередь с упреждающим чтением)
+        std::string inflight;                                                   // подписка, из которой отдано неподтвержденное сообщение (пусто - не из подписки)
+        std::list<std::string> ready;                                           // подписки, в очередях которых могут быть сообщения, в порядке обхода по кругу
+        std::set<std::string> ready_set;                                        // то же множеством (без повторов в ready)
 
-        connection(void):parent(NULL),last_event(0),st(0),fd(-1),session(0),bytes_sent(0),close_after_finish(false),eof(false),perm(0) {}
+        std::set<std::string> throttled;                                        // переполненные очереди, из-за которых приостановлен прием SEND от клиента
+        std::list<held_frame> held;                                             // придержанные фреймы (SEND и все, что пришло после него, кроме ACK)
+        size_t held_bytes;                                                      // их объем (от core::hold_bytes чтение от клиента прекращается)
+        bool resuming;                                                          // идет обработка придержанных фреймов
+        bool closing;                                                           // отправлен ответ с закрытием сессии, дальше фреймы не обрабатываются
+
+        connection(void):parent(NULL),last_event(0),want_event(EV_READ),st(0),fd(-1),session(0),bytes_sent(0),blob_fd(-1),blob_sent(0),blob_length(0),close_after_finish(false),eof(false),perm(0),held_bytes(0),resuming(false),closing(false) {}
 
         int set_role(const std::string& s);                                     // установить права доступа (nolimit, push, pull, proxy, router)
 
         void to_close(void) { eof=true; }
 
+        void set_ready(const std::string& qname)                                // в очереди подписки появились сообщения
+            { if (ready_set.insert(qname).second) ready.push_back(qname); }
+
         void close(void)
-            { event_del(&ev); ::close(fd); proto.end(); }
+            { event_del(&ev); ::close(fd); proto.end(); if (blob_fd != -1) ::close(blob_fd); }
+    };
+
+    // пороги заполнения очереди для управления потоком от отправителей
+    struct watermark
+    {
+        u_int32_t high;                                                         // при достижении перестаем читать от отправителя (0 - без ограничения)
+        u_int32_t low;                                                          // при снижении до этого уровня возобновляем чтение
+
+        watermark(void):high(0),low(0) {}
     };
 
     class core : public stomp::callback
@@ -115,6 +149,16 @@ namespace engine
 
         event sig_int,sig_quit,sig_term,sig_hup,sig_usr1,sig_usr2;
 
+        enum { reclaim_idle_max=64 };                                           // самый редкий интервал проверки (секунды)
+
+        event reclaim_ev;                                                       // таймер фонового удаления осиротевших элементов
+        event resume_ev;                                                        // обработка придержанных фреймов возобновленных отправителей
+        std::set<u_int32_t> resumed;                                            // их сессии
+        u_int64_t reclaimed;                                                    // удалено элементов в текущем проходе
+        int reclaim_idle;                                                       // интервал проверки, пока удалять нечего (секунды)
+        event migrate_ev;                                                       // таймер переноса колец в растущие очереди порциями
+        u_int64_t migrated;                                                     // перенесено элементов в текущем проходе
+
         std::list<listener> listeners;                                          // список прослушивающих сокетов
         std::map<u_int32_t,connection*> sessions;                               // список всех активных сессий
         persist::storage pdb;                                                   // база данных с очередями
@@ -122,9 +166,37 @@ namespace engine
 
         std::map<std::string, std::list<connection*> > subs;                    // список подписчиков на каждую очередь (key=имя очереди, value=список подписчиков)
 
+        watermark default_watermark;                                            // пороги по умолчанию
+        std::map<std::string, watermark> watermarks;                            // пороги для отдельных очередей
+        std::map<std::string, std::list<connection*> > throttled;               // приостановленные отправители (key=имя очереди, value=список отправителей)
+
+        const watermark& get_watermark(const std::string& qname);               // пороги для очереди
+
+        void throttle(const std::string& qname,connection* c);                  // приостановить чтение от отправителя в переполненную очередь
+
+        void unthrottle(const std::string& qname,persist::queue& q);            // возобновить чтение от отправителей, если очередь разгрузилась
+
+        void unthrottle(void);                                                  // то же для всех очередей с приостановленными отправителями
+
+        void unthrottle(connection* c);                                         // забыть об отправителе (при дисконнекте)
+
+        void hold(connection* c,const std::string& command,                     // придержать фрейм приостановленного отправителя
+            const std::list<std::string>& headers,std::string& data);
+
+        void resume(connection* c);                                             // обработать придержанные фреймы
+
+        bool held_full(connection* c)                                           // придержано не меньше hold_bytes - чтение от клиента прекращается
+            { return !c->held.empty() && c->held_bytes >= hold_bytes; }
+
         bool subscribe(const std::string& qname,                                // подписать клиента на очередь
             connection* c,persist::queue* _q=NULL);
 
+        void set_ready(const std::string& qname);                               // отметить очередь непустой у всех ее подписчиков
+
+        bool deliver(const std::string& qname,connection* c);                   // отдать готовому клиенту очередное сообщение подписки
+
+        void wakeup(const std::string& qname);                                  // раздать сообщения очереди простаивающим подписчикам
+
         bool unsubscribe(const std::string& qname,connection* c);               // отписать клиента от очереди
 
         bool unsubscribe(connection* c);                                        // отписать клиента от всех очередей (при дисконнекте)
@@ -139,14 +211,24 @@ namespace engine
         int __onevent(int fd,connection* p,short events);
     public:
         int db_max_queue_size;
+        int db_reclaim_batch;                                                   // элементов за одну итерацию фонового удаления (0 - не удалять)
+        int db_migrate_batch;                                                   // элементов за одну итерацию переноса колец (SYSTEM cmd=migrate)
+        int db_readahead;                                                       // сообщений в пачке упреждающего чтения подписки
+        size_t db_readahead_bytes;                                              // ограничение пачки по объему
+        size_t hold_bytes;                                                      // сколько SEND придерживать у приостановленного отправителя, не переставая читать
+        size_t db_lmdb_mapsize;                                                 // предельный размер БД LMDB (0 - по умолчанию: 64 ГБ)
+        size_t db_blob_threshold;                                               // сообщения от этого размера хранятся в файлах вне БД (0 - в БД)
+        std::string db_blob_dir;                                                // каталог этих файлов
         std::string db_type;
         int backlog;
         bool no_login;
     public:
-        core(void):evb(NULL),db_max_queue_size(1024),db_type("TreeDB"),backlog(5),no_login(false) {}
+        core(void):evb(NULL),reclaimed(0),reclaim_idle(0),migrated(0),db_max_queue_size(1024),db_reclaim_batch(1000),db_migrate_batch(1000),db_readahead(32),db_readahead_bytes(4 << 20),hold_bytes(4 << 20),db_lmdb_mapsize(0),db_blob_threshold(256 << 10),db_blob_dir("blobs"),db_type("TreeDB"),backlog(5),no_login(false) {}
 
         int init(void);
 
+        void set_watermark(const std::string& qname,u_int32_t high,u_int32_t low);  // задать пороги (пустое имя - по умолчанию)
+
         int open_persist_db(const std::string& path);
         int open_users_db(const std::string& path);
 
@@ -158,6 +240,10 @@ namespace engine
         void done(void);
 
         int onsignal(int sig);
+        void onreclaim(void);
+        void kick_reclaim(void);
+        void onmigrate(void);
+        void onresume(void);
         int onaccept(int fd,listener* p);
         int onevent(int fd,connection* p,short events);
         int onstomp(const std::string& command,const std::list<std::string>& headers,std::string& data,void* ctx);
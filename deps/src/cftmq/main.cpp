@@ -183,6 +183,53 @@ int main(int argc,char** argv)
         }
 		// Задать тип базы данных
         core.db_type=cfg::p["db_type"];
+		// Задать предельный размер БД LMDB
+        if (!cfg::p["db_lmdb_mapsize"].empty()) {
+            core.db_lmdb_mapsize = atol(cfg::p["db_lmdb_mapsize"].c_str());
+        }
+		// Задать размер порции фонового удаления осиротевших элементов
+        if (!cfg::p["db_reclaim_batch"].empty()) {
+            core.db_reclaim_batch = atoi(cfg::p["db_reclaim_batch"].c_str());
+        }
+		// Задать размер порции переноса колец в растущие очереди
+        if (!cfg::p["db_migrate_batch"].empty()) {
+            core.db_migrate_batch = atoi(cfg::p["db_migrate_batch"].c_str());
+            if (core.db_migrate_batch < 1) {
+                core.db_migrate_batch = 1;
+            }
+        }
+		// Задать размер пачки упреждающего чтения подписок
+        if (!cfg::p["db_readahead"].empty()) {
+            core.db_readahead = atoi(cfg::p["db_readahead"].c_str());
+            if (core.db_readahead < 1) {
+                core.db_readahead = 1;
+            }
+        }
+        if (!cfg::p["db_readahead_bytes"].empty()) {
+            core.db_readahead_bytes = atol(cfg::p["db_readahead_bytes"].c_str());
+        }
+		// Задать порог вынесения крупных сообщений в файлы и каталог для них
+        if (!cfg::p["db_blob_threshold"].empty()) {
+            core.db_blob_threshold = atol(cfg::p["db_blob_threshold"].c_str());
+        }
+        if (!cfg::p["db_blob_dir"].empty()) {
+            core.db_blob_dir = cfg::p["db_blob_dir"];
+        }
+		// Задать пороги заполнения очередей для управления потоком (по умолчанию и для отдельных очередей)
+        static const char high_tag[] = "queue_high_watermark";
+        static const char low_tag[] = "queue_low_watermark";
+        core.set_watermark("", atoi(cfg::p[high_tag].c_str()), atoi(cfg::p[low_tag].c_str()));
+        for (std::map<std::string, std::string>::const_iterator it = cfg::p.begin(); it != cfg::p.end(); ++it) {
+            if (!it->first.compare(0, sizeof(high_tag), std::string(high_tag) + '.')) {
+                std::string qname = it->first.substr(sizeof(high_tag));
+                core.set_watermark(
+                    qname, atoi(it->second.c_str()), atoi(cfg::p[std::string(low_tag) + '.' + qname].c_str())
+                );
+            }
+        }
+        if (!cfg::p["queue_hold_bytes"].empty()) {
+            core.hold_bytes = atol(cfg::p["queue_hold_bytes"].c_str());
+        }
 		// Задать тип бэклога
         core.backlog=atoi(cfg::p["backlog"].c_str());
         if (core.backlog < 1) {
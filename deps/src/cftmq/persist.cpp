@@ -4,12 +4,20 @@
  */
 
 #include "persist.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <set>
+#include <list>
+#include <vector>
+#include <algorithm>
 
 namespace persist
 {
-    using namespace kyotocabinet;
-
     struct global_meta_data {
         u_int32_t max_queue_size; // максимальное количество элементов в одной циклической очереди
         u_int32_t count;          // текущее количество очередей в хранилище (используется при автоматической "нарезке" на именованные очереди)
@@ -23,316 +31,1624 @@ namespace persist
         u_int64_t end_pos;    // граница очереди (определяется при создании нового файла, после этого не переопределяется)
     };
 
+    // граница растущей очереди: позиции - порядковые номера внутри очереди, циклического переноса нет
+    // (очереди, созданные до этого, являются кольцами фиксированного размера в общем пространстве ключей)
+    static const u_int64_t growable_end_pos = (u_int64_t) -1;
+
+    static bool is_growable(const meta_data& meta)
+    {
+        return meta.end_pos == growable_end_pos;
+    }
+
+    static void init_growable(meta_data& meta)
+    {
+        memset((char*)&meta, 0, sizeof(meta));
+        meta.end_pos = growable_end_pos;
+    }
+
+    // признак БД с упорядоченными ключами: позиции растущих очередей записаны в big-endian
+    // (ключ этого вида - 3 байта, с ключами очередей и метаданных не пересекается)
+    static const char ordered_keys_tag[] = "#be";
+
+    // каталог именованных очередей: одна запись со строками "индекс имя\n", переписывается при создании очереди
+    // (ключ - 7 байт, ни с чем не пересекается); SYSTEM ls и size работают по нему, не касаясь элементов очередей
+    static const char catalog_tag[] = "#queues";
+
+    static std::string catalog_record(const std::map<std::string, u_int32_t>& catalog)
+    {
+        std::stringstream ss;
+        for (std::map<std::string, u_int32_t>::const_iterator it = catalog.begin(); it != catalog.end(); ++it) {
+            ss << it->second << ' ' << it->first << '\n';
+        }
+        return ss.str();
+    }
+
+    static void put_be(char* p, u_int64_t v, int len)
+    {
+        for (int i = len - 1; i >= 0; i--, v >>= 8) {
+            p[i] = (char) (v & 0xff);
+        }
+    }
+
+    // ключ элемента очереди: для растущей очереди - индекс очереди + порядковый номер (12 байт),
+    // для кольца - позиция в общем пространстве (8 байт), ключи метаданных - 4 байта, пересечений нет;
+    // в упорядоченной БД ключ растущей очереди пишется в big-endian, так что в TreeDB элементы одной очереди
+    // лежат подряд в порядке позиций и push_front/pop_back работают с крайними страницами дерева
+    static std::string slot_key(u_int32_t idx, const meta_data& meta, u_int64_t pos, bool ordered)
+    {
+        if (!is_growable(meta)) {
+            return std::string((char*)&pos, sizeof(pos));
+        }
+
+        char buf[sizeof(idx) + sizeof(pos)];
+        if (ordered) {
+            put_be(buf, idx, sizeof(idx));
+            put_be(buf + sizeof(idx), pos, sizeof(pos));
+        } else {
+            memcpy(buf, (char*)&idx, sizeof(idx));
+            memcpy(buf + sizeof(idx), (char*)&pos, sizeof(pos));
+        }
+
+        return std::string(buf, sizeof(buf));
+    }
+
+    // диапазоны осиротевших элементов, ожидающие удаления (storage::reclaim): массив purge_range,
+    // дополняется в той же транзакции, что и сброс очереди (ключ - 6 байт, ни с чем не пересекается)
+    static const char purge_tag[] = "#purge";
+
+    struct purge_range {
+        u_int32_t idx;        // индекс очереди
+        u_int32_t ordered;    // кодировка ключей растущей очереди
+        meta_data meta;       // позиции read_idx..write_idx (с переносом для кольца) - еще не удаленные элементы
+    };
+
+    // диапазоны ключей, значения которых перенесены под другие ключи (queue::migrate): тот же массив purge_range,
+    // но файлы вынесенных сообщений при удалении не трогаются - на них ссылаются новые ключи (ключ - 6 байт)
+    static const char moved_tag[] = "#moved";
+
+    // добавить диапазон старых позиций очереди к освобождению (в список tag)
+    static bool add_purge(backend* db, u_int32_t idx, const meta_data& meta, bool ordered, const char* tag = purge_tag)
+    {
+        if (meta.read_idx == meta.write_idx) {
+            return true;
+        }
+
+        purge_range r;
+        memset((char*)&r, 0, sizeof(r));
+        r.idx = idx;
+        r.ordered = ordered;
+        r.meta = meta;
+
+        std::string record;
+        db->get(tag, record);
+        record.append((char*)&r, sizeof(r));
+
+        return db->set(tag, record);
+    }
+
+    // кольца, переводимые в растущие очереди порциями (queue::migrate, storage::migrate): массив migrate_state;
+    // элементы копируются под ключи растущей очереди, а кольцо до последней порции продолжает работать как обычно
+    // (ключ - 11 байт, ни с чем не пересекается)
+    static const char migrations_tag[] = "#migrations";
+
+    struct migrate_state {
+        u_int32_t idx;        // индекс очереди
+        u_int32_t ordered;    // кодировка ключей копий
+        u_int64_t pos;        // позиция кольца, с которой продолжается копирование
+        u_int64_t first;      // скопированные позиции растущей очереди [first, done)
+        u_int64_t done;
+    };
+
+    // найти перенос очереди idx
+    static bool find_migration(backend* db, u_int32_t idx, migrate_state& m)
+    {
+        std::string record;
+        db->get(migrations_tag, record);
+
+        for (std::string::size_type off = 0; off + sizeof(migrate_state) <= record.length(); off += sizeof(migrate_state)) {
+            memcpy((char*)&m, record.data() + off, sizeof(m));
+            if (m.idx == idx) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // удалить из списка перенос очереди idx и добавить в конец m (если задан) - очереди переносятся по очереди
+    static bool update_migrations(backend* db, u_int32_t idx, const migrate_state* m)
+    {
+        std::string tag(migrations_tag, sizeof(migrations_tag) - 1), record;
+        db->get(tag, record);
+
+        for (std::string::size_type off = 0; off + sizeof(migrate_state) <= record.length(); off += sizeof(migrate_state)) {
+            migrate_state r;
+            memcpy((char*)&r, record.data() + off, sizeof(r));
+            if (r.idx == idx) {
+                record.erase(off, sizeof(r));
+                break;
+            }
+        }
+
+        if (m) {
+            record.append((const char*)m, sizeof(*m));
+        }
+
+        return record.empty() ? (db->remove(tag), true) : db->set(tag, record);
+    }
+
+    // перенос прерван (кольцо опустело или сброшено): копии [first, done) больше не нужны и удаляются в фоне;
+    // вызывается внутри транзакции
+    static bool drop_migration(backend* db, const migrate_state& m)
+    {
+        meta_data copies;
+        init_growable(copies);
+        copies.read_idx = m.first;
+        copies.write_idx = m.done;
+
+        return add_purge(db, m.idx, copies, m.ordered, moved_tag) && update_migrations(db, m.idx, NULL);
+    }
+
+    // расстояние между позициями кольца (с переносом)
+    static u_int64_t ring_distance(const meta_data& meta, u_int64_t from, u_int64_t to)
+    {
+        return to >= from ? to - from : (meta.end_pos - from) + (to - meta.start_pos);
+    }
+
+    // ссылка на сообщение в файле (blobs): "\0blob", номер файла и длина, little-endian (21 байт);
+    // сообщения STOMP с нулевого байта не начинаются, так что со значением в БД ссылка не путается
+    static const char blob_ref_tag[] = "\0blob";
+
+    static const size_t blob_ref_tag_len = sizeof(blob_ref_tag) - 1;
+
+    static const size_t blob_ref_len = blob_ref_tag_len + 2 * sizeof(u_int64_t);
+
+    // номер следующего файла blobs (ключ - 6 байт, с "#purge" не совпадает)
+    static const char blobs_tag[] = "#blobs";
+
+    // удалить элемент очереди; файл вынесенного сообщения удаляется после коммита (blobs::end)
+    static bool remove_slot(backend* db, blobs* files, const std::string& slot)
+    {
+        if (files && files->is_open()) {
+            char buf[blob_ref_len];
+            if (db->get(slot.data(), slot.length(), buf, sizeof(buf)) == (int) blob_ref_len && blobs::is_ref(buf, blob_ref_len)) {
+                files->remove_later(std::string(buf, blob_ref_len));
+            }
+        }
+
+        return db->remove(slot);
+    }
+
+    // пачки, забранные упреждающим чтением (readahead) и еще не удаленные: массив claim_range,
+    // после сбоя возвращаются в очереди при открытии БД (ключ - 7 байт)
+    static const char claims_tag[] = "#claims";
+
+    struct claim_range {
+        u_int32_t idx;        // индекс очереди
+        u_int32_t ordered;    // кодировка ключей
+        u_int64_t from;       // позиции пачки [from, to)
+        u_int64_t to;
+    };
+
+    // удалить из списка пачку очереди idx, начинающуюся с from (если old_to > from), и добавить новую (если add)
+    static bool update_claims(backend* db, u_int32_t idx, u_int64_t from, u_int64_t old_to, const claim_range* add)
+    {
+        std::string tag(claims_tag, sizeof(claims_tag) - 1), record;
+        db->get(tag, record);
+
+        if (old_to > from) {
+            for (std::string::size_type off = 0; off + sizeof(claim_range) <= record.length(); off += sizeof(claim_range)) {
+                claim_range r;
+                memcpy((char*)&r, record.data() + off, sizeof(r));
+                if (r.idx == idx && r.from == from) {
+                    record.erase(off, sizeof(r));
+                    break;
+                }
+            }
+        }
+
+        if (add) {
+            record.append((const char*)add, sizeof(*add));
+        }
+
+        return record.empty() ? (db->remove(tag), true) : db->set(tag, record);
+    }
+
+    // вернуть в очередь idx сообщения пачки [acked, to), подтвержденные [from, acked) удалить;
+    // если после пачки из очереди никто не читал - просто откатываем позицию чтения (порядок сохраняется),
+    // иначе сообщения дописываются в конец очереди
+    static bool restore_claim(backend* db, blobs* files, u_int32_t idx, bool ordered, u_int64_t from, u_int64_t acked, u_int64_t to)
+    {
+        meta_data meta;
+        if (db->get((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return true;
+        }
+
+        meta_data claim;
+        init_growable(claim);
+
+        for (u_int64_t pos = from; pos < acked; pos++) {
+            remove_slot(db, files, slot_key(idx, claim, pos, ordered));
+        }
+
+        if (acked >= to) {
+            return true;
+        }
+
+        if (is_growable(meta) && meta.read_idx == to) {
+            meta.read_idx = acked;
+            meta.count += to - acked;
+        } else if (is_growable(meta)) {
+            for (u_int64_t pos = acked; pos < to; pos++) {
+                std::string slot = slot_key(idx, claim, pos, ordered), value;
+                if (db->get(slot, value)) {
+                    db->remove(slot);
+                    if (!db->set(slot_key(idx, meta, meta.write_idx, ordered), value)) {
+                        return false;
+                    }
+                    meta.write_idx++;
+                    meta.count++;
+                }
+            }
+        }
+
+        return db->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta));
+    }
+
+    // позиция pos входит в живой диапазон очереди
+    static bool is_live(const meta_data& meta, u_int64_t pos)
+    {
+        if (is_growable(meta) || meta.read_idx <= meta.write_idx) {
+            return pos >= meta.read_idx && pos < meta.write_idx;
+        }
+
+        // кольцо с переносом позиции записи в начало
+        return (pos >= meta.read_idx && pos < meta.end_pos) || (pos >= meta.start_pos && pos < meta.write_idx);
+    }
+
+    static u_int64_t get_be(const char* p, int len)
+    {
+        u_int64_t v = 0;
+        for (int i = 0; i < len; i++) {
+            v = (v << 8) | (unsigned char) p[i];
+        }
+        return v;
+    }
+
+    // разобрать ключ растущей очереди (12 байт)
+    static void parse_slot_key(const std::string& key, bool ordered, u_int32_t& idx, u_int64_t& pos)
+    {
+        if (ordered) {
+            idx = get_be(key.data(), sizeof(idx));
+            pos = get_be(key.data() + sizeof(idx), sizeof(pos));
+        } else {
+            memcpy((char*)&idx, key.data(), sizeof(idx));
+            memcpy((char*)&pos, key.data() + sizeof(idx), sizeof(pos));
+        }
+    }
+
+    // переложить элементы очереди в порядке чтения под ключи растущей очереди в кодировке ordered
+    // (вызывается внутри транзакции, meta заменяется новыми метаданными; возвращает количество элементов, -1 - ошибка)
+    static int rekey(backend* db, u_int32_t idx, meta_data& meta, bool from_ordered, bool ordered)
+    {
+        meta_data new_meta;
+        init_growable(new_meta);
+
+        u_int64_t pos = meta.read_idx;
+
+        for (;;) {
+            if (pos == meta.end_pos) {
+                pos = meta.start_pos;
+            }
+
+            if (pos == meta.write_idx) {
+                break;
+            }
+
+            std::string old_slot = slot_key(idx, meta, pos, from_ordered), value;
+
+            // старый ключ удаляется до записи нового: первый новый ключ может совпасть со старым
+            if (db->get(old_slot, value)) {
+                db->remove(old_slot);
+                if (!db->set(slot_key(idx, new_meta, new_meta.write_idx, ordered), value)) {
+                    return -1;
+                }
+                new_meta.write_idx++;
+                new_meta.count++;
+            }
+
+            pos++;
+        }
+
+        meta = new_meta;
+
+        return meta.count;
+    }
+
+    bool blobs::is_ref(const char* p, size_t len)
+    {
+        return len == blob_ref_len && !memcmp(p, blob_ref_tag, blob_ref_tag_len);
+    }
+
+    static u_int64_t blob_ref_field(const std::string& ref, int n)
+    {
+        u_int64_t v;
+        memcpy((char*)&v, ref.data() + blob_ref_tag_len + n * sizeof(v), sizeof(v));
+        return v;
+    }
+
+    bool blobs::open(const std::string& _dir, size_t _threshold, bool _sync)
+    {
+        if (_dir.empty() || (mkdir(_dir.c_str(), 0755) && errno != EEXIST)) {
+            return false;
+        }
+
+        dir = _dir;
+        if (dir[dir.length() - 1] != '/') {
+            dir += '/';
+        }
+
+        threshold = _threshold;
+        sync = _sync;
+
+        return true;
+    }
+
+    void blobs::close(bool _remove)
+    {
+        if (_remove && !dir.empty()) {
+            for (int i = 0; i < 256; i++) {
+                char sub[8];
+                sprintf(sub, "%02x/", i);
+                std::string subdir = dir + sub;
+
+                DIR* d = opendir(subdir.c_str());
+                if (!d) {
+                    continue;
+                }
+
+                for (dirent* e = readdir(d); e; e = readdir(d)) {
+                    if (e->d_name[0] != '.') {
+                        unlink((subdir + e->d_name).c_str());
+                    }
+                }
+
+                closedir(d);
+                rmdir(subdir.c_str());
+            }
+
+            rmdir(dir.c_str());
+        }
+
+        dir.clear();
+        unlinks.clear();
+        threshold = 0;
+        next_id = 0;
+    }
+
+    std::string blobs::path(const std::string& ref)
+    {
+        u_int64_t id = blob_ref_field(ref, 0);
+
+        char buf[32];
+        sprintf(buf, "%02x/%016llx", (unsigned) (id & 0xff), (unsigned long long) id);
+
+        return dir + buf;
+    }
+
+    bool blobs::put(const std::string& value, std::string& ref)
+    {
+        if (dir.empty()) {
+            return false;
+        }
+
+        u_int64_t id = next_id, length = value.length();
+
+        ref.assign(blob_ref_tag, blob_ref_tag_len);
+        ref.append((char*)&id, sizeof(id));
+        ref.append((char*)&length, sizeof(length));
+
+        std::string filename = path(ref);
+
+        // файл с этим номером может остаться от сбоя до коммита ссылки - перезаписываем
+        int fd = ::open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd == -1 && errno == ENOENT) {
+            mkdir(filename.substr(0, filename.find_last_of('/')).c_str(), 0755);
+            fd = ::open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        }
+
+        if (fd == -1) {
+            return false;
+        }
+
+        size_t l = 0;
+        while (l < value.length()) {
+            ssize_t n = write(fd, value.data() + l, value.length() - l);
+            if (n == (ssize_t) -1 || n == 0) {
+                break;
+            }
+            l += n;
+        }
+
+        bool ok = l == value.length() && (!sync || !fsync(fd));
+
+        ::close(fd);
+
+        if (!ok) {
+            unlink(filename.c_str());
+            return false;
+        }
+
+        next_id++;
+
+        return true;
+    }
+
+    int blobs::open_ref(const std::string& ref, off_t& length)
+    {
+        if (dir.empty() || !is_ref(ref)) {
+            return -1;
+        }
+
+        length = blob_ref_field(ref, 1);
+
+        return ::open(path(ref).c_str(), O_RDONLY);
+    }
+
+    bool blobs::load(const std::string& ref, std::string& value)
+    {
+        off_t length;
+        int fd = open_ref(ref, length);
+        if (fd == -1) {
+            return false;
+        }
+
+        value.resize(length);
+
+        off_t l = 0;
+        while (l < length) {
+            ssize_t n = read(fd, (char*) value.data() + l, length - l);
+            if (n == (ssize_t) -1 || n == 0) {
+                break;
+            }
+            l += n;
+        }
+
+        ::close(fd);
+
+        if (l != length) {
+            value.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool blobs::exists(const std::string& ref)
+    {
+        struct stat st;
+
+        return !dir.empty() && is_ref(ref) && !stat(path(ref).c_str(), &st);
+    }
+
+    void blobs::remove(const std::string& ref)
+    {
+        if (!dir.empty() && is_ref(ref)) {
+            unlink(path(ref).c_str());
+        }
+    }
+
+    void blobs::end(bool commit)
+    {
+        if (commit) {
+            for (std::list<std::string>::iterator it = unlinks.begin(); it != unlinks.end(); ++it) {
+                remove(*it);
+            }
+        }
+
+        unlinks.clear();
+    }
+
     bool storage::open(const std::string& path, const std::string& type, u_int32_t max, bool sync)
     {
-        if (type=="HashDB") {
-			db = new kyotocabinet::HashDB;
-		} else if (type=="TreeDB") {
-			db = new kyotocabinet::TreeDB;
+        db = backend::create(type);
+
+        if (!db) {
+            return false;
 		}
 
-        if (!db) {
-            return false;
-		}
+        this->sync = sync;
+
+        db->set_map_size(map_size);
+
+        if (db->open(path, sync)) {
+            // Если база новая, то добавляем туда структуру для хранения метаданных
+            global_meta_data gmeta;
+			memset((char*)&gmeta, 0, sizeof(gmeta));
+            gmeta.max_queue_size = max;
+            if (db->add("@", 1, (char*)&gmeta, sizeof(gmeta))) {
+                // новая БД сразу создается с упорядоченными ключами
+                db->set(ordered_keys_tag, sizeof(ordered_keys_tag) - 1, "1", 1);
+            }
+
+            std::string tag;
+            ordered = db->get(std::string(ordered_keys_tag, sizeof(ordered_keys_tag) - 1), tag);
+
+            if (load_catalog() && recover_claims()) {
+                return true;
+            }
+
+            db->close();
+        }
+
+        delete db;
+        db = NULL;
+
+        return false;
+    }
+
+    void storage::close(bool _remove)
+    {
+        if (db) {
+            db->close(_remove);
+            delete db;
+            db = NULL;
+        }
+
+        catalog.clear();
+        orphans.clear();
+        rings.clear();
+
+        files.close(_remove);
+    }
+
+    bool storage::open_blobs(const std::string& dir, size_t threshold)
+    {
+        if (!db || !files.open(dir, threshold, sync)) {
+            return false;
+        }
+
+        u_int64_t id;
+        if (db->get(blobs_tag, sizeof(blobs_tag) - 1, (char*)&id, sizeof(id)) == sizeof(id)) {
+            files.next_id = id;
+        }
+
+        return true;
+    }
+
+    bool storage::get_queue_by_index(u_int32_t idx, queue& q)
+    {
+        meta_data meta;
+
+        // ищем есть ли в БД очередь с таким индексом
+        if (db->get((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            // если нет, то создаем новую
+            init_growable(meta);
+
+            // пытаемся начать транзакцию изменения БД
+            if (!db->begin()) {
+                return false;
+			}
+
+            // пишем метаданные новой очереди
+            if (!db->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta))) {
+                db->end(false);
+				return false;
+			}
+
+            // коммитим транзакцию
+            if (!db->end(true)) {
+                return false;
+			}
+        }
+
+        q.db = db;
+        q.files = &files;
+        q.key = idx;
+        q.ordered = ordered;
+
+        return true;
+    }
+
+    bool storage::get_queue_by_name(const std::string& name, queue& q)
+    {
+        if (find_queue_by_name(name, q)) {
+            return true;
+        }
+
+        std::string key;
+		key.reserve(name.length() + 2);
+        key += '@';
+		key += name;
+		key += '@';
+
+        // подбираем новый индекс и создаем новую очередь
+        global_meta_data gmeta;
+        if (db->get("@", 1, (char*)&gmeta, sizeof(gmeta)) != sizeof(gmeta)) {
+            return false;
+		}
+
+        u_int32_t idx = gmeta.count++;
+
+        meta_data meta;
+        init_growable(meta);
+
+        std::map<std::string, u_int32_t> new_catalog(catalog);
+        new_catalog[name] = idx;
+
+        // пытаемся начать транзакцию изменения БД
+        if (!db->begin()) {
+            return false;
+		}
+
+        // пишем метаданные новой очереди, алиас и каталог
+        if (
+			!db->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta))
+			|| !db->set("@", 1, (char*)&gmeta, sizeof(gmeta))
+			|| !db->set(key.c_str(), key.length(), (char*)&idx,sizeof(idx))
+			|| !db->set(std::string(catalog_tag, sizeof(catalog_tag) - 1), catalog_record(new_catalog))
+		) {
+			db->end(false);
+			return false;
+		}
+
+        // коммитим транзакцию
+        if (!db->end(true)) {
+            return false;
+		}
+
+        catalog.swap(new_catalog);
+
+        q.db = db;
+        q.files = &files;
+        q.key = idx;
+        q.ordered = ordered;
+
+        return true;
+    }
+
+    bool storage::find_queue_by_name(const std::string& name, queue& q)
+    {
+        std::map<std::string, u_int32_t>::const_iterator it = catalog.find(name);
+
+        if (!db || it == catalog.end()) {
+            return false;
+        }
+
+        q.db = db;
+        q.files = &files;
+        q.key = it->second;
+        q.ordered = ordered;
+
+        return true;
+    }
+
+    u_int32_t queue::size(void)
+    {
+        if (!db) {
+            return 0;
+		}
+
+        // пытаемся получить метаданные
+        meta_data meta;
+        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return 0;
+		}
+
+        return meta.count;
+    }
+
+    bool queue::clear(void)
+    {
+        if (!db) {
+            return false;
+		}
+
+        // пытаемся получить метаданные
+        meta_data meta;
+        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return false;
+		}
+
+        // сброшенные элементы удаляются позже, небольшими порциями (storage::reclaim)
+        meta_data old_meta = meta;
+
+        migrate_state m;
+        bool migrating = false;
+
+        if (is_growable(meta)) {
+            // позиции растущей очереди не переиспользуются, просто догоняем позицию записи
+            meta.read_idx = meta.write_idx;
+            meta.count = 0;
+        } else {
+            // пустая очередь больше не привязана к кольцу и становится растущей (за копиями прерванного переноса)
+            migrating = find_migration(db, key, m);
+            init_growable(meta);
+            if (migrating) {
+                meta.read_idx = meta.write_idx = m.done;
+            }
+        }
+
+        // пытаемся начать транзакцию изменения БД
+        if (!db->begin()) {
+            return false;
+		}
+
+        // пишем метаданные и диапазон к освобождению
+        if (
+            !db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))
+            || !add_purge(db, key, old_meta, ordered)
+            || (migrating && !drop_migration(db, m))
+        ) {
+            db->end(false);
+			return false;
+		}
+
+        // коммитим транзакцию
+        if (!db->end(true)) {
+            return false;
+		}
+
+        return true;
+    }
+
+    int queue::claim(u_int64_t done_from, u_int64_t done_to, int max, size_t max_bytes, u_int64_t& from, std::list<std::string>& values)
+    {
+        if (!db) {
+            return -1;
+		}
+
+        meta_data meta;
+        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return -1;
+		}
+
+        // кольца из старых БД пачками не читаются
+        if (!is_growable(meta)) {
+            return -1;
+        }
+
+        if (!db->begin()) {
+            return -1;
+		}
+
+        // удаляем подтвержденную предыдущую пачку
+        for (u_int64_t pos = done_from; pos < done_to; pos++) {
+            remove_slot(db, files, slot_key(key, meta, pos, ordered));
+        }
+
+        // забираем следующую: ключи остаются в БД до подтверждения, позиция чтения сдвигается за пачку
+        from = meta.read_idx;
+
+        size_t bytes = 0;
+        int n = 0;
+
+        for (; n < max && meta.read_idx != meta.write_idx && (!n || bytes < max_bytes); n++) {
+            std::string value;
+            if (!db->get(slot_key(key, meta, meta.read_idx, ordered), value)) {
+                value.clear();
+            }
+            bytes += value.length();
+            values.push_back(value);
+            meta.read_idx++;
+            if (meta.count) {
+                meta.count--;
+            }
+        }
+
+        claim_range r = { key, ordered, from, meta.read_idx };
+
+        if (
+            !update_claims(db, key, done_from, done_to, n ? &r : NULL)
+            || !db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))
+        ) {
+            db->end(false);
+            end_files(false);
+            values.clear();
+            return -1;
+        }
+
+        if (!db->end(true)) {
+            end_files(false);
+            values.clear();
+            return -1;
+		}
+
+        end_files(true);
+
+        return n;
+    }
+
+    bool queue::release(u_int64_t from, u_int64_t acked, u_int64_t to)
+    {
+        if (!db || to <= from) {
+            return false;
+		}
+
+        if (!db->begin()) {
+            return false;
+		}
+
+        if (!restore_claim(db, files, key, ordered, from, acked, to) || !update_claims(db, key, from, to, NULL)) {
+            db->end(false);
+            end_files(false);
+            return false;
+        }
+
+        bool rc = db->end(true);
+
+        end_files(rc);
+
+        return rc;
+    }
+
+    bool readahead::pop(std::string& value, int max, size_t max_bytes)
+    {
+        value.clear();
+
+        for (;;) {
+            if (!values.empty()) {
+                value.swap(values.front());
+                values.pop_front();
+
+                // пропавшие из БД элементы (и вынесенные сообщения без файла) не отдаются, считаем их подтвержденными
+                if (value.empty() || (blobs::is_ref(value) && (!q.files || !q.files->exists(value)))) {
+                    acked++;
+                    continue;
+                }
+
+                return true;
+            }
+
+            // буфер пуст: одной транзакцией удаляем подтвержденную пачку и забираем следующую
+            u_int64_t next_from = 0;
+            int n = q.claim(from, acked, max, max_bytes, next_from, values);
+
+            if (n < 0) {
+                // кольцо из старой БД или ошибка - читаем по одному
+                if (to > from) {
+                    return false;
+                }
+                return q.pop_back(value) && !value.empty();
+            }
+
+            from = acked = next_from;
+            to = next_from + n;
+
+            if (!n) {
+                return false;
+            }
+        }
+    }
+
+    bool readahead::release(void)
+    {
+        bool rc = true;
+
+        if (to > from) {
+            rc = q.release(from, acked, to);
+        }
+
+        values.clear();
+        from = acked = to = 0;
+
+        return rc;
+    }
+
+    bool queue::push_front(const std::string& value, int max_num, int* cur_num)
+    {
+        if (!db) {
+            return false;
+		}
+
+        // пытаемся получить метаданные
+        meta_data meta;
+        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return false;
+		}
+
+        // ограничение количества сообщений в очереди
+        if (max_num > 0 && meta.count >= (u_int32_t)max_num) {
+            return false;
+		}
+
+        // опустевшее кольцо переводим в растущую очередь; если его переносили - новые позиции начинаются за копиями
+        migrate_state m;
+        bool migrating = false;
+
+        if (!is_growable(meta) && meta.read_idx == meta.write_idx) {
+            migrating = find_migration(db, key, m);
+            init_growable(meta);
+            if (migrating) {
+                meta.read_idx = meta.write_idx = m.done;
+            }
+        }
+
+        // текущая позиция
+        u_int64_t cur_idx=meta.write_idx;
+
+        // смещаем позицию записи на один
+        meta.write_idx++;
+
+        // очередь полна, ошибка, ничего не изменяем, в т.ч. указатели остаются на своих местах
+        if (meta.write_idx == meta.read_idx || (meta.read_idx == meta.start_pos && meta.write_idx == meta.end_pos)) {
+            return false;
+		}
+
+        // если позиция записи вышла за допустимые пределы перескакиваем в начало
+        if (meta.write_idx == meta.end_pos) {
+            meta.write_idx = meta.start_pos;
+		}
+
+        // увеличиваем значение счетчика элементов в очереди
+        meta.count++;
+
+        // крупное сообщение пишем в файл, в БД - только ссылку на него
+        std::string ref;
+        if (files && files->threshold > 0 && value.length() >= files->threshold && files->is_open()) {
+            if (!files->put(value, ref)) {
+                return false;
+            }
+        }
+
+        const std::string& stored = ref.empty() ? value : ref;
+
+        // пытаемся начать транзакцию изменения БД
+        if (!db->begin()) {
+            if (!ref.empty()) {
+                files->remove(ref);
+            }
+            return false;
+		}
+
+        // пишем значение
+        if (!db->set(slot_key(key, meta, cur_idx, ordered), stored)) {
+			db->end(false);
+            if (!ref.empty()) {
+                files->remove(ref);
+            }
+			return false;
+		}
+
+        // пишем метаданные (и номер следующего файла)
+        if (
+            !db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))
+            || (!ref.empty() && !db->set(blobs_tag, sizeof(blobs_tag) - 1, (char*)&files->next_id, sizeof(files->next_id)))
+            || (migrating && !drop_migration(db, m))
+        ) {
+			db->end(false);
+            if (!ref.empty()) {
+                files->remove(ref);
+            }
+			return false;
+		}
+
+        // коммитим транзакцию
+        if (!db->end(true)) {
+            if (!ref.empty()) {
+                files->remove(ref);
+            }
+            return false;
+		}
+
+        if (cur_num) {
+            *cur_num=meta.count;
+		}
+
+        return true;
+    }
+
+    bool queue::pop_back(std::string& value)
+    {
+        value.clear();
+
+        if (!db) {
+            return false;
+		}
+
+        // пытаемся получить метаданные
+        meta_data meta;
+        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return false;
+		}
+
+        // если позиция чтения вышла за допустимые пределы перескакиваем в начало
+        if (meta.read_idx == meta.end_pos) {
+            meta.read_idx = meta.start_pos;
+		}
+
+        // очередь пуста, ошибка, ничего не изменяем, в т.ч. указатели остаются на своих местах
+        if (meta.read_idx == meta.write_idx) {
+            return false;
+		}
+
+        // текущая позиция
+        u_int64_t cur_idx=meta.read_idx;
+
+        // смещаем позицию чтения на один
+        meta.read_idx++;
+
+        // уменьшаем значение счетчика элементов в очереди
+        meta.count--;
+
+        // пытаемся начать транзакцию изменения БД
+        if (!db->begin()) {
+            return false;
+		}
+
+        // читаем значение и удаляем эелемент
+        std::string slot = slot_key(key, meta, cur_idx, ordered);
+
+        if (!db->get(slot, value)) {
+            value.clear();
+		}
+
+        db->remove(slot);
+
+        // вынесенное в файл сообщение возвращаем целиком, файл удаляется после коммита;
+        // не прочитали файл - откатываемся, элемент и файл остаются на месте
+        if (blobs::is_ref(value) && files) {
+            std::string ref;
+            ref.swap(value);
+            if (!files->load(ref, value)) {
+                db->end(false);
+                end_files(false);
+                return false;
+            }
+            files->remove_later(ref);
+        }
+
+        // сохраняем метаданные
+        if (!db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))) {
+            db->end(false);
+            end_files(false);
+			return false;
+		}
+
+        // коммитим транзакцию
+        if (!db->end(true)) {
+            end_files(false);
+            return false;
+		}
+
+        end_files(true);
+
+        return true;
+    }
+
+    int queue::migrate(void)
+    {
+        if (!db) {
+            return -1;
+		}
+
+        meta_data meta;
+        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+            return -1;
+		}
+
+        migrate_state m;
+        if (is_growable(meta) || find_migration(db, key, m)) {
+            return is_growable(meta) ? 0 : meta.count;
+        }
+
+        // сами элементы переносятся порциями (storage::migrate), здесь только ставим очередь в список
+        memset((char*)&m, 0, sizeof(m));
+        m.idx = key;
+        m.ordered = ordered;
+        m.pos = meta.read_idx == meta.end_pos ? meta.start_pos : meta.read_idx;
+
+        if (!db->begin()) {
+            return -1;
+		}
+
+        if (!update_migrations(db, key, &m)) {
+            db->end(false);
+            return -1;
+        }
+
+        if (!db->end(true)) {
+            return -1;
+		}
+
+        return meta.count;
+    }
+
+    bool storage::migrate_pending(void)
+    {
+        std::string record;
+
+        return db && db->get(std::string(migrations_tag, sizeof(migrations_tag) - 1), record);
+    }
+
+    int storage::migrate(int max)
+    {
+        if (!db || max < 1) {
+            return 0;
+		}
+
+        std::string record;
+        if (!db->get(std::string(migrations_tag, sizeof(migrations_tag) - 1), record) || record.length() < sizeof(migrate_state)) {
+            return 0;
+        }
+
+        migrate_state m;
+        memcpy((char*)&m, record.data(), sizeof(m));
+
+        if (!db->begin()) {
+            return -1;
+		}
+
+        meta_data meta;
+        if (db->get((char*)&m.idx, sizeof(m.idx), (char*)&meta, sizeof(meta)) != sizeof(meta) || is_growable(meta)) {
+            // очереди нет или она уже растущая - переносить нечего
+            if (!update_migrations(db, m.idx, NULL)) {
+                db->end(false);
+                return -1;
+            }
+            return db->end(true) ? 0 : -1;
+        }
+
+        if (meta.read_idx == meta.end_pos) {
+            meta.read_idx = meta.start_pos;
+        }
+
+        // чтение обогнало копирование: скопированное уже забрано из кольца, продолжаем с позиции чтения
+        // (номера копий идут дальше, так что живые копии остаются непрерывным диапазоном)
+        if (m.pos != meta.write_idx && !is_live(meta, m.pos)) {
+            m.pos = meta.read_idx;
+        }
+
+        meta_data grown;
+        init_growable(grown);
+
+        int n = 0;
+
+        for (; n < max && m.pos != meta.write_idx; n++) {
+            // ключ кольца остается на месте до последней порции, значение (и ссылка на файл) копируется;
+            // пропавший элемент оставляет пропуск, который при чтении отбрасывается
+            std::string value;
+            if (db->get(slot_key(m.idx, meta, m.pos, m.ordered), value) && !db->set(slot_key(m.idx, grown, m.done, m.ordered), value)) {
+                db->end(false);
+                return -1;
+            }
+
+            m.done++;
+
+            if (++m.pos == meta.end_pos) {
+                m.pos = meta.start_pos;
+            }
+        }
+
+        bool ok;
+
+        if (m.pos == meta.write_idx) {
+            // скопировано все: очередь становится растущей из копий, ключи кольца и копии уже забранных элементов
+            // удаляются в фоне (storage::reclaim), файлы сообщений остаются за копиями
+            grown.write_idx = m.done;
+            grown.read_idx = m.done - ring_distance(meta, meta.read_idx, meta.write_idx);
+            grown.count = grown.write_idx - grown.read_idx;
+
+            meta_data stale = grown;
+            stale.read_idx = m.first;
+            stale.write_idx = grown.read_idx;
+
+            ok = add_purge(db, m.idx, meta, m.ordered, moved_tag)
+                && add_purge(db, m.idx, stale, m.ordered, moved_tag)
+                && db->set((char*)&m.idx, sizeof(m.idx), (char*)&grown, sizeof(grown))
+                && update_migrations(db, m.idx, NULL);
+        } else {
+            ok = update_migrations(db, m.idx, &m);
+        }
+
+        if (!ok) {
+            db->end(false);
+            return -1;
+        }
+
+        if (!db->end(true)) {
+            return -1;
+		}
+
+        return n;
+    }
+
+    // собирает индексы очередей по ключам метаданных (4 байта)
+    class queue_indexes : public visitor
+    {
+    public:
+        std::set<u_int32_t> indexes;
+
+        void visit(const char* key, size_t klen)
+        {
+            if (klen == sizeof(u_int32_t)) {
+                u_int32_t idx;
+                memcpy((char*)&idx, key, sizeof(idx));
+                indexes.insert(idx);
+            }
+        }
+    };
+
+    long storage::convert_keys(void)
+    {
+        if (!db) {
+            return -1;
+		}
+
+        if (ordered) {
+            return 0;
+        }
+
+        queue_indexes queues;
+        if (!db->iterate(queues)) {
+            return -1;
+        }
+
+        // новый ключ очереди idx совпадает со старым ключом очереди с переставленными байтами индекса,
+        // такие пары (индексы от 2^24) при переносе затерли бы друг друга
+        for (std::set<u_int32_t>::iterator it = queues.indexes.begin(); it != queues.indexes.end(); ++it) {
+            u_int32_t swapped = __builtin_bswap32(*it);
+            if (swapped != *it && queues.indexes.count(swapped)) {
+                return -1;
+            }
+        }
+
+        if (!db->begin()) {
+            return -1;
+		}
+
+        // незаконченные переносы колец прерываем: кольца переводятся ниже целиком, копии удаляются в фоне
+        std::string record;
+        db->get(std::string(migrations_tag, sizeof(migrations_tag) - 1), record);
+
+        for (std::string::size_type off = 0; off + sizeof(migrate_state) <= record.length(); off += sizeof(migrate_state)) {
+            migrate_state m;
+            memcpy((char*)&m, record.data() + off, sizeof(m));
+            if (!drop_migration(db, m)) {
+                db->end(false);
+                return -1;
+            }
+        }
+
+        long total = 0;
+
+        for (std::set<u_int32_t>::iterator it = queues.indexes.begin(); it != queues.indexes.end(); ++it) {
+            u_int32_t idx = *it;
+            meta_data meta;
+
+            if (db->get((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
+                continue;
+            }
 
-        if (db->open(path, BasicDB::OWRITER|BasicDB::OCREATE)) {
-            // Если база новая, то добавляем туда структуру для хранения метаданных
-            global_meta_data gmeta;
-			memset((char*)&gmeta, 0, sizeof(gmeta));
-            gmeta.max_queue_size = max;
-            db->add("@", 1, (char*)&gmeta, sizeof(gmeta));
-            hard_transaction = sync;
-            location = path;
+            int n = rekey(db, idx, meta, false, true);
 
-            return true;
+            if (n < 0 || !db->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta))) {
+                db->end(false);
+                return -1;
+            }
+
+            total += n;
         }
 
-        delete db;
-        db = NULL;
+        if (!db->set(ordered_keys_tag, sizeof(ordered_keys_tag) - 1, "1", 1)) {
+            db->end(false);
+            return -1;
+        }
 
-        return false;
+        if (!db->end(true)) {
+            return -1;
+		}
+
+        ordered = true;
+
+        return total;
     }
 
-    void storage::close(bool _remove)
+    // элемент с ключом key не входит в живой диапазон своей очереди (queues - метаданные очередей по индексу)
+    static bool is_orphan(const std::map<u_int32_t, meta_data>& queues, bool ordered, const std::string& key)
     {
-        if (db) {
-            db->close();
-            delete db;
-            db = NULL;
+        if (key.length() == sizeof(u_int32_t) + sizeof(u_int64_t)) {
+            // элемент растущей очереди
+            u_int32_t idx;
+            u_int64_t pos;
+            parse_slot_key(key, ordered, idx, pos);
 
-            if(_remove) {
-                unlink(location.c_str());
-			}
+            std::map<u_int32_t, meta_data>::const_iterator it = queues.find(idx);
+
+            return it == queues.end() || !is_growable(it->second) || !is_live(it->second, pos);
         }
-    }
 
-    bool storage::get_queue_by_index(u_int32_t idx, queue& q)
-    {
-        meta_data meta;
+        if (key.length() == sizeof(u_int64_t)) {
+            // элемент кольца в общем пространстве позиций
+            u_int64_t pos;
+            memcpy((char*)&pos, key.data(), sizeof(pos));
 
-        // ищем есть ли в БД очередь с таким индексом
-        if (db->get((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
-            // если нет, то создаем новую
-            global_meta_data gmeta;
-            if (db->get("@", 1, (char*)&gmeta, sizeof(gmeta)) != sizeof(gmeta)) {
-                return false;
-			}
+            for (std::map<u_int32_t, meta_data>::const_iterator it = queues.begin(); it != queues.end(); ++it) {
+                if (!is_growable(it->second) && is_live(it->second, pos)) {
+                    return false;
+                }
+            }
 
-            memset((char*)&meta, 0, sizeof(meta));
+            return true;
+        }
 
-            meta.start_pos = meta.write_idx = meta.read_idx = idx * gmeta.max_queue_size;
-            meta.end_pos = meta.start_pos + gmeta.max_queue_size;
+        return false;
+    }
 
-            // пытаемся начать транзакцию изменения БД
-            if (!db->begin_transaction(hard_transaction)) {
-                return false;
-			}
+    // служебная запись, длина ключа которой может совпасть с ключом элемента очереди: алиас "@имя@"
+    // (6 символов имени - 8 байт, как у кольца, 10 символов - 12 байт, как у растущей очереди) или тег "#...";
+    // алиас узнаем по каталогу, а созданный без каталога (старой версией) - по значению-индексу
+    static bool is_service_key(backend* db, const std::map<std::string, u_int32_t>& catalog, const std::string& key)
+    {
+        static const char* tags[] = { ordered_keys_tag, purge_tag, catalog_tag, claims_tag, blobs_tag, moved_tag, migrations_tag };
 
-            // пишем метаданные новой очереди
-            if (!db->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta))) {
-                db->end_transaction(false);
-				return false;
-			}
+        if (key.empty()) {
+            return false;
+        }
 
-            // коммитим транзакцию
-            if (!db->end_transaction(true)) {
-                return false;
-			}
+        if (key[0] == '#') {
+            for (size_t i = 0; i < sizeof(tags) / sizeof(*tags); i++) {
+                if (key == tags[i]) {
+                    return true;
+                }
+            }
+            return false;
         }
 
-        q.db = db;
-        q.key = idx;
-        q.hard_transaction = hard_transaction;
+        if (key.length() > 2 && key[0] == '@' && key[key.length() - 1] == '@') {
+            if (catalog.find(key.substr(1, key.length() - 2)) != catalog.end()) {
+                return true;
+            }
 
-        return true;
+            u_int32_t idx;
+            return db->get(key.data(), key.length(), (char*)&idx, sizeof(idx)) == sizeof(idx);
+        }
+
+        return false;
     }
 
-    bool storage::get_queue_by_name(const std::string& name, queue& q)
+    // копия элемента кольца, которое еще переносится (queue::migrate): принадлежит очереди, хотя та пока кольцо
+    static bool is_migration_copy(backend* db, bool ordered, const std::string& key)
     {
-        std::string key;
-		key.reserve(name.length() + 2);
-        key += '@';
-		key += name;
-		key += '@';
+        if (key.length() != sizeof(u_int32_t) + sizeof(u_int64_t)) {
+            return false;
+        }
 
-        u_int32_t idx = 0;
+        u_int32_t idx;
+        u_int64_t pos;
+        parse_slot_key(key, ordered, idx, pos);
 
-        // ищем индекс очереди с таким алиасом
-        if (db->get(key.c_str(), key.length(), (char*)&idx, sizeof(idx)) != sizeof(idx)) {
-            // если нет, подбираем новый индекс и создаем новую очередь
-            global_meta_data gmeta;
-            if (db->get("@", 1, (char*)&gmeta, sizeof(gmeta)) != sizeof(gmeta)) {
-                return false;
-			}
+        migrate_state m;
+        return find_migration(db, idx, m);
+    }
 
-            idx = gmeta.count++;
+    // прочитать метаданные очередей с заданными индексами
+    static void load_queues(backend* db, const std::set<u_int32_t>& indexes, std::map<u_int32_t, meta_data>& queues)
+    {
+        queues.clear();
 
+        for (std::set<u_int32_t>::const_iterator it = indexes.begin(); it != indexes.end(); ++it) {
+            u_int32_t idx = *it;
             meta_data meta;
-            memset((char*)&meta, 0, sizeof(meta));
 
-            meta.start_pos = meta.write_idx = meta.read_idx = idx * gmeta.max_queue_size;
-            meta.end_pos = meta.start_pos + gmeta.max_queue_size;
+            if (db->get((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta)) == sizeof(meta)) {
+                queues[idx] = meta;
+            }
+        }
+    }
 
-            // пытаемся начать транзакцию изменения БД
-            if (!db->begin_transaction(hard_transaction)) {
-                return false;
-			}
+    // собирает ключи элементов, не входящих в живые диапазоны своих очередей (по снимку метаданных)
+    class orphan_keys : public visitor
+    {
+    protected:
+        const std::map<u_int32_t, meta_data>& queues;
+        bool ordered;
+    public:
+        std::list<std::string> keys;
+
+        orphan_keys(const std::map<u_int32_t, meta_data>& _queues, bool _ordered):queues(_queues),ordered(_ordered) {}
+
+        void visit(const char* key, size_t klen)
+        {
+            std::string k(key, klen);
+            if (is_orphan(queues, ordered, k)) {
+                keys.push_back(k);
+            }
+        }
+    };
 
-            // пишем метаданные новой очереди
-            if (
-				!db->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta))
-				|| !db->set("@", 1, (char*)&gmeta, sizeof(gmeta))
-				|| !db->set(key.c_str(), key.length(), (char*)&idx,sizeof(idx))
-			) {
-				db->end_transaction(false);
-				return false;
-			}
+    long storage::scan_orphans(void)
+    {
+        if (!db) {
+            return -1;
+		}
 
-            // коммитим транзакцию
-            if (!db->end_transaction(true)) {
-                return false;
-			}
+        queue_indexes indexes;
+        if (!db->iterate(indexes)) {
+            return -1;
+        }
+
+        std::map<u_int32_t, meta_data> queues;
+        load_queues(db, indexes.indexes, queues);
 
+        // кольца запоминаем: при удалении элементы колец проверяются по их текущим метаданным
+        rings.clear();
+        for (std::map<u_int32_t, meta_data>::iterator it = queues.begin(); it != queues.end(); ++it) {
+            if (!is_growable(it->second)) {
+                rings.insert(it->first);
+            }
         }
 
-        q.db = db;
-        q.key = idx;
-        q.hard_transaction = hard_transaction;
+        orphan_keys found(queues, ordered);
+        if (!db->iterate(found)) {
+            return -1;
+        }
 
-        return true;
+        // алиасы очередей, теги и копии переносимых колец отсеиваем (ключ элемента очереди определяется только по длине)
+        long n = 0;
+        for (std::list<std::string>::iterator it = found.keys.begin(); it != found.keys.end(); ++it) {
+            if (!is_service_key(db, catalog, *it) && !is_migration_copy(db, ordered, *it)) {
+                orphans.push_back(*it);
+                n++;
+            }
+        }
+
+        return n;
     }
 
-    u_int32_t queue::size(void)
+    bool storage::reclaim_pending(void)
     {
-        if (!db) {
-            return 0;
-		}
-
-        // пытаемся получить метаданные
-        meta_data meta;
-        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
-            return 0;
-		}
+        std::string record;
 
-        return meta.count;
+        return db && (
+            !orphans.empty()
+            || db->get(std::string(purge_tag, sizeof(purge_tag) - 1), record)
+            || db->get(std::string(moved_tag, sizeof(moved_tag) - 1), record)
+        );
     }
 
-    bool queue::clear(void)
+    // удалить не больше max элементов первого диапазона из списка tag (files == NULL - без файлов сообщений);
+    // вызывается внутри транзакции (возвращает количество удаленных, -1 - ошибка)
+    static int purge_ranges(backend* db, blobs* files, const char* tag, int max)
     {
-        if (!db) {
-            return false;
-		}
+        std::string record;
+        int removed = 0;
 
-        // пытаемся получить метаданные
-        meta_data meta;
-        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
-            return false;
-		}
+        if (max < 1 || !db->get(tag, record) || record.length() < sizeof(purge_range)) {
+            return 0;
+        }
 
-        meta.write_idx = meta.read_idx = meta.start_pos;
-        meta.count = 0;
+        purge_range r;
+        memcpy((char*)&r, record.data(), sizeof(r));
 
-        // пытаемся начать транзакцию изменения БД
-        if (!db->begin_transaction(hard_transaction)) {
-            return false;
-		}
+        for (; removed < max && r.meta.read_idx != r.meta.write_idx; removed++) {
+            remove_slot(db, files, slot_key(r.idx, r.meta, r.meta.read_idx, r.ordered));
 
-        // пишем метаданные
-        if (!db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))) {
-            db->end_transaction(false);
-			return false;
-		}
+            if (++r.meta.read_idx == r.meta.end_pos) {
+                r.meta.read_idx = r.meta.start_pos;
+            }
+        }
 
-        // коммитим транзакцию
-        if (!db->end_transaction(true)) {
-            return false;
-		}
+        if (r.meta.read_idx == r.meta.write_idx) {
+            record.erase(0, sizeof(r));
+        } else {
+            memcpy((char*)record.data(), (char*)&r, sizeof(r));
+        }
 
-        return true;
+        if (!(record.empty() ? db->remove(tag) : db->set(tag, record))) {
+            return -1;
+        }
+
+        return removed;
     }
 
-    bool queue::push_front(const std::string& value, int max_num, int* cur_num)
+    int storage::reclaim(int max)
     {
-        if (!db) {
-            return false;
+        if (!db || max < 1) {
+            return 0;
 		}
 
-        // пытаемся получить метаданные
-        meta_data meta;
-        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
-            return false;
+        if (!db->begin()) {
+            return -1;
 		}
 
-        // ограничение количества сообщений в очереди
-        if (max_num > 0 && meta.count >= (u_int32_t)max_num) {
-            return false;
-		}
+        // диапазоны от сброшенных очередей: позиции в них больше не используются, удаляем без проверок;
+        // затем ключи, перенесенные под новые (файлы сообщений принадлежат новым ключам)
+        int n = purge_ranges(db, &files, purge_tag, max);
+        int m = n < 0 ? -1 : purge_ranges(db, NULL, moved_tag, max - n);
 
-        // текущая позиция
-        u_int64_t cur_idx=meta.write_idx;
+        if (m < 0) {
+            db->end(false);
+            files.end(false);
+            return -1;
+        }
 
-        // смещаем позицию записи на один
-        meta.write_idx++;
+        int removed = n + m;
 
-        // очередь полна, ошибка, ничего не изменяем, в т.ч. указатели остаются на своих местах
-        if (meta.write_idx == meta.read_idx || (meta.read_idx == meta.start_pos && meta.write_idx == meta.end_pos)) {
-            return false;
-		}
+        // пока перенесенные ключи не удалены, найденные сканированием не трогаем: среди них могут быть
+        // ключи с файлами, которые теперь принадлежат копиям
+        std::string record;
+        bool moving = db->get(std::string(moved_tag, sizeof(moved_tag) - 1), record);
 
-        // если позиция записи вышла за допустимые пределы перескакиваем в начало
-        if (meta.write_idx == meta.end_pos) {
-            meta.write_idx = meta.start_pos;
-		}
+        // ключи, найденные при сканировании: очередь могла снова занять позицию, поэтому перепроверяем
+        for (; !moving && removed < max && !orphans.empty(); orphans.pop_front()) {
+            const std::string& key = orphans.front();
+            std::map<u_int32_t, meta_data> queues;
 
-        // увеличиваем значение счетчика элементов в очереди
-        meta.count++;
+            if (key.length() == sizeof(u_int32_t) + sizeof(u_int64_t)) {
+                u_int32_t idx;
+                u_int64_t pos;
+                parse_slot_key(key, ordered, idx, pos);
 
-        // пытаемся начать транзакцию изменения БД
-        if (!db->begin_transaction(hard_transaction)) {
-            return false;
-		}
+                std::set<u_int32_t> indexes;
+                indexes.insert(idx);
+                load_queues(db, indexes, queues);
+            } else {
+                load_queues(db, rings, queues);
+            }
 
-        // пишем префикс
-        if (!db->set((char*)&cur_idx, sizeof(cur_idx), value.c_str(), value.length())) {
-			db->end_transaction(false);
-			return false;
-		}
+            if (
+                is_orphan(queues, ordered, key) && !is_service_key(db, catalog, key) && !is_migration_copy(db, ordered, key)
+                && remove_slot(db, &files, key)
+            ) {
+                removed++;
+            }
+        }
 
-        // пишем метаданные
-        if (!db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))) {
-			db->end_transaction(false);
-			return false;
+        if (!db->end(true)) {
+            files.end(false);
+            return -1;
 		}
 
-        // коммитим транзакцию
-        if (!db->end_transaction(true)) {
-            return false;
-		}
+        files.end(true);
 
-        if (cur_num) {
-            *cur_num=meta.count;
-		}
+        // шаг дефрагментации пропорционально удаленному
+        if (removed > 0) {
+            db->compact(removed);
+        }
 
-        return true;
+        return removed;
     }
 
-    bool queue::pop_back(std::string& value)
+    static bool claim_after(const claim_range& a, const claim_range& b)
     {
-        value.clear();
-
-        if (!db) {
-            return false;
-		}
-
-        // пытаемся получить метаданные
-        meta_data meta;
-        if (db->get((char*)&key, sizeof(key), (char*)&meta, sizeof(meta)) != sizeof(meta)) {
-            return false;
-		}
-
-        // если позиция чтения вышла за допустимые пределы перескакиваем в начало
-        if (meta.read_idx == meta.end_pos) {
-            meta.read_idx = meta.start_pos;
-		}
+        return a.to > b.to;
+    }
 
-        // очередь пуста, ошибка, ничего не изменяем, в т.ч. указатели остаются на своих местах
-        if (meta.read_idx == meta.write_idx) {
-            return false;
-		}
+    bool storage::recover_claims(void)
+    {
+        std::string tag(claims_tag, sizeof(claims_tag) - 1), record;
 
-        // текущая позиция
-        u_int64_t cur_idx=meta.read_idx;
+        if (!db->get(tag, record)) {
+            return true;
+        }
 
-        // смещаем позицию чтения на один
-        meta.read_idx++;
+        std::vector<claim_range> claims(record.length() / sizeof(claim_range));
+        if (!claims.empty()) {
+            memcpy((char*)&claims[0], record.data(), claims.size() * sizeof(claim_range));
+        }
 
-        // уменьшаем значение счетчика элементов в очереди
-        meta.count--;
+        // с конца: каждая пачка тогда оказывается сразу перед позицией чтения и возвращается на свое место
+        std::sort(claims.begin(), claims.end(), claim_after);
 
-        // пытаемся начать транзакцию изменения БД
-        if (!db->begin_transaction(hard_transaction)) {
+        if (!db->begin()) {
             return false;
 		}
 
-        // читаем значение и удаляем эелемент
-        if (!db->get(std::string((char*)&cur_idx, sizeof(cur_idx)), &value)) {
-            value.clear();
-		}
-
-        db->remove((char*)&cur_idx, sizeof(cur_idx));
-
-        // сохраняем метаданные
-        if (!db->set((char*)&key, sizeof(key), (char*)&meta, sizeof(meta))) {
-            db->end_transaction(false);
-			return false;
-		}
+        // что из пачки было подтверждено - неизвестно, возвращаем всю (возможна повторная доставка)
+        for (std::vector<claim_range>::iterator it = claims.begin(); it != claims.end(); ++it) {
+            if (!restore_claim(db, NULL, it->idx, it->ordered, it->from, it->from, it->to)) {
+                db->end(false);
+                return false;
+            }
+        }
 
-        // коммитим транзакцию
-        if (!db->end_transaction(true)) {
+        if (!db->remove(tag)) {
+            db->end(false);
             return false;
-		}
+        }
 
-        return true;
+        return db->end(true);
     }
 
     u_int32_t storage::size(void)
@@ -345,30 +1661,82 @@ namespace persist
         return gmeta.count;
     }
 
+    // собирает имена очередей из ключей вида @имя@
+    class queue_names : public visitor
+    {
+    public:
+        std::list<std::string> names;
+
+        void visit(const char* key, size_t klen)
+        {
+            if (klen > 2 && key[0] == '@' && key[klen - 1] == '@') {
+                names.push_back(std::string(key + 1, klen - 2));
+			}
+        }
+    };
+
+    bool storage::load_catalog(void)
+    {
+        catalog.clear();
+
+        std::string record;
+
+        if (db->get(std::string(catalog_tag, sizeof(catalog_tag) - 1), record)) {
+            std::stringstream ss(record);
+            u_int32_t idx;
+            std::string name;
+
+            while (ss >> idx && ss.get() == ' ' && std::getline(ss, name)) {
+                catalog[name] = idx;
+            }
+
+            return true;
+        }
+
+        // БД без каталога: один раз обходим все ключи и сохраняем каталог
+        queue_names aliases;
+        if (!db->iterate(aliases)) {
+            return false;
+        }
+
+        for (std::list<std::string>::iterator it = aliases.names.begin(); it != aliases.names.end(); ++it) {
+            std::string key = '@' + *it + '@';
+            u_int32_t idx;
+
+            if (db->get(key.c_str(), key.length(), (char*)&idx, sizeof(idx)) == sizeof(idx)) {
+                catalog[*it] = idx;
+            }
+        }
+
+        return db->set(std::string(catalog_tag, sizeof(catalog_tag) - 1), catalog_record(catalog));
+    }
+
     bool storage::list(std::stringstream& ss)
     {
         if (!db) {
             return false;
 		}
 
-        DB::Cursor* cur = db->cursor();
+        for (std::map<std::string, u_int32_t>::const_iterator it = catalog.begin(); it != catalog.end(); ++it) {
+            ss << it->first << '\n';
+        }
+
+        return true;
+    }
 
-        if (!cur) {
+    bool storage::list_sizes(std::stringstream& ss)
+    {
+        if (!db) {
             return false;
 		}
 
-        cur->jump();
-
-        std::string key, value;
-
-        while (cur->get(&key, &value, true)) {
-            if (key.length() > 2 && key[0] == '@' && key[key.length() - 1] == '@') {
-                ss << key.substr(1, key.length() - 2) << '\n';
-			}
+        for (std::map<std::string, u_int32_t>::const_iterator it = catalog.begin(); it != catalog.end(); ++it) {
+            queue q;
+            q.db = db;
+            q.key = it->second;
+            ss << it->first << ' ' << q.size() << '\n';
         }
 
-        delete cur;
-
         return true;
     }
 }
@@ -8,27 +8,91 @@
 
 #include <sys/types.h>
 #include <sstream>
-#include <kchashdb.h>
+#include <map>
+#include <set>
+#include <list>
+#include "backend.h"
 
 namespace persist
 {
+    // крупные сообщения вне БД: каждое в отдельном файле каталога dir (подкаталоги по младшему байту номера),
+    // в БД вместо сообщения лежит короткая ссылка (номер и длина файла); клиенту файл отдается через sendfile,
+    // файл удаляется вместе с элементом очереди после коммита транзакции
+    class blobs
+    {
+    protected:
+        std::string dir;
+
+        bool sync;
+
+        std::list<std::string> unlinks; // ссылки удаленных в текущей транзакции элементов
+    public:
+        size_t threshold;               // сообщения от этого размера выносятся в файлы (0 - не выносить)
+
+        u_int64_t next_id;              // номер следующего файла (запись #blobs пишется вместе с элементом)
+
+        blobs(void):sync(false),threshold(0),next_id(0) {}
+
+        // открыть (создать) каталог файлов, sync - fsync каждого файла перед коммитом ссылки на него
+        bool open(const std::string& _dir,size_t _threshold,bool _sync);
+
+        // закрыть (при необходимости удалив все файлы)
+        void close(bool _remove=false);
+
+        bool is_open(void) { return !dir.empty(); }
+
+        // значение из БД - ссылка на файл
+        static bool is_ref(const char* p,size_t len);
+        static bool is_ref(const std::string& value) { return is_ref(value.data(),value.length()); }
+
+        // путь к файлу по ссылке
+        std::string path(const std::string& ref);
+
+        // записать сообщение в новый файл, ref - ссылка для записи в БД
+        bool put(const std::string& value,std::string& ref);
+
+        // открыть файл на чтение (возвращает дескриптор или -1, length - длина сообщения)
+        int open_ref(const std::string& ref,off_t& length);
+
+        // прочитать сообщение из файла целиком
+        bool load(const std::string& ref,std::string& value);
+
+        // файл ссылки на месте
+        bool exists(const std::string& ref);
+
+        // удалить файл сразу (ссылка на него не попала в БД)
+        void remove(const std::string& ref);
+
+        // удалить файл после завершения транзакции, удаляющей элемент
+        void remove_later(const std::string& ref) { unlinks.push_back(ref); }
+
+        // транзакция завершена: при коммите удаляем отложенные файлы, при откате забываем про них
+        void end(bool commit);
+    };
+
     class queue
     {
     protected:
-        kyotocabinet::BasicDB* db;
+        backend* db;
 
-        bool hard_transaction;
+        blobs* files;
 
         u_int32_t key;
+
+        bool ordered;
+
+        // транзакция завершена - удалить (или забыть) файлы удаленных элементов
+        void end_files(bool commit) { if (files) files->end(commit); }
     public:
-        queue(void):db(NULL),hard_transaction(false),key(0) {}
+        queue(void):db(NULL),files(NULL),key(0),ordered(false) {}
 
         ~queue(void) {}
 
         // поместить в очередь значение
         bool push_front(const std::string& value,int max_num,int* cur_num);
 
-        // забрать из очереди очередной элемент
+        // забрать из очереди очередной элемент (если файл вынесенного сообщения не прочитать - false,
+        // элемент и файл остаются на месте)
         bool pop_back(std::string& value);
 
         // получить количество элементов в очереди
@@ -40,43 +104,141 @@ namespace persist
         // очистить
         bool clear(void);
 
+        // поставить очередь-кольцо в список переноса в растущую очередь, сами элементы переносятся порциями
+        // storage::migrate (возвращает количество переносимых элементов, 0 - очередь уже растущая, -1 - ошибка)
+        int migrate(void);
+
+        // одной транзакцией удалить подтвержденную пачку [done_from, done_to) и забрать следующую: не больше max
+        // сообщений и (кроме первого) max_bytes байт, from - позиция первого; ключи остаются в БД до удаления
+        // следующим вызовом или release (возвращает количество, -1 - очередь-кольцо или ошибка)
+        int claim(u_int64_t done_from,u_int64_t done_to,int max,size_t max_bytes,u_int64_t& from,std::list<std::string>& values);
+
+        // вернуть в очередь неподтвержденные сообщения пачки [acked, to), подтвержденные [from, acked) удалить
+        bool release(u_int64_t from,u_int64_t acked,u_int64_t to);
+
         friend class storage;
+        friend class readahead;
+    };
+
+    // упреждающее чтение из очереди для одной подписки: сообщения забираются пачками (queue::claim)
+    // и отдаются из памяти, при отписке или обрыве соединения неподтвержденные возвращаются в очередь
+    class readahead
+    {
+    protected:
+        queue q;
+
+        u_int64_t from;                 // текущая пачка [from, to)
+        u_int64_t acked;                // позиция, до которой сообщения подтверждены
+        u_int64_t to;
+
+        std::list<std::string> values;  // еще не отданные сообщения пачки
+    public:
+        readahead(void):from(0),acked(0),to(0) {}
+
+        void attach(const queue& _q) { q = _q; }
+
+        queue& get_queue(void) { return q; }
+
+        // отдать следующее сообщение (подтверждено должно быть все ранее отданное)
+        bool pop(std::string& value,int max,size_t max_bytes);
+
+        // клиент подтвердил последнее отданное сообщение
+        void ack(void) { if (acked < to - values.size()) acked++; }
+
+        // вернуть неподтвержденные сообщения в очередь
+        bool release(void);
     };
 
     class storage
     {
     protected:
-        kyotocabinet::BasicDB* db;
+        backend* db;
+
+        bool ordered;                   // ключи элементов в big-endian (БД создана этой версией или преобразована convert_keys)
+
+        std::map<std::string,u_int32_t> catalog;        // каталог именованных очередей (имя -> индекс), копия записи #queues
+
+        // загрузить каталог (в старой БД он один раз собирается по ключам @имя@)
+        bool load_catalog(void);
+
+        // вернуть в очереди пачки, забранные readahead до сбоя
+        bool recover_claims(void);
 
-        bool hard_transaction;
+        std::list<std::string> orphans;                 // осиротевшие элементы, найденные scan_orphans
+        std::set<u_int32_t> rings;                      // индексы очередей-колец на момент scan_orphans
 
-        std::string location;
+        bool sync;
+
+        size_t map_size;                                // предельный размер БД для LMDB (0 - по умолчанию)
+
+        blobs files;                                    // крупные сообщения вне БД (open_blobs)
     public:
-        storage(void):db(NULL),hard_transaction(false) {}
+        storage(void):db(NULL),ordered(false),sync(false),map_size(0) {}
 
         ~storage(void) {}
 
         // открыть файл БД
         // path: путь к файлу
-        // type: тип базы (HashDB или TreeDB)
-        // max: максимальное количество элементов в циклической очереди (влияет только на этапе создания новой БД)
+        // type: тип базы (HashDB, TreeDB, LMDB или LevelDB, см. backend.h)
+        // max: размер циклической очереди в старых БД (новые очереди растут по мере необходимости и от него не зависят)
         // sync: принудительная синхронизация с диском (true повышает отказоустойчивость но влияет на производительность)
         bool open(const std::string& path,const std::string& type,u_int32_t max,bool sync=false);
 
+        // предельный размер БД LMDB (адресное пространство отображения), задается до open
+        void set_map_size(size_t n) { map_size = n; }
+
+        // выносить сообщения от threshold байт в файлы каталога dir (0 - не выносить, уже вынесенные
+        // отдаются и удаляются как обычно)
+        bool open_blobs(const std::string& dir,size_t threshold);
+
+        // открыть файл сообщения по ссылке из очереди для отправки (возвращает дескриптор или -1)
+        int open_blob(const std::string& ref,off_t& length) { return files.open_ref(ref,length); }
+
         // получить неименованную очередь по индексу
         bool get_queue_by_index(u_int32_t idx,queue& q);
 
-        // получить именованную очередь по имени (если такой нет, то в БД под нее выделяется новый сегмент)
+        // получить именованную очередь по имени (если такой нет, то она создается)
         bool get_queue_by_name(const std::string& name,queue& q);
 
+        // найти именованную очередь по имени, не создавая ее
+        bool find_queue_by_name(const std::string& name,queue& q);
+
         // закрыть файл БД (при необходимости с удалением)
         void close(bool _remove=false);
 
         // общее количество очередей
         u_int32_t size(void);
 
-        // список очередей (разделитель - '\n')
+        // список очередей (разделитель - '\n'), по каталогу, без обращения к элементам очередей
         bool list(std::stringstream& ss);
+
+        // список очередей с количеством элементов ("имя количество\n")
+        bool list_sizes(std::stringstream& ss);
+
+        // найти элементы, не входящие ни в одну очередь (остатки сброшенных очередей и колец из старых БД),
+        // они удаляются reclaim (возвращает количество найденных, -1 - ошибка)
+        long scan_orphans(void);
+
+        // удалить очередную порцию осиротевших элементов (не больше max) одной транзакцией и сделать шаг
+        // дефрагментации БД (возвращает количество удаленных, -1 - ошибка)
+        int reclaim(int max);
+
+        // есть осиротевшие элементы, ожидающие удаления
+        bool reclaim_pending(void);
+
+        // скопировать очередную порцию (не больше max) элементов переносимого кольца одной транзакцией; после
+        // последней порции кольцо становится растущей очередью (возвращает количество скопированных, -1 - ошибка)
+        int migrate(int max);
+
+        // есть кольца, ожидающие переноса
+        bool migrate_pending(void);
+
+        // ключи элементов очередей упорядочены (big-endian)
+        bool ordered_keys(void) { return ordered; }
+
+        // перевести БД со старыми (little-endian) ключами на упорядоченные, одной транзакцией; кольца становятся
+        // растущими очередями (возвращает количество перенесенных элементов, -1 - ошибка)
+        long convert_keys(void);
     };
 }
 
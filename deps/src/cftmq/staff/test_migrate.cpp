@@ -0,0 +1,145 @@
+// перенос кольца в растущую очередь порциями (SYSTEM cmd=migrate): между порциями из кольца читают и в него пишут,
+// порядок сообщений должен сохраниться; кольцо, опустевшее до конца переноса, становится растущей очередью за копиями
+
+#include "persist.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+// метаданные очереди в БД (как в persist.cpp)
+struct meta_data {
+    u_int64_t write_idx;
+    u_int64_t read_idx;
+    u_int32_t count;
+    u_int64_t start_pos;
+    u_int64_t end_pos;
+};
+
+static int rc = 0;
+
+// превратить очередь idx в кольцо [start, start + 10) с элементами prefix0.. начиная с позиции read (с переносом)
+static void make_ring(persist::backend* b, u_int32_t idx, u_int64_t start, u_int64_t read, int n, const char* prefix)
+{
+    meta_data meta;
+    memset((char*)&meta, 0, sizeof(meta));
+    meta.start_pos = start;
+    meta.end_pos = start + 10;
+    meta.read_idx = read;
+    meta.count = n;
+
+    u_int64_t pos = read;
+    for (int i = 0; i < n; i++) {
+        char value[32];
+        snprintf(value, sizeof(value), "%s%i", prefix, i);
+        b->set((char*)&pos, sizeof(pos), value, strlen(value));
+        if (++pos == meta.end_pos) {
+            pos = meta.start_pos;
+        }
+    }
+    meta.write_idx = pos;
+
+    b->set((char*)&idx, sizeof(idx), (char*)&meta, sizeof(meta));
+}
+
+static void expect_pop(persist::queue& q, const char* expected)
+{
+    std::string value;
+    if (!q.pop_back(value) || value != expected) {
+        printf("pop: '%s' (expected '%s')\n", value.c_str(), expected);
+        rc = 1;
+    }
+}
+
+static void expect_migrate(persist::storage& s, int max, int expected)
+{
+    int n = s.migrate(max);
+    if (n != expected) {
+        printf("migrate: %i (expected %i)\n", n, expected);
+        rc = 1;
+    }
+}
+
+int main(int argc,char** argv)
+{
+    const char* path = "test_migrate.kct";
+
+    persist::storage s;
+    persist::queue old_q, drained_q;
+
+    if (!s.open(path, "TreeDB", 10, false) || !s.get_queue_by_name("old", old_q) || !s.get_queue_by_name("drained", drained_q)) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    u_int32_t old_idx = old_q.index(), drained_idx = drained_q.index();
+
+    s.close();
+
+    persist::backend* b = persist::backend::create("TreeDB");
+    if (b->open(path, false)) {
+        make_ring(b, old_idx, 1000, 1005, 8, "m");
+        make_ring(b, drained_idx, 2000, 2000, 2, "d");
+        b->close();
+    }
+
+    if (s.open(path, "TreeDB", 10, false) && s.get_queue_by_name("old", old_q) && s.get_queue_by_name("drained", drained_q)) {
+        if (old_q.migrate() != 8 || drained_q.migrate() != 2 || !s.migrate_pending()) {
+            printf("migrate not started\n");
+            rc = 1;
+        }
+
+        // порции чередуются с чтением и записью
+        expect_migrate(s, 3, 3);
+        expect_pop(old_q, "m0");
+        old_q.push_front("n0", 0, NULL);
+
+        // кольцо опустело до конца переноса: новая запись идет за единственной копией
+        expect_migrate(s, 1, 1);
+        expect_pop(drained_q, "d0");
+        expect_pop(drained_q, "d1");
+        drained_q.push_front("x", 0, NULL);
+
+        expect_migrate(s, 3, 3);
+        expect_pop(old_q, "m1");
+        expect_migrate(s, 3, 3);
+
+        if (s.migrate_pending()) {
+            printf("migration not finished\n");
+            rc = 1;
+        }
+
+        if (old_q.size() != 7 || drained_q.size() != 1) {
+            printf("sizes: %u %u (expected 7 1)\n", old_q.size(), drained_q.size());
+            rc = 1;
+        }
+
+        const char* rest[] = { "m2", "m3", "m4", "m5", "m6", "m7", "n0" };
+        for (size_t i = 0; i < sizeof(rest) / sizeof(*rest); i++) {
+            expect_pop(old_q, rest[i]);
+        }
+        expect_pop(drained_q, "x");
+
+        old_q.push_front("n1", 0, NULL);
+        expect_pop(old_q, "n1");
+
+        while (s.reclaim_pending() && s.reclaim(1000) > 0) {}
+
+        s.close();
+    }
+
+    // ключи кольца и копии забранных элементов удалены
+    if (s.open(path, "TreeDB", 10, false)) {
+        long n = s.scan_orphans();
+        printf("orphans left: %li (expected 0)\n", n);
+        if (n != 0) {
+            rc = 1;
+        }
+        s.close(true);
+    }
+
+    delete b;
+
+    printf("%s\n", rc ? "FAILED" : "ok");
+
+    return rc;
+}
@@ -0,0 +1,68 @@
+// поиск осиротевших элементов не должен задевать алиасы очередей, у которых длина ключа совпадает
+// с ключом элемента: "@OUTPUT@" (8 байт, как у кольца) и "@abcdefghij@" (12 байт, как у растущей очереди)
+
+#include "persist.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char* names[] = { "OUTPUT", "router", "abcdefghij" };
+
+int main(int argc,char** argv)
+{
+    const char* path = "test_orphans.kct";
+    int rc = 0;
+
+    persist::storage s;
+
+    if (!s.open(path, "TreeDB", 5, false)) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        persist::queue q;
+        if (s.get_queue_by_name(names[i], q)) {
+            q.push_front("MESSAGE\n\nhello", 0, NULL);
+        }
+    }
+
+    s.close();
+
+    // настоящий осиротевший элемент: растущая очередь с индексом, которого нет
+    persist::backend* b = persist::backend::create("TreeDB");
+    if (b->open(path, false)) {
+        char key[12];
+        memset(key, 0, sizeof(key));
+        key[3] = 99;
+        b->set(key, sizeof(key), "x", 1);
+        b->close();
+    }
+
+    if (s.open(path, "TreeDB", 5, false)) {
+        long n = s.scan_orphans();
+        printf("orphans found: %li (expected 1)\n", n);
+        if (n != 1) {
+            rc = 1;
+        }
+
+        while (s.reclaim_pending() && s.reclaim(1000) > 0) {}
+
+        s.close();
+    }
+
+    if (b->open(path, false)) {
+        for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+            std::string alias = std::string("@") + names[i] + "@", value;
+            bool ok = b->get(alias, value);
+            printf("%s: %s\n", alias.c_str(), ok ? "ok" : "REMOVED");
+            if (!ok) {
+                rc = 1;
+            }
+        }
+        b->close(true);
+    }
+
+    delete b;
+
+    return rc;
+}
@@ -11,15 +11,15 @@ int main(int argc,char** argv)
 
         if(s.get_queue_by_name("test1",q))
         {
-            q.push_front("111");
-            q.push_front("222");
+            q.push_front("111",0,NULL);
+            q.push_front("222",0,NULL);
 
             printf("%i\n",q.size());
             q.clear();
             printf("%i\n",q.size());
 
-            q.push_front("333");
-            q.push_front("444");
+            q.push_front("333",0,NULL);
+            q.push_front("444",0,NULL);
 
         }
 
@@ -35,7 +35,7 @@ int main(int argc,char** argv)
                 {
                     char buf[256]; int n=sprintf(buf,"%ivalue%i",idx,i);
 
-                    bool rc=q.push_front(std::string(buf,n));
+                    bool rc=q.push_front(std::string(buf,n),0,NULL);
 
                     printf("%i: %s\n",i,rc?"true":"false");
                 }
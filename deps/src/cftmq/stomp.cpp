@@ -179,7 +179,9 @@ int stomp::parser::parse(const char* s, int len) {
                     // конец фрейма - требуется обработка
                     if (parent) {
                         std::string s = data.str();
-                        parent->onstomp(command, headers, s, ctx);
+                        if (parent->onstomp(command, headers, s, ctx)) {
+                            return -1;
+                        }
                     }
 #ifdef TRY_PARSER
                     printf("command: '%s'\n", command.c_str());
@@ -13,6 +13,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 bool stomp::connection::connect(const std::string& addr) {
     std::string::size_type n=addr.find(':');
@@ -43,10 +45,12 @@ bool stomp::connection::connect(const std::string& addr) {
         if (!::connect(fd, (sockaddr*) &sin, sizeof(sin))) {
             int on = 1;
             setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
-            fp = fdopen(fd, "a+");
-            if (fp) {
-                return true;
+            if (!rbuf) {
+                rbuf = new char[buffer_size];
             }
+            rpos = rlen = 0;
+            this->fd = fd;
+            return true;
         }
 
         ::close(fd);
@@ -56,90 +60,248 @@ bool stomp::connection::connect(const std::string& addr) {
 }
 
 void stomp::connection::close(void) {
-    if (fp) {
-        fclose(fp);
-        fp = NULL;
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    rpos = rlen = 0;
+}
+
+bool stomp::connection::fill(void) {
+    if (fd == -1) {
+        return false;
+    }
+
+    // сдвигаем неразобранный остаток в начало буфера
+    if (rpos > 0) {
+        if (rlen > rpos) {
+            memmove(rbuf, rbuf + rpos, rlen - rpos);
+        }
+        rlen -= rpos;
+        rpos = 0;
+    }
+
+    if (rlen >= buffer_size) {
+        return false;
+    }
+
+    // EINTR не повторяем - прерывание по alarm() означает таймаут
+    ssize_t n = ::read(fd, rbuf + rlen, buffer_size - rlen);
+    if (n <= 0) {
+        return false;
+    }
+
+    rlen += n;
+
+    return true;
+}
+
+bool stomp::connection::readline(std::string& s) {
+    s.clear();
+
+    for (;;) {
+        char* p = (char*) memchr(rbuf + rpos, '\n', rlen - rpos);
+
+        if (p) {
+            s.append(rbuf + rpos, p - (rbuf + rpos));
+            rpos = p - rbuf + 1;
+            break;
+        }
+
+        // строка длиннее буфера - накапливаем по частям, но не больше max_line_length
+        s.append(rbuf + rpos, rlen - rpos);
+        rpos = rlen;
+
+        if (s.length() > max_line_length) {
+            return false;
+        }
+
+        if (!fill()) {
+            return false;
+        }
+    }
+
+    if (s.length() > max_line_length) {
+        return false;
     }
+
+    if (!s.empty() && s[s.length() - 1] == '\r') {
+        s.resize(s.length() - 1);
+    }
+
+    return true;
 }
 
 bool stomp::connection::send(const frame& f) {
-    if (fprintf(fp, "%s\n", f.command.c_str()) < 0) {
+    if (fd == -1) {
         return false;
     }
 
+    // все заголовки собираем в один буфер, тело и завершающий \0 отправляем одним writev
+    std::string hdrs;
+    hdrs.reserve(256);
+    hdrs += f.command;
+    hdrs += '\n';
+
     for (
         std::map<std::string, std::string>::const_iterator i = f.hdrs.begin();
         i != f.hdrs.end();
         ++i
     ) {
-        if (fprintf(fp, "%s:%s\n", i->first.c_str(), i->second.c_str()) < 0) {
-            return false;
+        if (i->first == "content-length") {
+            continue;
         }
-    }
-    if (fprintf(fp, "content-length:%i\n\n", (int) f.data.length()) < 0) {
-        return false;
+        hdrs += i->first;
+        hdrs += ':';
+        hdrs += i->second;
+        hdrs += '\n';
     }
 
-    if (fwrite(f.data.c_str(), f.data.length() + 1, 1, fp) != 1) {
-        return false;
-    }
+    char buf[64];
+    int n = sprintf(buf, "content-length:%lu\n\n", (unsigned long) f.data.length());
+    hdrs.append(buf, n);
 
-    if (!fflush(fp)) {
-        return true;
+    static const char eof[1] = { 0 };
+
+    iovec iov[3];
+    iov[0].iov_base = (void*) hdrs.data();
+    iov[0].iov_len = hdrs.length();
+    iov[1].iov_base = (void*) f.data.data();
+    iov[1].iov_len = f.data.length();
+    iov[2].iov_base = (void*) eof;
+    iov[2].iov_len = sizeof(eof);
+
+    for (int idx = 0; idx < 3;) {
+        if (!iov[idx].iov_len) {
+            idx++;
+            continue;
+        }
+
+        ssize_t l = ::writev(fd, iov + idx, 3 - idx);
+        if (l <= 0) {
+            return false;
+        }
+
+        // частичная запись - сдвигаем вектор
+        while (idx < 3 && (size_t) l >= iov[idx].iov_len) {
+            l -= iov[idx].iov_len;
+            iov[idx].iov_len = 0;
+            idx++;
+        }
+
+        if (idx < 3) {
+            iov[idx].iov_base = (char*) iov[idx].iov_base + l;
+            iov[idx].iov_len -= l;
+        }
     }
 
-    return false;
+    return true;
 }
 
 bool stomp::connection::recv(frame& f) {
     f.clear();
-    char buf[256];
+
+    if (fd == -1) {
+        return false;
+    }
+
+    std::string line;
+
     for (int idx = 0;;) {
-        if (!fgets(buf, sizeof(buf), fp)) {
+        if (!readline(line)) {
             return false;
         }
 
-        char* p = strchr(buf, '\n');
-        if (!p) {
-            return false;
-        }
-        *p=0;
         if (!idx) {
-            if (!*buf) {
+            // пропускаем пустые строки и \0 между фреймами
+            std::string::size_type n = line.find_first_not_of('\0');
+            if (n == std::string::npos) {
                 continue;
             }
-            f.command.assign(buf, p - buf);
+            f.command.assign(line, n, std::string::npos);
             idx++;
         } else {
-            if (!*buf) {
+            if (line.empty()) {
                 break;
             }
 
-            char* p2 = strchr(buf, ':');
+            if (++idx > max_headers_num + 1) {
+                return false;
+            }
+
+            std::string::size_type n = line.find(':');
 
-            if (p2) {
-                *p2 = 0;
-                p2++;
-                f.hdrs[buf].assign(p2, p - p2);
+            if (n != std::string::npos) {
+                f.hdrs[line.substr(0, n)].assign(line, n + 1, std::string::npos);
             }
         }
     }
 
+    long len = -1;
+
     std::map<std::string,std::string>::const_iterator it = f.hdrs.find("content-length");
 
     if (it != f.hdrs.end()) {
-        int len = atoi(it->second.c_str());
-        if (len > 0) {
-            f.data.reserve(len);
+        // длину присылает пир - проверяем до выделения памяти
+        const char* s = it->second.c_str();
+        char* e = NULL;
+
+        errno = 0;
+        len = strtol(s, &e, 10);
+
+        if (e == s || *e || errno || len < 0 || len > max_data) {
+            return false;
         }
     }
 
-    for (;;) {
-        int ch = fgetc(fp);
-        if (ch == EOF || ch == 0) {
-            break;
+    if (len >= 0) {
+        // длина известна - забираем остаток буфера и дочитываем тело напрямую из сокета
+        f.data.resize(len);
+
+        long l = rlen - rpos;
+        if (l > len) {
+            l = len;
+        }
+        memcpy(&f.data[0], rbuf + rpos, l);
+        rpos += l;
+
+        while (l < len) {
+            ssize_t n = ::read(fd, &f.data[l], len - l);
+            if (n <= 0) {
+                return false;
+            }
+            l += n;
+        }
+
+        // за телом должен следовать \0
+        if (rpos >= rlen && !fill()) {
+            return false;
+        }
+
+        if (rbuf[rpos] != 0) {
+            return false;
+        }
+        rpos++;
+    } else {
+        // длина неизвестна - ищем \0 поблочно
+        for (;;) {
+            char* p = (char*) memchr(rbuf + rpos, 0, rlen - rpos);
+            if (p) {
+                f.data.append(rbuf + rpos, p - (rbuf + rpos));
+                rpos = p - rbuf + 1;
+                break;
+            }
+            f.data.append(rbuf + rpos, rlen - rpos);
+            rpos = rlen;
+
+            if ((long) f.data.size() > max_data) {
+                return false;
+            }
+
+            if (!fill()) {
+                return false;
+            }
         }
-        f.data += ch;
     }
 
     return true;
@@ -24,11 +24,32 @@ namespace stomp
     class connection
     {
     protected:
-        FILE* fp;
+        // пределы заголовков шире, чем у разборщика брокера (stomp.h): брокер добавляет к заголовкам отправителя свои
+        enum { buffer_size=64*1024, max_data_length=30*1024*1024, max_line_length=4096, max_headers_num=256 };
+
+        int fd;
+
+        // максимальный размер тела принимаемого фрейма
+        long max_data;
+
+        // буфер чтения (данные в диапазоне [rpos,rlen) еще не разобраны)
+        char* rbuf;
+        int rpos;
+        int rlen;
+
+        // дочитать в буфер очередную порцию данных из сокета
+        bool fill(void);
+
+        // прочитать строку заголовка (без завершающего \n и \r), false - ошибка или строка длиннее max_line_length
+        bool readline(std::string& s);
+    private:
+        // буфер rbuf принадлежит соединению - не копируется
+        connection(const connection&);
+        connection& operator=(const connection&);
 
     public:
-        connection(void):fp(NULL) {}
-        ~connection(void) { close(); }
+        connection(void):fd(-1),max_data(max_data_length),rbuf(NULL),rpos(0),rlen(0) {}
+        ~connection(void) { close(); delete[] rbuf; }
 
         bool connect(const std::string& addr);
 
@@ -46,11 +67,13 @@ namespace stomp
 
         bool recv(frame& f);
 
+        void set_max_data(long n) { max_data=n; }
+
         bool ack(const std::string& msgid);
 
         void close(void);
 
-        bool empty(void) { return fp?false:true; }
+        bool empty(void) { return fd==-1?true:false; }
     };
 }
 
@@ -0,0 +1,665 @@
+/*
+ * Генератор нагрузки для cftmq
+ *
+ * Один процесс, несколько потоков, у каждого потока свой epoll и своя доля соединений
+ * производителей (SEND) и потребителей (SUBSCRIBE + ACK). В начало тела каждого сообщения
+ * пишется время отправки, задержку считает потребитель при получении. Итог - JSON.
+ *
+ * Закрытый цикл: -r -w N - у каждого производителя не больше N SEND без RECEIPT.
+ * Открытый цикл: -R rate - сообщения отправляются по расписанию, в тело пишется плановое
+ * время отправки (отставание генератора тоже попадает в задержку).
+ *
+ * ./loadgen -P 4 -C 4 -n 1000000 -s 256-4096 -r -w 32
+ * ./loadgen -P 2 -C 2 -T 30 -R 20000 -s exp:2048 -o result.json
+ */
+
+#include "stomp.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <algorithm>
+
+namespace cfg
+{
+    std::string addr = "127.0.0.1:40090";
+    std::string login = "root";
+    std::string passcode;
+    std::string prefix = "loadgen.";
+    std::string size_spec = "1024";
+    std::string output;
+    int threads = 0;
+    int producers = 1;
+    int consumers = 1;
+    int queues = 0;
+    unsigned long long messages = 100000;
+    double duration = 0;            // > 0 - производители работают заданное время, а не -n сообщений
+    double rate = 0;                // сообщений в секунду на всех производителей, 0 - без ограничения
+    bool receipts = false;
+    int window = 1;
+    double drain = 10;
+}
+
+enum { role_producer, role_consumer };
+
+enum { st_connecting, st_login, st_subscribe, st_ready, st_done, st_closed };
+
+// распределение размеров тела
+struct sizes_t
+{
+    enum { fixed, uniform, exponential } type;
+    unsigned min, max;
+    double mean;
+
+    bool parse(const std::string& s)
+    {
+        char* endptr = NULL;
+        if (!s.compare(0, 4, "exp:")) {
+            type = exponential;
+            mean = strtod(s.c_str() + 4, &endptr);
+            return !*endptr && mean > 0;
+        }
+        min = strtoul(s.c_str(), &endptr, 10);
+        if (*endptr == '-') {
+            type = uniform;
+            max = strtoul(endptr + 1, &endptr, 10);
+            return !*endptr && max >= min;
+        }
+        type = fixed;
+        max = min;
+        return !*endptr;
+    }
+
+    unsigned next(unsigned int* seed) const
+    {
+        switch (type) {
+            case uniform:
+                return min + rand_r(seed) % (max - min + 1);
+            case exponential:
+                return (unsigned) (-mean * log(1.0 - rand_r(seed) / (RAND_MAX + 1.0)));
+            default:
+                return min;
+        }
+    }
+} sizes;
+
+// общие счетчики (меняются атомарно из всех потоков)
+volatile unsigned long long total_sent = 0;
+volatile unsigned long long total_received = 0;
+volatile unsigned long long total_receipts = 0;
+volatile unsigned long long total_errors = 0;
+volatile unsigned long long bytes_sent = 0;
+volatile unsigned long long bytes_received = 0;
+volatile int ready_num = 0;             // соединений, прошедших CONNECT (и SUBSCRIBE)
+volatile int producers_done = 0;
+volatile int failed_num = 0;            // соединений, закрытых из-за ошибки
+volatile bool started = false;
+volatile bool stopped = false;
+
+unsigned long long t0 = 0;              // начало отправки, нс
+unsigned long long t_last_recv = 0;
+
+static unsigned long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct conn_t
+{
+    int fd;
+    int role;
+    int st;
+    int id;
+    std::string dest;
+
+    std::string out;                    // исходящие фреймы, [out_pos, size) еще не отправлено
+    std::string::size_type out_pos;
+    bool want_write;
+
+    stomp::parser parser;
+
+    // производитель
+    unsigned long long quota;           // сколько сообщений отправить (в режиме -n)
+    unsigned long long sent;
+    std::deque<unsigned long long> inflight;    // время отправки SEND, ждущих RECEIPT
+
+    conn_t(void):fd(-1), role(0), st(st_connecting), id(0), out_pos(0), want_write(false), quota(0), sent(0) {}
+};
+
+class worker : public stomp::callback
+{
+public:
+    pthread_t thread;
+    int efd;
+    std::vector<conn_t*> conns;
+    unsigned int seed;
+
+    std::vector<unsigned> latency;          // задержка доставки, мкс
+    std::vector<unsigned> receipt_latency;  // задержка RECEIPT, мкс
+    unsigned long long last_recv;
+
+    worker(void):efd(-1), seed(0), last_recv(0) {}
+
+    bool start(void);
+    void run(void);
+    void close(conn_t* c, bool error);
+    void flush(conn_t* c);
+    void produce(conn_t* c, unsigned long long t);
+    int onstomp(const std::string& command, const std::list<std::string>& headers, std::string& data, void* ctx);
+};
+
+static bool resolve(const std::string& addr, sockaddr_in& sin) {
+    std::string::size_type n = addr.find(':');
+    if (n == std::string::npos) {
+        return false;
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(atoi(addr.substr(n + 1).c_str()));
+    sin.sin_addr.s_addr = inet_addr(addr.substr(0, n).c_str());
+
+    if (sin.sin_addr.s_addr == INADDR_NONE) {
+        hostent* he = gethostbyname(addr.substr(0, n).c_str());
+        if (he) {
+            memcpy((char*) &sin.sin_addr.s_addr, he->h_addr, sizeof(sin.sin_addr.s_addr));
+        }
+    }
+    return sin.sin_addr.s_addr != INADDR_NONE && sin.sin_port;
+}
+
+static void* thread_proc(void* arg) {
+    ((worker*) arg)->run();
+    return NULL;
+}
+
+bool worker::start(void) {
+    sockaddr_in sin;
+    if (!resolve(cfg::addr, sin)) {
+        fprintf(stderr, "** invalid address '%s'\n", cfg::addr.c_str());
+        return false;
+    }
+
+    efd = epoll_create(conns.size() + 1);
+    if (efd == -1) {
+        perror("epoll_create");
+        return false;
+    }
+
+    for (std::vector<conn_t*>::iterator it = conns.begin(); it != conns.end(); ++it) {
+        conn_t* c = *it;
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd == -1) {
+            perror("socket");
+            return false;
+        }
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        int on = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        if (connect(c->fd, (sockaddr*) &sin, sizeof(sin)) && errno != EINPROGRESS) {
+            perror("connect");
+            return false;
+        }
+
+        c->parser.begin(this, c);
+
+        char buf[512];
+        int n = snprintf(
+            buf, sizeof(buf), "CONNECT\nlogin:%s\npasscode:%s\n\n",
+            cfg::login.c_str(), cfg::passcode.c_str()
+        );
+        c->out.append(buf, n);
+        c->out.push_back(0);
+        c->want_write = true;
+
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = c;
+        epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    return !pthread_create(&thread, NULL, thread_proc, this);
+}
+
+void worker::close(conn_t* c, bool error) {
+    if (c->fd == -1) {
+        return;
+    }
+    if (error) {
+        __sync_fetch_and_add(&failed_num, 1);
+        if (c->role == role_producer && c->st != st_done) {
+            __sync_fetch_and_add(&producers_done, 1);
+        }
+    }
+    epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+    ::close(c->fd);
+    c->fd = -1;
+    c->st = st_closed;
+}
+
+void worker::flush(conn_t* c) {
+    while (c->out_pos < c->out.size()) {
+        ssize_t n = ::write(c->fd, c->out.data() + c->out_pos, c->out.size() - c->out_pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            close(c, true);
+            return;
+        }
+        c->out_pos += n;
+    }
+
+    if (c->out_pos == c->out.size()) {
+        c->out.clear();
+        c->out_pos = 0;
+    } else if (c->out_pos > 1024 * 1024) {
+        c->out.erase(0, c->out_pos);
+        c->out_pos = 0;
+    }
+
+    // EPOLLOUT нужен только пока есть что отправлять
+    bool want = c->out_pos < c->out.size();
+    if (want != c->want_write) {
+        epoll_event ev;
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+}
+
+// сформировать очередные SEND с учетом квоты, окна RECEIPT и расписания
+void worker::produce(conn_t* c, unsigned long long t) {
+    static const std::string::size_type max_pending = 256 * 1024;
+
+    while (c->out.size() - c->out_pos < max_pending) {
+        if (cfg::duration > 0 ? t - t0 >= cfg::duration * 1e9 : c->sent >= c->quota) {
+            if (c->inflight.empty() && c->out_pos == c->out.size()) {
+                c->st = st_done;
+                __sync_fetch_and_add(&producers_done, 1);
+            }
+            return;
+        }
+        if (cfg::receipts && c->inflight.size() >= (size_t) cfg::window) {
+            return;
+        }
+
+        unsigned long long stamp = t;
+        if (cfg::rate > 0) {
+            // плановое время очередного сообщения этого производителя
+            double interval = 1e9 * cfg::producers / cfg::rate;
+            stamp = t0 + (unsigned long long) (c->sent * interval);
+            if (stamp > t) {
+                return;
+            }
+        }
+
+        char body[64];
+        int blen = snprintf(body, sizeof(body), "%llu %d %llu ", stamp, c->id, c->sent);
+        unsigned size = std::max((unsigned) blen, sizes.next(&seed));
+
+        char hdr[512];
+        int n;
+        if (cfg::receipts) {
+            n = snprintf(
+                hdr, sizeof(hdr), "SEND\ndestination:%s\nreceipt:%llu\ncontent-length:%u\n\n",
+                c->dest.c_str(), c->sent, size
+            );
+        } else {
+            n = snprintf(
+                hdr, sizeof(hdr), "SEND\ndestination:%s\ncontent-length:%u\n\n",
+                c->dest.c_str(), size
+            );
+        }
+
+        c->out.append(hdr, n);
+        c->out.append(body, blen);
+        c->out.append(size - blen, 'x');
+        c->out.push_back(0);
+
+        if (cfg::receipts) {
+            c->inflight.push_back(t);
+        }
+        c->sent++;
+        __sync_fetch_and_add(&total_sent, 1);
+        __sync_fetch_and_add(&bytes_sent, size);
+    }
+}
+
+int worker::onstomp(const std::string& command, const std::list<std::string>& headers, std::string& data, void* ctx) {
+    conn_t* c = (conn_t*) ctx;
+
+    if (command == "MESSAGE") {
+        unsigned long long t = now();
+        unsigned long long stamp = strtoull(data.c_str(), NULL, 10);
+        if (stamp && stamp <= t) {
+            latency.push_back((t - stamp) / 1000);
+        }
+        last_recv = t;
+        __sync_fetch_and_add(&total_received, 1);
+        __sync_fetch_and_add(&bytes_received, data.size());
+
+        // брокер отдает следующее сообщение только после ACK
+        for (std::list<std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+            if (!it->compare(0, 11, "message-id:")) {
+                c->out.append("ACK\n" + *it + "\n\n");
+                c->out.push_back(0);
+                break;
+            }
+        }
+    } else if (command == "RECEIPT") {
+        if (c->st == st_subscribe) {
+            c->st = st_ready;
+            __sync_fetch_and_add(&ready_num, 1);
+        } else if (!c->inflight.empty()) {
+            receipt_latency.push_back((now() - c->inflight.front()) / 1000);
+            c->inflight.pop_front();
+            __sync_fetch_and_add(&total_receipts, 1);
+        }
+    } else if (command == "CONNECTED") {
+        if (c->role == role_consumer) {
+            char buf[512];
+            int n = snprintf(
+                buf, sizeof(buf), "SUBSCRIBE\ndestination:%s\nack:client\nreceipt:subscribe\n\n",
+                c->dest.c_str()
+            );
+            c->out.append(buf, n);
+            c->out.push_back(0);
+            c->st = st_subscribe;
+        } else {
+            c->st = st_ready;
+            __sync_fetch_and_add(&ready_num, 1);
+        }
+    } else if (command == "ERROR") {
+        __sync_fetch_and_add(&total_errors, 1);
+        if (c->st != st_ready) {
+            fprintf(stderr, "** connection %d: %s", c->id, data.c_str());
+            close(c, true);
+            return 0;
+        }
+        // отказ в SEND приходит вместо RECEIPT
+        if (!c->inflight.empty()) {
+            c->inflight.pop_front();
+        }
+    }
+
+    return 0;
+}
+
+void worker::run(void) {
+    static const int max_events = 256;
+    epoll_event events[max_events];
+    char buf[64 * 1024];
+
+    while (!stopped) {
+        int timeout = cfg::rate > 0 ? 1 : 10;
+        int n = epoll_wait(efd, events, max_events, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            conn_t* c = (conn_t*) events[i].data.ptr;
+
+            if (c->st == st_connecting) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) {
+                    fprintf(stderr, "** connection %d: %s\n", c->id, strerror(err));
+                    close(c, true);
+                    continue;
+                }
+                c->st = st_login;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                for (;;) {
+                    ssize_t len = ::read(c->fd, buf, sizeof(buf));
+                    if (len < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (len < 0 && errno == EAGAIN) {
+                        break;
+                    }
+                    if (len <= 0 || c->parser.parse(buf, len) || c->fd == -1) {
+                        close(c, c->st != st_done || len < 0);
+                        break;
+                    }
+                    if (len < (ssize_t) sizeof(buf)) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        unsigned long long t = now();
+
+        for (std::vector<conn_t*>::iterator it = conns.begin(); it != conns.end(); ++it) {
+            conn_t* c = *it;
+            if (c->fd == -1) {
+                continue;
+            }
+            if (c->role == role_producer && c->st == st_ready && started) {
+                produce(c, t);
+            }
+            if (c->st != st_connecting && c->out_pos < c->out.size()) {
+                flush(c);
+            }
+        }
+    }
+
+    for (std::vector<conn_t*>::iterator it = conns.begin(); it != conns.end(); ++it) {
+        close(*it, false);
+    }
+    ::close(efd);
+}
+
+// перцентили задержки в JSON
+static void print_latency(FILE* fp, const char* name, std::vector<unsigned>& v) {
+    fprintf(fp, "  \"%s\": {\"count\": %lu", name, (unsigned long) v.size());
+    if (!v.empty()) {
+        std::sort(v.begin(), v.end());
+        double sum = 0;
+        for (size_t i = 0; i < v.size(); i++) {
+            sum += v[i];
+        }
+        static const double pct[] = { 50, 90, 99, 99.9 };
+        static const char* names[] = { "p50", "p90", "p99", "p999" };
+        fprintf(fp, ", \"min\": %u, \"mean\": %.1f", v.front(), sum / v.size());
+        for (size_t i = 0; i < sizeof(pct) / sizeof(*pct); i++) {
+            size_t k = (size_t) ceil(pct[i] / 100 * v.size());
+            fprintf(fp, ", \"%s\": %u", names[i], v[k ? k - 1 : 0]);
+        }
+        fprintf(fp, ", \"max\": %u", v.back());
+    }
+    fprintf(fp, "}");
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "USAGE: loadgen [options]\n"
+        "-a host:port   broker address (default %s)\n"
+        "-u login       login (default %s)\n"
+        "-k passcode    passcode\n"
+        "-t threads     worker threads (default - number of CPUs)\n"
+        "-P producers   producer connections (default 1)\n"
+        "-C consumers   consumer connections (default 1)\n"
+        "-q queues      number of queues <prefix>N (default - number of consumers)\n"
+        "-d prefix      queue name prefix (default %s)\n"
+        "-n messages    messages to send in total (default %llu)\n"
+        "-T seconds     send for the given time instead of -n\n"
+        "-s size        body size: N, min-max (uniform) or exp:mean (default %s)\n"
+        "-R rate        open loop: messages per second for all producers\n"
+        "-r             request RECEIPT for every SEND\n"
+        "-w window      closed loop: max SENDs without RECEIPT per producer (with -r, default 1)\n"
+        "-D seconds     how long to wait for the rest of messages after sending (default 10)\n"
+        "-o file        write JSON result to file instead of stdout\n",
+        cfg::addr.c_str(), cfg::login.c_str(), cfg::prefix.c_str(), cfg::messages, cfg::size_spec.c_str());
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ha:u:k:t:P:C:q:d:n:T:s:R:rw:D:o:")) > 0) {
+        switch (opt) {
+            case 'a': cfg::addr = optarg; break;
+            case 'u': cfg::login = optarg; break;
+            case 'k': cfg::passcode = optarg; break;
+            case 't': cfg::threads = atoi(optarg); break;
+            case 'P': cfg::producers = atoi(optarg); break;
+            case 'C': cfg::consumers = atoi(optarg); break;
+            case 'q': cfg::queues = atoi(optarg); break;
+            case 'd': cfg::prefix = optarg; break;
+            case 'n': cfg::messages = strtoull(optarg, NULL, 10); break;
+            case 'T': cfg::duration = atof(optarg); break;
+            case 's': cfg::size_spec = optarg; break;
+            case 'R': cfg::rate = atof(optarg); break;
+            case 'r': cfg::receipts = true; break;
+            case 'w': cfg::window = atoi(optarg); break;
+            case 'D': cfg::drain = atof(optarg); break;
+            case 'o': cfg::output = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (!sizes.parse(cfg::size_spec) || cfg::producers < 1 || cfg::consumers < 0 || cfg::window < 1) {
+        usage();
+        return 1;
+    }
+    if (cfg::queues < 1) {
+        cfg::queues = cfg::consumers > 0 ? cfg::consumers : 1;
+    }
+    if (cfg::threads < 1) {
+        cfg::threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    int total = cfg::producers + cfg::consumers;
+    if (cfg::threads > total) {
+        cfg::threads = total;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // соединения распределяются по потокам по кругу
+    std::vector<worker> workers(cfg::threads);
+    std::vector<conn_t> conns(total);
+    for (int i = 0; i < total; i++) {
+        conn_t& c = conns[i];
+        c.id = i;
+        c.role = i < cfg::producers ? role_producer : role_consumer;
+        int q = c.role == role_producer ? i : i - cfg::producers;
+        char buf[32];
+        sprintf(buf, "%d", q % cfg::queues);
+        c.dest = cfg::prefix + buf;
+        if (c.role == role_producer) {
+            c.quota = cfg::messages / cfg::producers + ((unsigned long long) i < cfg::messages % cfg::producers);
+        }
+        workers[i % cfg::threads].conns.push_back(&c);
+    }
+
+    for (int i = 0; i < cfg::threads; i++) {
+        workers[i].seed = i + 1;
+        if (!workers[i].start()) {
+            return 1;
+        }
+    }
+
+    // ждем, пока все войдут и подпишутся
+    unsigned long long t = now();
+    while (ready_num + failed_num < total && now() - t < 10e9) {
+        usleep(1000);
+    }
+    if (ready_num < total) {
+        fprintf(stderr, "** only %d of %d connections are ready\n", ready_num, total);
+        stopped = true;
+        for (int i = 0; i < cfg::threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        return 1;
+    }
+
+    t0 = now();
+    __sync_synchronize();
+    started = true;
+
+    while (producers_done < cfg::producers) {
+        usleep(1000);
+    }
+    unsigned long long t_sent = now();
+
+    // дожидаемся доставки оставшихся сообщений
+    if (cfg::consumers > 0) {
+        while (total_received < total_sent && now() - t_sent < cfg::drain * 1e9) {
+            usleep(1000);
+        }
+    }
+
+    stopped = true;
+    std::vector<unsigned> latency, receipt_latency;
+    for (int i = 0; i < cfg::threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        latency.insert(latency.end(), workers[i].latency.begin(), workers[i].latency.end());
+        receipt_latency.insert(receipt_latency.end(), workers[i].receipt_latency.begin(), workers[i].receipt_latency.end());
+        t_last_recv = std::max(t_last_recv, workers[i].last_recv);
+    }
+
+    double send_time = (t_sent - t0) / 1e9;
+    double recv_time = t_last_recv > t0 ? (t_last_recv - t0) / 1e9 : 0;
+
+    FILE* fp = stdout;
+    if (!cfg::output.empty() && !(fp = fopen(cfg::output.c_str(), "w"))) {
+        perror(cfg::output.c_str());
+        return 1;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp,
+        "  \"config\": {\"addr\": \"%s\", \"threads\": %d, \"producers\": %d, \"consumers\": %d, \"queues\": %d, "
+        "\"messages\": %llu, \"duration\": %g, \"size\": \"%s\", \"rate\": %g, \"receipts\": %s, \"window\": %d},\n",
+        cfg::addr.c_str(), cfg::threads, cfg::producers, cfg::consumers, cfg::queues,
+        cfg::messages, cfg::duration, cfg::size_spec.c_str(), cfg::rate, cfg::receipts ? "true" : "false",
+        cfg::window);
+    fprintf(fp,
+        "  \"sent\": %llu,\n  \"received\": %llu,\n  \"receipts\": %llu,\n  \"errors\": %llu,\n  \"failed_connections\": %d,\n",
+        total_sent, total_received, total_receipts, total_errors, failed_num);
+    fprintf(fp,
+        "  \"send_seconds\": %.3f,\n  \"send_rate\": %.1f,\n  \"send_mbps\": %.2f,\n",
+        send_time, send_time > 0 ? total_sent / send_time : 0, send_time > 0 ? bytes_sent / send_time / 1048576 : 0);
+    fprintf(fp,
+        "  \"recv_seconds\": %.3f,\n  \"recv_rate\": %.1f,\n  \"recv_mbps\": %.2f,\n",
+        recv_time, recv_time > 0 ? total_received / recv_time : 0, recv_time > 0 ? bytes_received / recv_time / 1048576 : 0);
+    print_latency(fp, "latency_us", latency);
+    fprintf(fp, ",\n");
+    print_latency(fp, "receipt_latency_us", receipt_latency);
+    fprintf(fp, "\n}\n");
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    return failed_num || (cfg::consumers > 0 && total_received < total_sent) ? 2 : 0;
+}
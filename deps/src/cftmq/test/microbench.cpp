@@ -0,0 +1,547 @@
+/*
+ * Микробенчмарки внутренностей cftmq (make bench)
+ *
+ * parser    - stomp::parser::parse на маленьких и больших фреймах, целиком и кусками
+ * persist   - persist::queue push_front/pop_back для каждого db_type (движка) и hard_transaction,
+ *             в т.ч. на смеси размеров сообщений (сравнение движков для конкретной площадки),
+ *             и чтение подписчиком (readahead) с крупными сообщениями в БД и в файлах
+ * users     - users::user::validate для md5 и sha256
+ * onstomp   - обработка SEND ядром (в persist, напрямую подписчику, с RECEIPT) без сети:
+ *             соединения - socketpair, событие libevent назначено, но цикл не крутится
+ *
+ * Каждый результат - одна строка JSON в stdout:
+ * {"bench": "parser.small", "ops": 1000000, "ns_per_op": 250.1, "ops_per_sec": 3998400.6, "mb_per_sec": 381.3}
+ *
+ * ./microbench [-t секунд на тест] [-d каталог для БД] [подстрока имени теста]
+ */
+
+#include "core.h"
+#include "persist.h"
+#include "users.h"
+#include "stomp.h"
+#include "md5.h"
+#include "sha256.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <algorithm>
+
+namespace cfg
+{
+    double min_time = 0.5;
+    std::string dir = "/tmp";
+    std::string filter;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// тест выполняет n операций и возвращает затраченное на них время (без подготовки)
+typedef double (*bench_fn)(void* ctx, long n);
+
+static void run(const char* name, bench_fn fn, void* ctx, size_t bytes_per_op = 0, long max_ops = 0) {
+    if (!cfg::filter.empty() && !strstr(name, cfg::filter.c_str())) {
+        return;
+    }
+
+    // увеличиваем число операций, пока тест не займет min_time
+    long n = 1;
+    double t = 0;
+    for (;;) {
+        t = fn(ctx, n);
+        if (t >= cfg::min_time || (max_ops && n >= max_ops)) {
+            break;
+        }
+        long next = t > 0 ? (long) (n * cfg::min_time * 1.2 / t) : n * 10;
+        if (next > n * 10) {
+            next = n * 10;
+        }
+        if (next <= n) {
+            next = n * 2;
+        }
+        if (max_ops && next > max_ops) {
+            next = max_ops;
+        }
+        n = next;
+    }
+
+    printf(
+        "{\"bench\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f}\n",
+        name, n, t * 1e9 / n, n / t, bytes_per_op ? bytes_per_op * n / t / 1048576 : 0.0
+    );
+    fflush(stdout);
+}
+
+// --- stomp::parser ---------------------------------------------------------------------------------
+
+class counter : public stomp::callback
+{
+public:
+    long frames;
+
+    counter(void):frames(0) {}
+
+    int onstomp(const std::string& command, const std::list<std::string>& headers, std::string& data, void* ctx)
+        { frames++; return 0; }
+};
+
+struct parser_ctx
+{
+    std::string frame;
+    int chunk;                      // размер куска, которыми фрейм подается в парсер (0 - целиком)
+};
+
+static std::string make_frame(size_t body_size) {
+    std::string s =
+        "SEND\n"
+        "destination:INPUT\n"
+        "doc_id:3f5b5c2e-1d2a-4c7e-9a61-0c6f2b8d7e11\n"
+        "doc_type:MT999\n"
+        "receipt:3f5b5c2e-1d2a-4c7e-9a61-0c6f2b8d7e11\n"
+        "\n";
+    s.append(body_size, 'x');
+    s.push_back(0);
+    return s;
+}
+
+static double bench_parser(void* arg, long n) {
+    parser_ctx* ctx = (parser_ctx*) arg;
+    counter cb;
+    stomp::parser p;
+    p.begin(&cb, NULL);
+
+    const char* data = ctx->frame.data();
+    int len = ctx->frame.size();
+
+    double t = now();
+    for (long i = 0; i < n; i++) {
+        if (!ctx->chunk) {
+            p.parse(data, len);
+        } else {
+            for (int off = 0; off < len; off += ctx->chunk) {
+                p.parse(data + off, len - off < ctx->chunk ? len - off : ctx->chunk);
+            }
+        }
+    }
+    t = now() - t;
+
+    if (cb.frames != n) {
+        fprintf(stderr, "** parser: %ld frames of %ld\n", cb.frames, n);
+    }
+    return t;
+}
+
+// --- persist::queue --------------------------------------------------------------------------------
+
+enum persist_mode { pm_push, pm_pop, pm_mix, pm_claim };
+
+struct persist_ctx
+{
+    std::string type;
+    bool sync;
+    persist_mode mode;              // pm_pop - очередь заполняется до замера, pm_mix - push+pop при постоянной глубине,
+                                    // pm_claim - то же, но чтение как у подписчика брокера (readahead)
+    size_t blob_threshold;          // сообщения от этого размера - в файлах (0 - все в БД)
+    std::vector<std::string> values;  // значения по кругу (одно - фиксированный размер, много - смесь размеров)
+};
+
+// смесь размеров сообщений в очередях процессинга: квитанции и короткие документы, документы XML,
+// документы с вложениями и редкие крупные вложения
+static const struct { int percent; size_t size; } message_mix[] = {
+    { 60, 1024 },
+    { 30, 8 * 1024 },
+    { 9, 64 * 1024 },
+    { 1, 1024 * 1024 },
+};
+
+static size_t make_mix(std::vector<std::string>& values) {
+    size_t total = 0;
+    values.clear();
+    for (size_t i = 0; i < sizeof(message_mix) / sizeof(*message_mix); i++) {
+        for (int j = 0; j < message_mix[i].percent; j++) {
+            values.push_back(std::string(message_mix[i].size, 'x'));
+            total += message_mix[i].size;
+        }
+    }
+    // перемешиваем детерминированно, чтобы крупные сообщения не шли подряд
+    srand(1);
+    for (size_t i = values.size() - 1; i > 0; i--) {
+        std::swap(values[i], values[rand() % (i + 1)]);
+    }
+    return total / values.size();
+}
+
+static double bench_persist(void* arg, long n) {
+    persist_ctx* ctx = (persist_ctx*) arg;
+    persist::storage s;
+    std::string path = cfg::dir + "/microbench." + ctx->type;
+
+    // удаляем остатки прошлого запуска (LevelDB - каталог)
+    if (s.open(path, ctx->type, 1024, ctx->sync)) {
+        s.open_blobs(path + ".blobs", 0);
+        s.close(true);
+    }
+    if (!s.open(path, ctx->type, 1024, ctx->sync) || !s.open_blobs(path + ".blobs", ctx->blob_threshold)) {
+        fprintf(stderr, "** can't open %s\n", path.c_str());
+        exit(1);
+    }
+
+    persist::queue q;
+    s.get_queue_by_name("bench", q);
+
+    size_t nvalues = ctx->values.size();
+    std::string value;
+    double t = 0;
+
+    switch (ctx->mode) {
+        case pm_push:
+            t = now();
+            for (long i = 0; i < n; i++) {
+                q.push_front(ctx->values[i % nvalues], -1, NULL);
+            }
+            t = now() - t;
+            break;
+        case pm_pop:
+            for (long i = 0; i < n; i++) {
+                q.push_front(ctx->values[i % nvalues], -1, NULL);
+            }
+            t = now();
+            for (long i = 0; i < n; i++) {
+                q.pop_back(value);
+            }
+            t = now() - t;
+            break;
+        case pm_mix:
+            // в очереди постоянно лежит сотня сообщений, как у подписчика с небольшим отставанием
+            for (size_t i = 0; i < 100; i++) {
+                q.push_front(ctx->values[i % nvalues], -1, NULL);
+            }
+            t = now();
+            for (long i = 0; i < n; i++) {
+                q.push_front(ctx->values[i % nvalues], -1, NULL);
+                q.pop_back(value);
+            }
+            t = now() - t;
+            break;
+        case pm_claim:
+            {
+                persist::readahead r;
+                r.attach(q);
+                for (size_t i = 0; i < 100; i++) {
+                    q.push_front(ctx->values[i % nvalues], -1, NULL);
+                }
+                t = now();
+                for (long i = 0; i < n; i++) {
+                    q.push_front(ctx->values[i % nvalues], -1, NULL);
+                    r.pop(value, 32, 4 << 20);
+                    r.ack();
+                }
+                t = now() - t;
+                r.release();
+            }
+            break;
+    }
+
+    s.close(true);
+    return t;
+}
+
+// --- users::user::validate -------------------------------------------------------------------------
+
+struct users_ctx
+{
+    users::user u;
+    std::string passcode;
+};
+
+static double bench_validate(void* arg, long n) {
+    users_ctx* ctx = (users_ctx*) arg;
+    long ok = 0;
+
+    double t = now();
+    for (long i = 0; i < n; i++) {
+        ok += ctx->u.validate(ctx->passcode);
+    }
+    t = now() - t;
+
+    if (ok != n) {
+        fprintf(stderr, "** validate failed\n");
+    }
+    return t;
+}
+
+static std::string hex(const unsigned char* p, int len) {
+    static const char t[] = "0123456789abcdef";
+    std::string s;
+    for (int i = 0; i < len; i++) {
+        s.push_back(t[p[i] >> 4]);
+        s.push_back(t[p[i] & 0x0f]);
+    }
+    return s;
+}
+
+// --- engine::core::onstomp -------------------------------------------------------------------------
+
+static void noop_callback(evutil_socket_t fd, short events, void* arg) {}
+
+// ядро с соединениями без сети: исходящие ответы копятся в queue_out и выбрасываются тестом
+class bench_core : public engine::core
+{
+public:
+    engine::connection* connect(const std::string& identity) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            perror("socketpair");
+            exit(1);
+        }
+        peers.push_back(sv[1]);
+
+        engine::connection* c = new engine::connection;
+        c->fd = sv[0];
+        c->session = sessions.size() + 1;
+        c->addr = "127.0.0.1";
+        c->identity = identity;
+        c->set_role("nolimit");
+        c->st = engine::st_ready;
+        sessions[c->session] = c;
+
+        event_assign(&c->ev, evb, c->fd, EV_READ | EV_PERSIST, noop_callback, c);
+        event_add(&c->ev, NULL);
+        c->proto.begin(this, c);
+        return c;
+    }
+
+    void drain(engine::connection* c) {
+        std::string s;
+        while (c->queue_out.pop_back(s)) {}
+    }
+
+    void finish(void) {
+        done();
+        for (size_t i = 0; i < peers.size(); i++) {
+            ::close(peers[i]);
+        }
+        peers.clear();
+    }
+
+protected:
+    std::vector<int> peers;
+};
+
+struct onstomp_ctx
+{
+    std::string path;
+    std::list<std::string> headers;
+    std::string body;
+    std::string frame;              // не пусто - подавать фрейм через парсер соединения
+    bool subscriber;                // у очереди есть готовый подписчик
+};
+
+static double bench_onstomp(void* arg, long n) {
+    onstomp_ctx* ctx = (onstomp_ctx*) arg;
+    bench_core core;
+
+    unlink(ctx->path.c_str());
+    core.db_blob_dir = ctx->path + ".blobs";
+    if (core.init() || core.open_persist_db(ctx->path)) {
+        fprintf(stderr, "** can't init core\n");
+        exit(1);
+    }
+
+    engine::connection* c = core.connect("producer");
+    engine::connection* s = NULL;
+    if (ctx->subscriber) {
+        s = core.connect("consumer");
+        std::list<std::string> hdrs;
+        hdrs.push_back("destination:bench");
+        hdrs.push_back("ack:client");
+        std::string empty;
+        core.onstomp("SUBSCRIBE", hdrs, empty, s);
+    }
+
+    double t = now();
+    for (long i = 0; i < n; i++) {
+        if (!ctx->frame.empty()) {
+            c->proto.parse(ctx->frame.data(), ctx->frame.size());
+        } else {
+            std::string data(ctx->body);
+            core.onstomp("SEND", ctx->headers, data, c);
+        }
+        core.drain(c);
+        if (s) {
+            // подписчик "подтвердил" сообщение
+            core.drain(s);
+            s->st = engine::st_ready;
+        }
+    }
+    t = now() - t;
+
+    core.finish();
+    unlink(ctx->path.c_str());
+    rmdir(core.db_blob_dir.c_str());
+    return t;
+}
+
+static void usage(void) {
+    fprintf(stderr, "USAGE: microbench [-t seconds per test] [-d dir for databases] [name filter]\n");
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ht:d:")) > 0) {
+        switch (opt) {
+            case 't': cfg::min_time = atof(optarg); break;
+            case 'd': cfg::dir = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        cfg::filter = argv[optind];
+    }
+
+    // парсер: маленький фрейм, большой, и те же фреймы кусками (ядро читает из сокета по 1024 байта)
+    {
+        parser_ctx small, small_split, large, large_split;
+        small.frame = small_split.frame = make_frame(200);
+        large.frame = large_split.frame = make_frame(1024 * 1024);
+        small.chunk = large.chunk = 0;
+        small_split.chunk = 7;
+        large_split.chunk = 1024;
+
+        run("parser.small", bench_parser, &small, small.frame.size());
+        run("parser.small.split7", bench_parser, &small_split, small.frame.size());
+        run("parser.large", bench_parser, &large, large.frame.size());
+        run("parser.large.split1024", bench_parser, &large_split, large.frame.size());
+    }
+
+    // persist: все движки, собранные в брокере (backend.h), с принудительной синхронизацией и без;
+    // push/pop - сообщения по 1 Кб, mix - смесь размеров message_mix, claim - та же смесь через readahead,
+    // claim.blobs - то же с сообщениями от 64 Кб в файлах
+    {
+        static const char* types[] = { "TreeDB", "HashDB", "LMDB", "LevelDB" };
+        static const char* modes[] = { "push", "pop", "mix", "claim", "claim.blobs" };
+
+        for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++) {
+            persist::backend* b = persist::backend::create(types[i]);
+            if (!b) {
+                if (cfg::filter.empty()) {
+                    fprintf(stderr, "%s is not built in, skipped\n", types[i]);
+                }
+                continue;
+            }
+            delete b;
+
+            for (int sync = 0; sync < 2; sync++) {
+                for (int mode = pm_push; mode <= pm_claim + 1; mode++) {
+                    persist_ctx ctx;
+                    ctx.type = types[i];
+                    ctx.sync = sync;
+                    ctx.mode = mode > pm_claim ? pm_claim : (persist_mode) mode;
+                    ctx.blob_threshold = mode > pm_claim ? 64 * 1024 : 0;
+
+                    size_t bytes_per_op;
+                    if (mode >= pm_mix) {
+                        bytes_per_op = make_mix(ctx.values);
+                    } else {
+                        ctx.values.push_back(std::string(1024, 'x'));
+                        bytes_per_op = 1024;
+                    }
+
+                    // с синхронизацией каждая операция пишет на диск, ограничиваем число операций
+                    long max_ops = sync ? 2000 : 0;
+                    char name[64];
+
+                    sprintf(name, "persist.%s.%s.%s", types[i], sync ? "hard" : "soft", modes[mode]);
+                    run(name, bench_persist, &ctx, bytes_per_op, max_ops);
+                }
+            }
+        }
+    }
+
+    // users: пользователи с md5 и sha256 паролями
+    {
+        std::string path = cfg::dir + "/microbench.users";
+        std::string passcode = "secret", salt = "sjk36dfhj21dvcs";
+        unsigned char md[32];
+
+        MD5_CTX md5;
+        MD5_Init(&md5);
+        MD5_Update(&md5, (unsigned char*) (passcode + salt).c_str(), passcode.size() + salt.size());
+        MD5_Final(md, &md5);
+        std::string md5_hash = hex(md, 16);
+
+        SHA256_CTX sha;
+        sha256_init(&sha);
+        sha256_update(&sha, (unsigned char*) (passcode + salt).c_str(), passcode.size() + salt.size());
+        sha256_final(&sha, md);
+        std::string sha_hash = hex(md, 32);
+
+        FILE* fp = fopen(path.c_str(), "w");
+        if (!fp) {
+            perror(path.c_str());
+            return 1;
+        }
+        fprintf(fp, "md5user:md5:%s:%s:nolimit\n", md5_hash.c_str(), salt.c_str());
+        fprintf(fp, "shauser:sha256:%s:%s:nolimit\n", sha_hash.c_str(), salt.c_str());
+        fclose(fp);
+
+        users::list l;
+        if (!l.open(path, path + ".db")) {
+            fprintf(stderr, "** can't open users\n");
+            return 1;
+        }
+
+        users_ctx md5_ctx, sha_ctx;
+        md5_ctx.passcode = sha_ctx.passcode = passcode;
+        l.get("md5user", md5_ctx.u);
+        l.get("shauser", sha_ctx.u);
+
+        run("users.validate.md5", bench_validate, &md5_ctx);
+        run("users.validate.sha256", bench_validate, &sha_ctx);
+
+        l.close();
+        unlink(path.c_str());
+    }
+
+    // onstomp: SEND в persist очередь, напрямую готовому подписчику, с RECEIPT и через парсер соединения
+    {
+        onstomp_ctx ctx;
+        ctx.path = cfg::dir + "/microbench.core";
+        ctx.headers.push_back("destination:bench");
+        ctx.headers.push_back("doc_id:3f5b5c2e-1d2a-4c7e-9a61-0c6f2b8d7e11");
+        ctx.headers.push_back("doc_type:MT999");
+        ctx.body.assign(1024, 'x');
+        ctx.subscriber = false;
+
+        run("onstomp.send.persist", bench_onstomp, &ctx, ctx.body.size());
+
+        ctx.subscriber = true;
+        run("onstomp.send.direct", bench_onstomp, &ctx, ctx.body.size());
+
+        ctx.subscriber = false;
+        ctx.headers.push_back("receipt:3f5b5c2e-1d2a-4c7e-9a61-0c6f2b8d7e11");
+        run("onstomp.send.receipt", bench_onstomp, &ctx, ctx.body.size());
+
+        ctx.frame = "SEND\n";
+        for (std::list<std::string>::iterator it = ctx.headers.begin(); it != ctx.headers.end(); ++it) {
+            ctx.frame += *it + "\n";
+        }
+        ctx.frame += "\n" + ctx.body;
+        ctx.frame.push_back(0);
+        run("onstomp.send.frame", bench_onstomp, &ctx, ctx.body.size());
+    }
+
+    return 0;
+}
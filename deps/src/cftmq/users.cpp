@@ -2,6 +2,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <algorithm>
 
 #include "md5.h"
 #include "sha256.h"
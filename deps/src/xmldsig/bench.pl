@@ -0,0 +1,66 @@
+#!/usr/bin/perl
+
+# сравнение скорости шифрования/расшифровки больших документов разными алгоритмами
+# ./bench.pl [размер тела в Мб] [количество повторов]
+
+use lib ".";
+use strict;
+use Time::HiRes qw(time);
+use xmldsig;
+
+my $size = ($ARGV[0] || 8) * 1024 * 1024;
+my $count = $ARGV[1] || 5;
+
+my $data = join("", map { chr(65 + $_ % 26) } 0..1023);
+$data = $data x int($size / length($data));
+
+my $template = "<Document><Header>header</Header><RawData>$data</RawData></Document>";
+
+my @ciphers = (
+    "tripledes-cbc",
+    "aes128-cbc",
+    "aes256-cbc",
+    "aes128-gcm",
+    "aes256-gcm",
+    "aes256-gcm,rsa-oaep",
+);
+
+printf "%-22s %12s %12s\n", "cipher", "encrypt MB/s", "decrypt MB/s";
+
+for my $cipher (@ciphers) {
+    my ($out, $dec);
+
+    my $t = time;
+    for (1..$count) {
+        $out = encrypt({
+            template => $template,
+            certs => ['certs/test.cer'],
+            sigpath => "//*[local-name()='RawData']",
+            cipher => $cipher,
+        });
+        last if $out->{result};
+    }
+    if ($out->{result}) {
+        printf "%-22s %s\n", $cipher, $out->{errmsg};
+        next;
+    }
+    my $enc_time = time - $t;
+
+    $t = time;
+    for (1..$count) {
+        $dec = decrypt({
+            xml => $out->{xml},
+            key => 'certs/test.key',
+            pwd => 'test',
+            sigpath => "//*[local-name()='EncryptedData']",
+        });
+        last if $dec->{result};
+    }
+    my $dec_time = time - $t;
+
+    die "$cipher: $dec->{errmsg}" if $dec->{result};
+    die "$cipher: decrypted data differs" if index($dec->{xml}, $data) < 0;
+
+    printf "%-22s %12.1f %12.1f\n", $cipher,
+        $size * $count / $enc_time / 1048576, $size * $count / $dec_time / 1048576;
+}
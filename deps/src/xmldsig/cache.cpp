@@ -0,0 +1,1003 @@
+/*
+    Process-wide caches of parsed/compiled objects used by xml::verify, xml::sign etc.
+*/
+
+#include <libxml/xmlschemas.h>
+#include <libxml/xpathInternals.h>
+#include <xmlsec/xmlsec.h>
+#include <xmlsec/crypto.h>
+#include <openssl/sha.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include <list>
+#include "cache.h"
+
+string toHex(const string &s);
+
+namespace xml
+{
+    void errorFunc(void *ctx, const char* msg,...);
+}
+
+namespace
+{
+    // кэши общие для всех потоков пула, все обращения к ним под этой блокировкой
+    pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+    class Guard
+    {
+    public:
+        Guard() { pthread_mutex_lock(&cacheLock); }
+        ~Guard() { pthread_mutex_unlock(&cacheLock); }
+    };
+
+    // скомпилированная XSD схема и пул контекстов валидации к ней
+    struct SchemaEntry
+    {
+        time_t mtime;
+        off_t size;
+        xmlSchemaPtr schema;
+        vector<xmlSchemaValidCtxtPtr> pool;
+        int refs;   // ссылка кэша плюс потоки, которые сейчас валидируют по этой схеме
+
+        SchemaEntry() : mtime(0), size(0), schema(NULL), refs(1) {}
+
+        ~SchemaEntry()
+        {
+            for (size_t i = 0; i < pool.size(); i++)
+                xmlSchemaFreeValidCtxt(pool[i]);
+            if (schema)
+                xmlSchemaFree(schema);
+        }
+    };
+
+    // не больше контекстов валидации на одну схему держим в пуле
+    const size_t MAX_SCHEMA_CTXT = 16;
+
+    map<string, SchemaEntry *> schemas;
+
+    void unref(SchemaEntry *entry)
+    {
+        if (--entry->refs == 0)
+            delete entry;
+    }
+
+    SchemaEntry *getSchema(const string &path)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st)) {
+            xml::errorFunc(NULL, "Can't stat schema file \"%s\". ", path.c_str());
+            return NULL;
+        }
+
+        map<string, SchemaEntry *>::iterator it = schemas.find(path);
+        if (it != schemas.end()) {
+            if (it->second->mtime == st.st_mtime && it->second->size == st.st_size)
+                return it->second;
+            // файл изменился - компилируем заново
+            unref(it->second);
+            schemas.erase(it);
+        }
+
+        // to load additional files from memory we should use xmlRegisterInputCallbacks()
+        xmlSchemaParserCtxtPtr ctxtParser = xmlSchemaNewParserCtxt(path.c_str());
+        if (!ctxtParser) {
+            xml::errorFunc(NULL, "Can't create schema parser context. ");
+            return NULL;
+        }
+        xmlSchemaSetParserErrors(ctxtParser, (xmlSchemaValidityErrorFunc) xml::errorFunc, (xmlSchemaValidityWarningFunc) xml::errorFunc, NULL);
+        xmlSchemaPtr schema = xmlSchemaParse(ctxtParser);
+        xmlSchemaFreeParserCtxt(ctxtParser);
+        if (!schema) {
+            xml::errorFunc(NULL, "Can't parse schema \"%s\". ", path.c_str());
+            return NULL;
+        }
+
+        SchemaEntry *entry = new SchemaEntry;
+        entry->mtime = st.st_mtime;
+        entry->size = st.st_size;
+        entry->schema = schema;
+        schemas[path] = entry;
+        return entry;
+    }
+
+    // разобранный ключ/сертификат или готовый keys manager
+    struct KeyEntry
+    {
+        xmlSecKeyPtr key;
+        xmlSecKeysMngrPtr mngr;
+        string fingerprint;
+
+        int refs;   // ссылка кэша плюс вызовы, которые сейчас используют mngr
+
+        KeyEntry() : key(NULL), mngr(NULL), refs(1) {}
+
+        ~KeyEntry()
+        {
+            if (mngr)
+                xmlSecKeysMngrDestroy(mngr);
+            if (key)
+                xmlSecKeyDestroy(key);
+        }
+    };
+
+    // сколько записей держим в каждом кэше ключей
+    const size_t MAX_KEY_ENTRIES = 64;
+
+    // выданные keys manager'ы, чтобы по указателю найти запись при release()
+    map<xmlSecKeysMngrPtr, KeyEntry *> owners;
+
+    void unref(KeyEntry *entry)
+    {
+        if (--entry->refs == 0) {
+            if (entry->mngr)
+                owners.erase(entry->mngr);
+            delete entry;
+        }
+    }
+
+    // отдать keys manager вызывающему, запись не удалится до release()
+    xmlSecKeysMngrPtr acquire(KeyEntry *entry)
+    {
+        entry->refs++;
+        owners[entry->mngr] = entry;
+        return entry->mngr;
+    }
+
+    // LRU кэш: самые старые записи вытесняются при переполнении
+    class KeyCache
+    {
+        typedef list<pair<string, KeyEntry *> > lru_t;
+
+        lru_t lru;
+        map<string, lru_t::iterator> index;
+
+    public:
+        unsigned long hits, misses;
+
+        KeyCache() : hits(0), misses(0) {}
+        ~KeyCache() { clear(); }
+
+        KeyEntry *find(const string &id)
+        {
+            map<string, lru_t::iterator>::iterator it = index.find(id);
+            if (it == index.end()) {
+                misses++;
+                return NULL;
+            }
+            hits++;
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+
+        void insert(const string &id, KeyEntry *entry)
+        {
+            lru.push_front(make_pair(id, entry));
+            index[id] = lru.begin();
+
+            while (lru.size() > MAX_KEY_ENTRIES) {
+                index.erase(lru.back().first);
+                unref(lru.back().second);
+                lru.pop_back();
+            }
+        }
+
+        void clear()
+        {
+            for (lru_t::iterator it = lru.begin(); it != lru.end(); ++it)
+                unref(it->second);
+            lru.clear();
+            index.clear();
+        }
+    };
+
+    // скомпилированное XPath выражение и контекст с зарегистрированными пространствами имен;
+    // контекст меняется при вычислении, поэтому такие кэши у каждого потока свои
+    struct XPathEntry
+    {
+        xmlXPathCompExprPtr expr;
+        xmlXPathContextPtr context;
+
+        XPathEntry() : expr(NULL), context(NULL) {}
+
+        ~XPathEntry()
+        {
+            if (expr)
+                xmlXPathFreeCompExpr(expr);
+            if (context)
+                xmlXPathFreeContext(context);
+        }
+    };
+
+    typedef map<string, XPathEntry *> XPathCache;
+
+    // разных sigpath немного, при переполнении кэш потока просто сбрасывается
+    const size_t MAX_XPATH_ENTRIES = 64;
+
+    pthread_key_t xpathKey;
+    pthread_once_t xpathOnce = PTHREAD_ONCE_INIT;
+
+    unsigned long xpathHits = 0, xpathMisses = 0;
+
+    void clearXPath(XPathCache *cache)
+    {
+        for (XPathCache::iterator it = cache->begin(); it != cache->end(); ++it)
+            delete it->second;
+        cache->clear();
+    }
+
+    void freeXPath(void *p)
+    {
+        XPathCache *cache = (XPathCache *) p;
+        clearXPath(cache);
+        delete cache;
+    }
+
+    void makeXPathKey()
+    {
+        pthread_key_create(&xpathKey, freeXPath);
+    }
+
+    XPathCache &xpathCache()
+    {
+        pthread_once(&xpathOnce, makeXPathKey);
+        XPathCache *cache = (XPathCache *) pthread_getspecific(xpathKey);
+        if (!cache) {
+            cache = new XPathCache;
+            pthread_setspecific(xpathKey, cache);
+        }
+        return *cache;
+    }
+
+    KeyCache verifyMngrs;   // SHA1(PEM) -> keys manager с сертификатом
+    KeyCache signKeys;      // файлы ключа и сертификата + пароль -> ключ
+    KeyCache certKeys;      // файл сертификата -> ключ с именем-отпечатком
+    KeyCache encryptMngrs;  // набор файлов сертификатов -> keys manager
+    KeyCache decryptMngrs;  // файл ключа + пароль -> keys manager
+
+    string sha1(const string &s)
+    {
+        unsigned char md[SHA_DIGEST_LENGTH];
+        SHA1((const unsigned char *) s.data(), s.size(), md);
+        return string((const char *) md, sizeof(md));
+    }
+
+    // идентификатор версии файла: путь, время изменения и размер
+    bool fileId(const string &path, string &id)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st))
+            return false;
+
+        char buf[64];
+        snprintf(buf, sizeof(buf), "|%lu|%lu|", (unsigned long) st.st_mtime, (unsigned long) st.st_size);
+        id.append(path);
+        id.append(buf);
+        return true;
+    }
+
+    xmlSecKeysMngrPtr newKeysMngr()
+    {
+        xmlSecKeysMngrPtr mngr = xmlSecKeysMngrCreate();
+        if (!mngr) {
+            xml::errorFunc(NULL, "Error: failed to create keys manager. ");
+            return NULL;
+        }
+        if (xmlSecCryptoAppDefaultKeysMngrInit(mngr) < 0) {
+            xml::errorFunc(NULL, "Error: failed to initialize keys manager. ");
+            xmlSecKeysMngrDestroy(mngr);
+            return NULL;
+        }
+        return mngr;
+    }
+
+    // отпечаток (SHA1, hex) сертификата из PEM файла
+    bool getFingerprint(const string &path, string &fingerprint, string &errmsg)
+    {
+        FILE *fp = fopen(path.c_str(), "r");
+        if (!fp) {
+            errmsg = "Can't open file ";
+            errmsg.append(path);
+            return false;
+        }
+        X509 *x = PEM_read_X509(fp, NULL, NULL, NULL);
+        fclose(fp);
+        if (!x) {
+            errmsg = "Can't read certificate. ";
+            errmsg.append(ERR_error_string(ERR_get_error(), NULL));
+            return false;
+        }
+
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned len = sizeof md;
+
+        if (!X509_digest(x, EVP_sha1(), md, &len)) {
+            errmsg = "Can't calculate fingerprint. ";
+            errmsg.append(ERR_error_string(ERR_get_error(), NULL));
+            X509_free(x);
+            return false;
+        }
+        fingerprint = toHex(string((char *) md, len));
+
+        X509_free(x);
+        return true;
+    }
+
+    // сертификат получателя с именем-отпечатком
+    KeyEntry *getCertKey(const string &path)
+    {
+        string id;
+        if (!fileId(path, id)) {
+            xml::errorFunc(NULL, "Error: failed to load pem certificate \"%s\". ", path.c_str());
+            return NULL;
+        }
+
+        KeyEntry *entry = certKeys.find(id);
+        if (entry)
+            return entry;
+
+        xmlSecKeyPtr key = xmlSecCryptoAppKeyLoad(path.c_str(), xmlSecKeyDataFormatCertPem, NULL, NULL, NULL);
+        if (!key) {
+            xml::errorFunc(NULL, "Error: failed to load pem certificate \"%s\". ", path.c_str());
+            return NULL;
+        }
+
+        string fingerprint, errmsg;
+        if (!getFingerprint(path, fingerprint, errmsg)) {
+            xml::errorFunc(NULL, "Error: getCertInfo \"%s\". ", errmsg.c_str());
+            xmlSecKeyDestroy(key);
+            return NULL;
+        }
+        if (xmlSecKeySetName(key, BAD_CAST fingerprint.c_str()) < 0) {
+            xml::errorFunc(NULL, "Error: failed to set key name for cert from \"%s\". ", path.c_str());
+            xmlSecKeyDestroy(key);
+            return NULL;
+        }
+
+        entry = new KeyEntry;
+        entry->key = key;
+        entry->fingerprint = fingerprint;
+        certKeys.insert(id, entry);
+        return entry;
+    }
+
+    // результат проверки подписи документа
+    struct ResultEntry
+    {
+        bool result;
+        string errors;      // сообщения об ошибках для неуспешной проверки
+        time_t expires;
+    };
+
+    // LRU кэш результатов verify; по умолчанию выключен (maxSize = 0)
+    class ResultCache
+    {
+        typedef list<pair<string, ResultEntry> > lru_t;
+
+        lru_t lru;
+        map<string, lru_t::iterator> index;
+
+    public:
+        size_t maxSize;
+        unsigned ttl;
+        unsigned long hits, misses;
+
+        ResultCache() : maxSize(0), ttl(0), hits(0), misses(0) {}
+
+        const ResultEntry *find(const string &id)
+        {
+            map<string, lru_t::iterator>::iterator it = index.find(id);
+            if (it == index.end()) {
+                misses++;
+                return NULL;
+            }
+            if (ttl && it->second->second.expires <= time(NULL)) {
+                lru.erase(it->second);
+                index.erase(it);
+                misses++;
+                return NULL;
+            }
+            hits++;
+            lru.splice(lru.begin(), lru, it->second);
+            return &it->second->second;
+        }
+
+        void insert(const string &id, const ResultEntry &entry)
+        {
+            map<string, lru_t::iterator>::iterator it = index.find(id);
+            if (it != index.end()) {
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            lru.push_front(make_pair(id, entry));
+            index[id] = lru.begin();
+            shrink();
+        }
+
+        void shrink()
+        {
+            while (lru.size() > maxSize) {
+                index.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+
+        size_t size() const { return lru.size(); }
+
+        void clear()
+        {
+            lru.clear();
+            index.clear();
+        }
+    };
+
+    ResultCache verifyResults;
+
+    // хранилище сертификатов участников: файлы <member_id>-<отпечаток>.pem в одном каталоге
+    struct StoreEntry
+    {
+        time_t mtime;
+        off_t size;
+        KeyEntry *entry;    // keys manager с одним сертификатом
+    };
+
+    map<string, StoreEntry> certStore;          // member_id-отпечаток -> сертификат
+    unsigned long storeVersion = 0;             // меняется при каждом изменении хранилища
+    unsigned long storeHits = 0, storeMisses = 0;
+
+    string upper(const string &s)
+    {
+        string result(s);
+        for (size_t i = 0; i < result.size(); i++)
+            result[i] = toupper((unsigned char) result[i]);
+        return result;
+    }
+
+    // разобрать сертификат хранилища; отпечаток в имени файла должен совпадать с настоящим
+    KeyEntry *loadStoreCert(const string &path, const string &id)
+    {
+        xml::MappedFile file;
+        if (!file.open(path))
+            return NULL;
+        const xml::Input &in = file.input();
+
+        BIO *bio = BIO_new_mem_buf((void *) in.data, in.size);
+        X509 *x = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+        if (bio)
+            BIO_free(bio);
+        if (!x) {
+            xml::errorFunc(NULL, "Error: can't read certificate \"%s\". ", path.c_str());
+            return NULL;
+        }
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned len = sizeof md;
+        int ok = X509_digest(x, EVP_sha1(), md, &len);
+        X509_free(x);
+
+        string fingerprint = ok ? toHex(string((char *) md, len)) : string();
+        if (fingerprint.empty() || id.size() <= fingerprint.size()
+            || id.compare(id.size() - fingerprint.size(), fingerprint.size(), fingerprint) != 0
+            || id[id.size() - fingerprint.size() - 1] != '-') {
+            xml::errorFunc(NULL, "Error: certificate \"%s\" doesn't match its fingerprint %s. ", path.c_str(), fingerprint.c_str());
+            return NULL;
+        }
+
+        xmlSecKeysMngrPtr mngr = newKeysMngr();
+        if (!mngr)
+            return NULL;
+        xmlSecKeyPtr key = xmlSecCryptoAppKeyLoadMemory((const xmlSecByte *) in.data, in.size, xmlSecKeyDataFormatCertPem, NULL, NULL, NULL);
+        if (!key) {
+            xml::errorFunc(NULL, "Error: can not load certificate \"%s\". ", path.c_str());
+            xmlSecKeysMngrDestroy(mngr);
+            return NULL;
+        }
+        if (xmlSecCryptoAppDefaultKeysMngrAdoptKey(mngr, key) < 0) {
+            xml::errorFunc(NULL, "Error: failed to add certificate to keys manager. ");
+            xmlSecKeyDestroy(key);
+            xmlSecKeysMngrDestroy(mngr);
+            return NULL;
+        }
+
+        KeyEntry *entry = new KeyEntry;
+        entry->mngr = mngr;
+        entry->fingerprint = fingerprint;
+        return entry;
+    }
+}
+
+int xml::cache::validateSchema(xmlDocPtr doc, const string &xsd_filename)
+{
+    SchemaEntry *entry = NULL;
+    xmlSchemaValidCtxtPtr ctxt = NULL;
+    {
+        Guard g;
+        entry = getSchema(xsd_filename);
+        if (!entry)
+            return -1;
+        entry->refs++;
+        if (!entry->pool.empty()) {
+            ctxt = entry->pool.back();
+            entry->pool.pop_back();
+        }
+    }
+
+    // сама валидация идет без блокировки, скомпилированная схема только читается
+    if (!ctxt)
+        ctxt = xmlSchemaNewValidCtxt(entry->schema);
+    if (!ctxt) {
+        errorFunc(NULL, "Can't create schema validation context. ");
+        Guard g;
+        unref(entry);
+        return -1;
+    }
+    xmlSchemaSetValidErrors(ctxt, (xmlSchemaValidityErrorFunc) errorFunc, (xmlSchemaValidityWarningFunc) errorFunc, NULL);
+
+    int ret = xmlSchemaValidateDoc(ctxt, doc);
+
+    // контекст переиспользуется для следующих документов
+    Guard g;
+    if (entry->pool.size() < MAX_SCHEMA_CTXT)
+        entry->pool.push_back(ctxt);
+    else
+        xmlSchemaFreeValidCtxt(ctxt);
+    unref(entry);
+
+    return ret;
+}
+
+xmlSecKeysMngrPtr xml::cache::verifyKeysMngr(const string &cert)
+{
+    string id = sha1(cert);
+
+    Guard g;
+    KeyEntry *entry = verifyMngrs.find(id);
+    if (entry)
+        return acquire(entry);
+
+    xmlSecKeysMngrPtr mngr = newKeysMngr();
+    if (!mngr)
+        return NULL;
+
+    // load trusted x509 certificate
+    xmlSecKeyPtr pkey = xmlSecCryptoAppKeyLoadMemory((xmlChar *) cert.c_str(), cert.size(), xmlSecKeyDataFormatCertPem, NULL, NULL, NULL);
+    if (!pkey) {
+        errorFunc(NULL, "Error: can not load certificate. ");
+        xmlSecKeysMngrDestroy(mngr);
+        return NULL;
+    }
+    if (xmlSecCryptoAppDefaultKeysMngrAdoptKey(mngr, pkey) < 0) {
+        errorFunc(NULL, "Error: failed to add certificate to keys manager. ");
+        xmlSecKeyDestroy(pkey);
+        xmlSecKeysMngrDestroy(mngr);
+        return NULL;
+    }
+
+    entry = new KeyEntry;
+    entry->mngr = mngr;
+    verifyMngrs.insert(id, entry);
+    return acquire(entry);
+}
+
+xmlSecKeyPtr xml::cache::signKey(const string &key, const string &pwd, const string &cert)
+{
+    // пароль в ключ кэша попадает только в виде хэша
+    string id;
+    if (!fileId(key, id)) {
+        errorFunc(NULL,"Error: failed to load private pem key from \"%s\". ", key.c_str());
+        return NULL;
+    }
+    if (!fileId(cert, id)) {
+        errorFunc(NULL,"Error: failed to load pem certificate \"%s\". ", cert.c_str());
+        return NULL;
+    }
+    id.append(sha1(pwd));
+
+    Guard g;
+    KeyEntry *entry = signKeys.find(id);
+    if (!entry) {
+        // load private key
+        xmlSecKeyPtr pkey = xmlSecCryptoAppKeyLoad(key.c_str(), xmlSecKeyDataFormatPem, pwd.c_str(), NULL, NULL);
+        if (!pkey) {
+            errorFunc(NULL,"Error: failed to load private pem key from \"%s\". ", key.c_str());
+            return NULL;
+        }
+
+        // load certificate and add to the key
+        if (xmlSecCryptoAppKeyCertLoad(pkey, cert.c_str(), xmlSecKeyDataFormatPem) < 0) {
+            errorFunc(NULL,"Error: failed to load pem certificate \"%s\". ", cert.c_str());
+            xmlSecKeyDestroy(pkey);
+            return NULL;
+        }
+
+        entry = new KeyEntry;
+        entry->key = pkey;
+        signKeys.insert(id, entry);
+    }
+
+    xmlSecKeyPtr result = xmlSecKeyDuplicate(entry->key);
+    if (!result)
+        errorFunc(NULL,"Error: failed to duplicate private key. ");
+    return result;
+}
+
+xmlSecKeysMngrPtr xml::cache::encryptKeysMngr(const vector<string> &certs, vector<string> &names)
+{
+    // сертификаты разбираются по одному, keys manager собирается на весь набор
+    string id;
+    vector<KeyEntry *> keys;
+
+    Guard g;
+    names.clear();
+    for (size_t i = 0; i < certs.size(); i++) {
+        KeyEntry *cert = getCertKey(certs[i]);
+        if (!cert)
+            return NULL;
+        fileId(certs[i], id);
+        keys.push_back(cert);
+        names.push_back(cert->fingerprint);
+    }
+
+    KeyEntry *entry = encryptMngrs.find(id);
+    if (entry)
+        return acquire(entry);
+
+    xmlSecKeysMngrPtr mngr = newKeysMngr();
+    if (!mngr)
+        return NULL;
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        xmlSecKeyPtr pkey = xmlSecKeyDuplicate(keys[i]->key);
+        if (!pkey || xmlSecCryptoAppDefaultKeysMngrAdoptKey(mngr, pkey)) {
+            errorFunc(NULL, "Error: failed to add key %s. ", certs[i].c_str());
+            if (pkey)
+                xmlSecKeyDestroy(pkey);
+            xmlSecKeysMngrDestroy(mngr);
+            return NULL;
+        }
+    }
+
+    entry = new KeyEntry;
+    entry->mngr = mngr;
+    encryptMngrs.insert(id, entry);
+    return acquire(entry);
+}
+
+xmlSecKeysMngrPtr xml::cache::decryptKeysMngr(const string &key, const string &pwd)
+{
+    string id;
+    if (!fileId(key, id)) {
+        errorFunc(NULL,"Error: failed to load private key \"%s\". ", key.c_str());
+        return NULL;
+    }
+    id.append(sha1(pwd));
+
+    Guard g;
+    KeyEntry *entry = decryptMngrs.find(id);
+    if (entry)
+        return acquire(entry);
+
+    xmlSecKeysMngrPtr mngr = newKeysMngr();
+    if (!mngr)
+        return NULL;
+
+    xmlSecKeyPtr pkey = xmlSecCryptoAppKeyLoad(key.c_str(), xmlSecKeyDataFormatPem, pwd.c_str(), NULL, NULL);
+    if (!pkey) {
+        errorFunc(NULL,"Error: failed to load private key \"%s\". ", key.c_str());
+        xmlSecKeysMngrDestroy(mngr);
+        return NULL;
+    }
+    if (xmlSecCryptoAppDefaultKeysMngrAdoptKey(mngr, pkey) < 0) {
+        errorFunc(NULL, "Error: failed to add private key to keys manager. ");
+        xmlSecKeyDestroy(pkey);
+        xmlSecKeysMngrDestroy(mngr);
+        return NULL;
+    }
+
+    entry = new KeyEntry;
+    entry->mngr = mngr;
+    decryptMngrs.insert(id, entry);
+    return acquire(entry);
+}
+
+xmlXPathObjectPtr xml::cache::evalXPath(xmlDocPtr doc, const string &xpath, const map<string, string> &xmlns)
+{
+    // ключ - выражение и все пространства имен
+    string id(xpath);
+    for (map<string, string>::const_iterator it = xmlns.begin(); it != xmlns.end(); ++it) {
+        id.append(1, '\0');
+        id.append(it->first);
+        id.append(1, '=');
+        id.append(it->second);
+    }
+
+    XPathCache &cache = xpathCache();
+    XPathEntry *entry = NULL;
+
+    XPathCache::iterator found = cache.find(id);
+    if (found != cache.end()) {
+        entry = found->second;
+        Guard g;
+        xpathHits++;
+    } else {
+        {
+            Guard g;
+            xpathMisses++;
+        }
+
+        entry = new XPathEntry;
+        entry->context = xmlXPathNewContext(NULL);
+        if (!entry->context) {
+            errorFunc(NULL, "Error in xmlXPathNewContext. ");
+            delete entry;
+            return NULL;
+        }
+        for (map<string, string>::const_iterator it = xmlns.begin(); it != xmlns.end(); ++it) {
+            if (xmlXPathRegisterNs(entry->context, (const xmlChar*) it->first.c_str(), (const xmlChar*) it->second.c_str())) {
+                errorFunc(NULL, "can't register namespace '%s' ", it->first.c_str());
+                delete entry;
+                return NULL;
+            }
+        }
+        entry->expr = xmlXPathCtxtCompile(entry->context, (const xmlChar *) xpath.c_str());
+        if (!entry->expr) {
+            errorFunc(NULL, "Error in xmlXPathEvalExpression. ");
+            delete entry;
+            return NULL;
+        }
+
+        if (cache.size() >= MAX_XPATH_ENTRIES)
+            clearXPath(&cache);
+        cache[id] = entry;
+    }
+
+    // контекст привязывается к документу только на время вычисления
+    xmlXPathContextPtr context = entry->context;
+    context->doc = doc;
+    context->node = NULL;
+    context->contextSize = -1;
+    context->proximityPosition = -1;
+
+    xmlXPathObjectPtr result = xmlXPathCompiledEval(entry->expr, context);
+
+    context->doc = NULL;
+    context->node = NULL;
+
+    if (!result)
+        errorFunc(NULL, "Error in xmlXPathEvalExpression. ");
+    return result;
+}
+
+int xml::cache::loadCertStore(const string &dir, size_t &loaded)
+{
+    loaded = 0;
+
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        errorFunc(NULL, "Error: can't open certificate store \"%s\". ", dir.c_str());
+        return -1;
+    }
+
+    // текущее содержимое каталога: member_id-отпечаток -> путь и его stat
+    map<string, pair<string, struct stat> > files;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        string name = de->d_name;
+        string::size_type dot = name.rfind('.');
+        if (name[0] == '.' || dot == string::npos)
+            continue;
+        string ext = name.substr(dot);
+        if (strcasecmp(ext.c_str(), ".pem") && strcasecmp(ext.c_str(), ".cer") && strcasecmp(ext.c_str(), ".crt"))
+            continue;
+
+        string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        // отпечаток приводим к виду toHex(), member_id оставляем как есть
+        string id = name.substr(0, dot);
+        string::size_type dash = id.rfind('-');
+        if (dash == string::npos)
+            continue;
+        id = id.substr(0, dash + 1) + upper(id.substr(dash + 1));
+        files[id] = make_pair(path, st);
+    }
+    closedir(d);
+
+    // загружаются только новые и измененные файлы
+    vector<string> changed;
+    {
+        Guard g;
+        for (map<string, pair<string, struct stat> >::iterator it = files.begin(); it != files.end(); ++it) {
+            map<string, StoreEntry>::iterator old = certStore.find(it->first);
+            if (old == certStore.end() || old->second.mtime != it->second.second.st_mtime
+                || old->second.size != it->second.second.st_size)
+                changed.push_back(it->first);
+        }
+    }
+
+    // сертификаты разбираются без блокировки, проверки подписей продолжают работать
+    map<string, StoreEntry> fresh;
+    for (size_t i = 0; i < changed.size(); i++) {
+        pair<string, struct stat> &file = files[changed[i]];
+        StoreEntry se;
+        se.mtime = file.second.st_mtime;
+        se.size = file.second.st_size;
+        se.entry = loadStoreCert(file.first, changed[i]);
+        if (se.entry)
+            fresh[changed[i]] = se;
+    }
+    loaded = fresh.size();
+
+    Guard g;
+    bool modified = !fresh.empty();
+    for (map<string, StoreEntry>::iterator it = certStore.begin(); it != certStore.end(); ) {
+        if (files.find(it->first) == files.end() || fresh.find(it->first) != fresh.end()) {
+            // файл удален или заменен; keys manager освободится после последнего release()
+            unref(it->second.entry);
+            certStore.erase(it++);
+            modified = true;
+        } else
+            ++it;
+    }
+    for (map<string, StoreEntry>::iterator it = fresh.begin(); it != fresh.end(); ++it)
+        certStore[it->first] = it->second;
+
+    if (modified)
+        storeVersion++;
+    return certStore.size();
+}
+
+xmlSecKeysMngrPtr xml::cache::storeKeysMngr(const string &signer, const string &fingerprint)
+{
+    string fp = upper(fingerprint);
+
+    // только по отпечатку не ищем: подошел бы сертификат любого участника из хранилища
+    if (signer.empty()) {
+        errorFunc(NULL, "Error: signer is required to take certificate %s from store. ", fp.c_str());
+        return NULL;
+    }
+
+    Guard g;
+    map<string, StoreEntry>::iterator it = certStore.find(signer + "-" + fp);
+    if (it == certStore.end()) {
+        storeMisses++;
+        errorFunc(NULL, "Error: certificate %s-%s not found in store. ", signer.c_str(), fp.c_str());
+        return NULL;
+    }
+    storeHits++;
+    return acquire(it->second.entry);
+}
+
+void xml::cache::configure(size_t maxResults, unsigned resultTTL)
+{
+    Guard g;
+    verifyResults.maxSize = maxResults;
+    verifyResults.ttl = resultTTL;
+    verifyResults.shrink();
+}
+
+string xml::cache::verifyResultId(const Input &msg, const string &xsd_filename, const string &cert, const string &signer, const string &sigpath, const map<string, string> &xmlns)
+{
+    unsigned long version;
+    {
+        Guard g;
+        if (!verifyResults.maxSize)
+            return string();
+        version = storeVersion;
+    }
+
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *) msg.data, msg.size, md);
+
+    // документ, сертификат (или подписант и версия хранилища), версия схемы и способ поиска подписи
+    string id((const char *) md, sizeof(md));
+    if (cert.empty()) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "|%lu|", version);
+        id.append(signer);
+        id.append(buf);
+    } else
+        id.append(sha1(cert));
+    if (!xsd_filename.empty() && !fileId(xsd_filename, id))
+        return string();    // схемы нет - результат не кэшируем, ошибку выдаст verify
+    id.append(sigpath);
+    for (map<string, string>::const_iterator it = xmlns.begin(); it != xmlns.end(); ++it) {
+        id.append("|");
+        id.append(it->first);
+        id.append("=");
+        id.append(it->second);
+    }
+    return id;
+}
+
+int xml::cache::findVerifyResult(const string &id)
+{
+    string errors;
+    {
+        Guard g;
+        const ResultEntry *entry = verifyResults.find(id);
+        if (!entry)
+            return -1;
+        if (entry->result)
+            return 1;
+        errors = entry->errors;
+    }
+    errorFunc(NULL, "%s", errors.c_str());
+    return 0;
+}
+
+void xml::cache::storeVerifyResult(const string &id, bool result, const string &errors)
+{
+    ResultEntry entry;
+    entry.result = result;
+    if (!result)
+        entry.errors = errors;
+
+    Guard g;
+    entry.expires = time(NULL) + verifyResults.ttl;
+    verifyResults.insert(id, entry);
+}
+
+void xml::cache::release(xmlSecKeysMngrPtr mngr)
+{
+    if (!mngr)
+        return;
+
+    Guard g;
+    map<xmlSecKeysMngrPtr, KeyEntry *>::iterator it = owners.find(mngr);
+    if (it != owners.end())
+        unref(it->second);
+}
+
+void xml::cache::getStats(map<string, unsigned long> &stats)
+{
+    Guard g;
+    stats["verify_hits"] = verifyMngrs.hits;
+    stats["verify_misses"] = verifyMngrs.misses;
+    stats["sign_hits"] = signKeys.hits;
+    stats["sign_misses"] = signKeys.misses;
+    stats["cert_hits"] = certKeys.hits;
+    stats["cert_misses"] = certKeys.misses;
+    stats["encrypt_hits"] = encryptMngrs.hits;
+    stats["encrypt_misses"] = encryptMngrs.misses;
+    stats["decrypt_hits"] = decryptMngrs.hits;
+    stats["decrypt_misses"] = decryptMngrs.misses;
+    stats["schemas"] = schemas.size();
+    stats["xpath_hits"] = xpathHits;
+    stats["xpath_misses"] = xpathMisses;
+    stats["result_hits"] = verifyResults.hits;
+    stats["result_misses"] = verifyResults.misses;
+    stats["results"] = verifyResults.size();
+    stats["store_hits"] = storeHits;
+    stats["store_misses"] = storeMisses;
+    stats["store_certs"] = certStore.size();
+}
+
+void xml::cache::clear()
+{
+    // XPath кэш сбрасывается у вызывающего потока, у рабочих он освобождается при их завершении
+    clearXPath(&xpathCache());
+
+    Guard g;
+    verifyMngrs.clear();
+    signKeys.clear();
+    certKeys.clear();
+    encryptMngrs.clear();
+    decryptMngrs.clear();
+    verifyResults.clear();
+
+    for (map<string, SchemaEntry *>::iterator it = schemas.begin(); it != schemas.end(); ++it)
+        unref(it->second);
+    schemas.clear();
+}
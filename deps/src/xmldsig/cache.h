@@ -0,0 +1,82 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <xmlsec/keys.h>
+#include <xmlsec/keysmngr.h>
+#include "io.h"
+
+using namespace std;
+
+namespace xml
+{
+    namespace cache
+    {
+        // проверить документ по XSD схеме; схема компилируется один раз на процесс
+        // и перекомпилируется только при изменении файла (mtime/size)
+        // возвращает 0 - документ валиден, > 0 - документ не валиден, < 0 - ошибка загрузки схемы
+        int validateSchema(xmlDocPtr doc, const string &xsd_filename);
+
+        // keys manager'ы, полученные ниже, принадлежат кэшу: освобождать их нельзя,
+        // по окончании работы нужно вызвать release() (запись может быть вытеснена другим потоком)
+
+        // keys manager с доверенным сертификатом для проверки подписи, ключ кэша - SHA1 от PEM
+        xmlSecKeysMngrPtr verifyKeysMngr(const string &cert);
+
+        // закрытый ключ (расшифрованный паролем) вместе с сертификатом для подписи,
+        // ключ кэша - пути к файлам, их mtime/size и пароль;
+        // возвращается копия, которую освобождает вызывающий (обычно xmlSecDSigCtxDestroy)
+        xmlSecKeyPtr signKey(const string &key, const string &pwd, const string &cert);
+
+        // keys manager с сертификатами получателей, names - их отпечатки (SHA1) в том же порядке
+        xmlSecKeysMngrPtr encryptKeysMngr(const vector<string> &certs, vector<string> &names);
+
+        // keys manager с закрытым ключом для расшифровки
+        xmlSecKeysMngrPtr decryptKeysMngr(const string &key, const string &pwd);
+
+        // загрузить/обновить хранилище сертификатов участников из каталога dir с файлами
+        // <member_id>-<отпечаток>.pem (.cer, .crt); повторный вызов разбирает только новые
+        // и измененные (mtime/size) файлы и убирает удаленные; loaded - сколько файлов разобрано,
+        // возвращает число сертификатов в хранилище или -1, если каталог не открывается
+        int loadCertStore(const string &dir, size_t &loaded);
+
+        // keys manager с сертификатом из хранилища по подписанту и отпечатку (KeyName подписи);
+        // без подписанта сертификат ищется только по отпечатку
+        xmlSecKeysMngrPtr storeKeysMngr(const string &signer, const string &fingerprint);
+
+        // вернуть keys manager, полученный от verifyKeysMngr/storeKeysMngr/encryptKeysMngr/decryptKeysMngr
+        void release(xmlSecKeysMngrPtr mngr);
+
+        // вычислить XPath выражение на документе; выражение компилируется один раз
+        // и хранится вместе с контекстом, где уже зарегистрированы пространства имен xmlns
+        // (свой кэш у каждого потока); результат освобождает вызывающий
+        xmlXPathObjectPtr evalXPath(xmlDocPtr doc, const string &xpath, const map<string, string> &xmlns);
+
+        // кэш результатов verify: не больше maxResults записей (0 - выключен, по умолчанию),
+        // каждая живет resultTTL секунд (0 - пока не вытеснена)
+        void configure(size_t maxResults, unsigned resultTTL);
+
+        // ключ кэша результатов: SHA256 документа, SHA1 сертификата (без сертификата - подписант и версия хранилища), версия файла схемы, sigpath и xmlns;
+        // пустая строка - кэш выключен
+        string verifyResultId(const Input &msg, const string &xsd_filename, const string &cert, const string &signer, const string &sigpath, const map<string, string> &xmlns);
+
+        // 1 - документ уже проверен успешно, 0 - уже проверен с ошибкой (ошибки добавлены в xml::getErrors()),
+        // -1 - результата в кэше нет
+        int findVerifyResult(const string &id);
+
+        // запомнить окончательный результат проверки (подпись/схема верна или неверна)
+        void storeVerifyResult(const string &id, bool result, const string &errors);
+
+        // счетчики попаданий/промахов по всем кэшам
+        void getStats(map<string, unsigned long> &stats);
+
+        // освободить все закэшированные объекты
+        void clear();
+    }
+}
+
+#endif
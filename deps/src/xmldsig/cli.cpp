@@ -0,0 +1,485 @@
+/*
+    Command line tool and unix socket daemon for bulk signing/verifying/encrypting/decrypting
+    of XML documents with the same code (and caches) as the Perl module
+
+    xmldsig verify -c cert.pem -x schema.xsd archive/
+    xmldsig sign -k key.pem -p pwd -c cert.pem -o signed/ docs/
+    xmldsig decrypt -k key.pem -p pwd -s "//xenc:EncryptedData" -n xenc=http://www.w3.org/2001/04/xmlenc# < in.xml > out.xml
+    xmldsig verify -c cert.pem -l /var/run/xmldsig.sock
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <map>
+#include <vector>
+#include <string>
+#include "xml.h"
+#include "pool.h"
+#include "cache.h"
+
+using namespace std;
+
+namespace cfg
+{
+    string command;
+    string cert;                // verify: сертификат (PEM), sign: путь к сертификату
+    vector<string> certs;       // encrypt: сертификаты получателей
+    string key;
+    string pwd;
+    string xsd;
+    string sigpath = "//*[local-name()='Signature']";
+    string cipher = "aes256-cbc";
+    map<string, string> xmlns;
+    string outdir;
+    string socket;
+    string store;               // verify: каталог хранилища сертификатов <member_id>-<отпечаток>.pem
+    string signer;              // verify: member_id подписанта для поиска в хранилище
+    int threads = 0;
+    bool verbose = false;
+}
+
+// один документ пакета
+struct Job
+{
+    string path;                // "-" - stdin/stdout
+    string cert;                // сертификат для verify, если отличается от общего
+    string outpath;
+    bool ok;
+    string errmsg;
+    size_t bytes;
+
+    Job() : ok(false), bytes(0) {}
+};
+
+struct Stats
+{
+    unsigned long docs, failed;
+    double bytes, seconds;
+
+    Stats() : docs(0), failed(0), bytes(0), seconds(0) {}
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool readFile(const string &path, string &data)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return false;
+    char buf[8192];
+    size_t n;
+    data.clear();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        data.append(buf, n);
+    fclose(fp);
+    return true;
+}
+
+static bool readFd(int fd, string &data)
+{
+    char buf[65536];
+    data.clear();
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return true;
+        data.append(buf, n);
+    }
+}
+
+// выполнить команду над одним документом (в потоке пула)
+static void runJob(void *arg, size_t i)
+{
+    Job &job = (*(vector<Job> *) arg)[i];
+    xml::MappedFile file;
+    string data;
+    const char *p = NULL;
+    size_t size = 0;
+    int fd = -1;
+
+    xml::clearErrors();
+
+    if (job.path == "-") {
+        if (!readFd(0, data)) {
+            job.errmsg = "can't read stdin";
+            return;
+        }
+        p = data.data();
+        size = data.size();
+    } else {
+        if (!file.open(job.path)) {
+            job.errmsg = xml::getErrors();
+            return;
+        }
+        p = file.input().data;
+        size = file.input().size;
+    }
+    job.bytes = size;
+
+    if (cfg::command != "verify") {
+        if (job.outpath == "-")
+            fd = dup(1);
+        else
+            fd = open(job.outpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            job.errmsg = "can't create output file " + job.outpath;
+            return;
+        }
+    }
+
+    xml::Input in(p, size);
+    xml::FdOutput out(fd);
+    map<string, string> xmlns(cfg::xmlns);
+    vector<string> certs(cfg::certs);
+
+    if (cfg::command == "verify")
+        job.ok = xml::verify(in, cfg::xsd, job.cert.empty() ? cfg::cert : job.cert, cfg::signer, cfg::sigpath, xmlns);
+    else if (cfg::command == "sign")
+        job.ok = xml::sign(in, out, cfg::key, cfg::cert, cfg::pwd, cfg::sigpath, xmlns);
+    else if (cfg::command == "encrypt")
+        job.ok = xml::encrypt(in, certs, cfg::sigpath, xmlns, cfg::cipher, out);
+    else if (cfg::command == "decrypt")
+        job.ok = xml::decrypt(in, cfg::key, cfg::pwd, cfg::sigpath, xmlns, out);
+
+    if (fd != -1) {
+        close(fd);
+        if (!job.ok && job.outpath != "-")
+            unlink(job.outpath.c_str());
+    }
+    if (!job.ok)
+        job.errmsg = xml::getErrors();
+}
+
+static string baseName(const string &path)
+{
+    string::size_type n = path.rfind('/');
+    return n == string::npos ? path : path.substr(n + 1);
+}
+
+// добавить файл или все файлы каталога (рекурсивно)
+static void collect(const string &path, vector<Job> &jobs)
+{
+    struct stat st;
+    if (path != "-" && stat(path.c_str(), &st)) {
+        fprintf(stderr, "** %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    if (path != "-" && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path.c_str());
+        if (!dir) {
+            fprintf(stderr, "** %s: %s\n", path.c_str(), strerror(errno));
+            return;
+        }
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] == '.')
+                continue;
+            collect(path + "/" + de->d_name, jobs);
+        }
+        closedir(dir);
+        return;
+    }
+    if (path != "-" && !S_ISREG(st.st_mode))
+        return;
+
+    Job job;
+    job.path = path;
+    if (path == "-" || cfg::outdir == "-")
+        job.outpath = "-";
+    else if (!cfg::outdir.empty())
+        job.outpath = cfg::outdir + "/" + baseName(path);
+    jobs.push_back(job);
+}
+
+static void process(vector<Job> &jobs, Stats &stats, FILE *report)
+{
+    double t = now();
+    xml::pool::run(runJob, &jobs, jobs.size(), cfg::threads);
+    stats.seconds += now() - t;
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        Job &job = jobs[i];
+        stats.docs++;
+        stats.bytes += job.bytes;
+        if (!job.ok)
+            stats.failed++;
+
+        // ошибки в одну строку
+        for (size_t j = 0; j < job.errmsg.size(); j++)
+            if (job.errmsg[j] == '\n' || job.errmsg[j] == '\r')
+                job.errmsg[j] = ' ';
+
+        if (job.ok && (cfg::verbose || report != stderr))
+            fprintf(report, "OK %s\n", job.path.c_str());
+        else if (!job.ok)
+            fprintf(report, "FAIL %s %s\n", job.path.c_str(), job.errmsg.c_str());
+    }
+    fflush(report);
+}
+
+// загрузить хранилище сертификатов или подхватить изменения в нем
+static bool refreshStore()
+{
+    if (cfg::store.empty())
+        return true;
+
+    xml::clearErrors();
+    size_t loaded = 0;
+    int certs = xml::cache::loadCertStore(cfg::store, loaded);
+    string errors = xml::getErrors();
+    if (!errors.empty())
+        fprintf(stderr, "** %s\n", errors.c_str());
+    if (certs < 0)
+        return false;
+    if (loaded || cfg::verbose)
+        fprintf(stderr, "** certificate store: %d certificates, %lu loaded\n", certs, (unsigned long) loaded);
+    return true;
+}
+
+static void printStats(const Stats &stats)
+{
+    fprintf(stderr, "** docs: %lu, failed: %lu, time: %.3f s, %.1f docs/s, %.2f MB/s\n",
+        stats.docs, stats.failed, stats.seconds,
+        stats.seconds > 0 ? stats.docs / stats.seconds : 0.0,
+        stats.seconds > 0 ? stats.bytes / stats.seconds / 1048576 : 0.0);
+}
+
+// демон: клиент пишет в сокет пути к файлам по одному в строке
+// (для verify через табуляцию можно указать файл сертификата), ответ - строка
+// "OK путь" или "FAIL путь ошибка" на каждый файл; строки, пришедшие одним куском,
+// обрабатываются одним пакетом параллельно
+static int serve()
+{
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (cfg::socket.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "** socket path is too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, cfg::socket.c_str());
+    unlink(cfg::socket.c_str());
+
+    if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) || listen(s, 16)) {
+        perror("bind");
+        return 1;
+    }
+    fprintf(stderr, "** listening on %s\n", cfg::socket.c_str());
+
+    Stats total;
+
+    for (;;) {
+        int c = accept(s, NULL, NULL);
+        if (c == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        // новые и измененные сертификаты хранилища подхватываются на каждом соединении
+        refreshStore();
+
+        FILE *report = fdopen(dup(c), "w");
+        string pending;
+        char buf[65536];
+        Stats stats;
+
+        for (;;) {
+            ssize_t n = read(c, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            pending.append(buf, n);
+
+            vector<Job> jobs;
+            string::size_type pos;
+            while ((pos = pending.find('\n')) != string::npos) {
+                string line = pending.substr(0, pos);
+                pending.erase(0, pos + 1);
+                if (!line.empty() && line[line.size() - 1] == '\r')
+                    line.erase(line.size() - 1);
+                if (line.empty())
+                    continue;
+
+                Job job;
+                string::size_type tab = line.find('\t');
+                job.path = line.substr(0, tab);
+                if (tab != string::npos && !readFile(line.substr(tab + 1), job.cert)) {
+                    fprintf(report, "FAIL %s can't read certificate\n", job.path.c_str());
+                    continue;
+                }
+                job.outpath = cfg::outdir.empty() ? job.path + ".out" : cfg::outdir + "/" + baseName(job.path);
+                jobs.push_back(job);
+            }
+            if (!jobs.empty())
+                process(jobs, stats, report);
+            fflush(report);
+        }
+
+        fclose(report);
+        close(c);
+
+        total.docs += stats.docs;
+        total.failed += stats.failed;
+        total.bytes += stats.bytes;
+        total.seconds += stats.seconds;
+        printStats(total);
+    }
+
+    close(s);
+    return 1;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "USAGE: xmldsig sign|verify|encrypt|decrypt [options] [file|dir|-]...\n"
+        "-c cert     verify: trusted certificate file, sign: signer certificate,\n"
+        "            encrypt: recipient certificate (may be repeated)\n"
+        "-k key      private key (sign, decrypt)\n"
+        "-p pwd      private key passphrase\n"
+        "-x xsd      XSD schema to validate against (verify)\n"
+        "-S dir      certificate store with <member_id>-<fingerprint>.pem files,\n"
+        "            used by verify without -c to find the signer certificate by KeyName\n"
+        "-m member   signer member_id for the certificate store lookup (verify, required without -c)\n"
+        "-s xpath    signature/encryption tag XPath (default %s)\n"
+        "-n pfx=uri  namespace for XPath (may be repeated)\n"
+        "-C cipher   encrypt cipher (default %s)\n"
+        "-o dir      output directory, '-' - stdout (sign, encrypt, decrypt)\n"
+        "-t threads  worker threads (default - number of CPUs)\n"
+        "-l socket   run as daemon on unix socket\n"
+        "-v          print OK lines too\n"
+        "Without files a document is read from stdin and the result is written to stdout.\n",
+        cfg::sigpath.c_str(), cfg::cipher.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+        return 1;
+    }
+    cfg::command = argv[1];
+    if (cfg::command != "sign" && cfg::command != "verify" && cfg::command != "encrypt" && cfg::command != "decrypt") {
+        usage();
+        return 1;
+    }
+
+    string certfile;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "hvc:k:p:x:S:m:s:n:C:o:t:l:")) > 0) {
+        switch (opt) {
+        case 'c':
+            certfile = optarg;
+            cfg::certs.push_back(optarg);
+            break;
+        case 'k': cfg::key = optarg; break;
+        case 'p': cfg::pwd = optarg; break;
+        case 'x': cfg::xsd = optarg; break;
+        case 'S': cfg::store = optarg; break;
+        case 'm': cfg::signer = optarg; break;
+        case 's': cfg::sigpath = optarg; break;
+        case 'n': {
+            string ns = optarg;
+            string::size_type eq = ns.find('=');
+            if (eq == string::npos) {
+                fprintf(stderr, "** invalid namespace '%s', expected prefix=uri\n", optarg);
+                return 1;
+            }
+            cfg::xmlns[ns.substr(0, eq)] = ns.substr(eq + 1);
+            break;
+        }
+        case 'C': cfg::cipher = optarg; break;
+        case 'o': cfg::outdir = optarg; break;
+        case 't': cfg::threads = atoi(optarg); break;
+        case 'l': cfg::socket = optarg; break;
+        case 'v': cfg::verbose = true; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    // verify получает сам сертификат, sign - путь к нему
+    cfg::cert = certfile;
+    if (cfg::command == "verify" && !certfile.empty() && !readFile(certfile, cfg::cert)) {
+        fprintf(stderr, "** can't read certificate %s\n", certfile.c_str());
+        return 1;
+    }
+
+    // по хранилищу проверяется только подпись заданного участника
+    if (cfg::command == "verify" && certfile.empty() && cfg::signer.empty() && cfg::socket.empty()) {
+        fprintf(stderr, "** signer member_id (-m) is required to verify without -c\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!xml::init()) {
+        fprintf(stderr, "** XML init error: %s\n", xml::getErrors().c_str());
+        return 1;
+    }
+
+    if (!refreshStore()) {
+        xml::done();
+        return 1;
+    }
+
+    if (!cfg::socket.empty()) {
+        int rc = serve();
+        xml::done();
+        return rc;
+    }
+
+    vector<Job> jobs;
+    if (optind >= argc)
+        collect("-", jobs);
+    for (int i = optind; i < argc; i++)
+        collect(argv[i], jobs);
+
+    if (cfg::command != "verify") {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (jobs[i].outpath.empty()) {
+                fprintf(stderr, "** output directory (-o) is required for files\n");
+                return 1;
+            }
+        }
+    }
+
+    Stats stats;
+    process(jobs, stats, stderr);
+    printStats(stats);
+
+    xml::done();
+    return stats.failed ? 2 : 0;
+}
@@ -0,0 +1,77 @@
+/*
+    Document input/output without intermediate copies
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "io.h"
+
+namespace xml
+{
+    void errorFunc(void *ctx, const char* msg,...);
+}
+
+bool xml::FdOutput::write(const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            errorFunc(NULL, "Error: can't write output. ");
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool xml::MappedFile::open(const string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        errorFunc(NULL, "Error: can't open file \"%s\". ", path.c_str());
+        return false;
+    }
+    bool result = open(fd);
+    ::close(fd);
+    return result;
+}
+
+bool xml::MappedFile::open(int fd)
+{
+    close();
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        errorFunc(NULL, "Error: input is not a regular file. ");
+        return false;
+    }
+    if (st.st_size == 0)
+        return true;
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        errorFunc(NULL, "Error: can't map input file. ");
+        return false;
+    }
+    // документ разбирается последовательно от начала до конца
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    addr = p;
+    length = st.st_size;
+    return true;
+}
+
+void xml::MappedFile::close()
+{
+    if (addr)
+        munmap(addr, length);
+    addr = NULL;
+    length = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef __IO_H
+#define __IO_H
+
+#include <string>
+#include <stddef.h>
+
+using namespace std;
+
+namespace xml
+{
+    // входной документ: указатель на чужой буфер (строка, буфер Perl SV, отображенный файл),
+    // данные не копируются, буфер должен жить до конца вызова
+    struct Input
+    {
+        const char *data;
+        size_t size;
+
+        Input(const string &s) : data(s.data()), size(s.size()) {}
+        Input(const char *d, size_t s) : data(d), size(s) {}
+    };
+
+    // приемник результата: сериализованный XML пишется в него кусками
+    // сразу из дерева, без промежуточного буфера
+    class Output
+    {
+    public:
+        virtual ~Output() {}
+        virtual bool write(const char *data, size_t size) = 0;
+    };
+
+    class StringOutput : public Output
+    {
+        string &out;
+    public:
+        StringOutput(string &s) : out(s) { out.clear(); }
+        bool write(const char *data, size_t size) { out.append(data, size); return true; }
+    };
+
+    // запись в открытый файловый дескриптор, владельцем дескриптора остается вызывающий
+    class FdOutput : public Output
+    {
+        int fd;
+    public:
+        FdOutput(int f) : fd(f) {}
+        bool write(const char *data, size_t size);
+    };
+
+    // файл, отображенный в память только для чтения
+    class MappedFile
+    {
+        void *addr;
+        size_t length;
+
+        MappedFile(const MappedFile &);
+        MappedFile &operator=(const MappedFile &);
+    public:
+        MappedFile() : addr(NULL), length(0) {}
+        ~MappedFile() { close(); }
+
+        bool open(const string &path);
+        bool open(int fd);          // дескриптор не закрывается
+        void close();
+
+        Input input() const { return Input((const char *) addr, length); }
+    };
+}
+
+#endif
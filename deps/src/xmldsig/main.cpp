@@ -5,8 +5,12 @@
 #include <EXTERN.h>
 #include <perl.h>
 #include <XSUB.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "perlparams.h"
 #include "xml.h"
+#include "cache.h"
+#include "pool.h"
 
 enum cmnds {CMD_SIGN, CMD_VERIFY, CMD_ENCRYPT, CMD_DECRYPT};
 
@@ -21,40 +25,234 @@ enum cmnds {CMD_SIGN, CMD_VERIFY, CMD_ENCRYPT, CMD_DECRYPT};
     ST(0) = newRV_noinc(params.GetOutput()); \
     XSRETURN(1);
 
-void callGateway(cmnds cmd, CPerlParams &params)
+// результат пишется прямо в строку Perl, которая потом возвращается в хеше как есть
+class SvOutput : public xml::Output
+{
+public:
+    SV *sv;
+
+    SvOutput() : sv(newSVpvn("", 0)) {}
+    ~SvOutput() { if (sv) SvREFCNT_dec(sv); }
+
+    bool write(const char *data, size_t size)
+    {
+        // растим буфер с запасом, чтобы не перевыделять его на каждый кусок
+        STRLEN need = SvCUR(sv) + size + 1;
+        if (SvLEN(sv) < need)
+            SvGROW(sv, need < 2 * SvLEN(sv) ? 2 * SvLEN(sv) : need);
+        sv_catpvn(sv, data, size);
+        return true;
+    }
+
+    SV *release() { SV *result = sv; sv = NULL; return result; }
+};
+
+// выходной файл, если задан out_file или out_fd
+class FileOutput : public xml::FdOutput
+{
+    int fd;
+    bool own;
+public:
+    FileOutput(int f, bool o) : xml::FdOutput(f), fd(f), own(o) {}
+    ~FileOutput() { if (own) close(fd); }
+};
+
+// входной документ: файл in_file или дескриптор in_fd отображаются в память,
+// иначе берется буфер строки из хеша без копирования
+static bool getInput(CPerlParams &params, const char *name, xml::MappedFile &file, const char *&data, size_t &size)
+{
+    const char *path = params["in_file"];
+    int fd = params.GetInt("in_fd", -1);
+
+    if (*path || fd >= 0) {
+        if (*path ? !file.open(path) : !file.open(fd))
+            return false;
+        xml::Input in = file.input();
+        data = in.data;
+        size = in.size;
+        return true;
+    }
+
+    STRLEN len = 0;
+    data = params.GetBuffer(name, len);
+    size = len;
+    return true;
+}
+
+static bool runCommand(cmnds cmd, CPerlParams &params, xml::Output &out)
 {
-    bool res = false;
-    string out;
     string sigpath = params["sigpath"];
     map<string, string> xmlns;
+    xml::MappedFile file;
+    const char *data = NULL;
+    size_t size = 0;
 
-    xml::clearErrors();
     params.GetHash("xmlns", xmlns);
 
-    if (cmd == CMD_SIGN) {
-        if ((res = xml::sign(params["template"], out, params["key"], params["cert"], params["pwd"], sigpath, xmlns)))
-            params.SetString("xml", out);
-        else
-            params.SetString("errmsg", xml::getErrors());
-    } else if (cmd == CMD_VERIFY) {
-        if (!(res = xml::verify(params["xml"], params["xsd"], params["cert"], sigpath, xmlns)))
-            params.SetString("errmsg", xml::getErrors());
-    } else if (cmd == CMD_ENCRYPT) {
+    if (!getInput(params, (cmd == CMD_SIGN || cmd == CMD_ENCRYPT) ? "template" : "xml", file, data, size))
+        return false;
+    xml::Input in(data, size);
+
+    if (cmd == CMD_SIGN)
+        return xml::sign(in, out, params["key"], params["cert"], params["pwd"], sigpath, xmlns);
+    if (cmd == CMD_VERIFY)
+        return xml::verify(in, params["xsd"], params["cert"], params["signer"], sigpath, xmlns);
+    if (cmd == CMD_ENCRYPT) {
         vector<string> certs;
         params.GetVector("certs", certs);
-        if ((res = xml::encrypt(params["template"], certs, sigpath, xmlns, params["cipher"], out)))
-            params.SetString("xml", out);
-        else
-            params.SetString("errmsg", xml::getErrors());
-    } else if (cmd == CMD_DECRYPT) {
-        if ((res = xml::decrypt(params["xml"], params["key"], params["pwd"], sigpath, xmlns, out)))
-            params.SetString("xml", out);
-        else
-            params.SetString("errmsg", xml::getErrors());
+        return xml::encrypt(in, certs, sigpath, xmlns, params["cipher"], out);
     }
+    if (cmd == CMD_DECRYPT)
+        return xml::decrypt(in, params["key"], params["pwd"], sigpath, xmlns, out);
+    return false;
+}
+
+void callGateway(cmnds cmd, CPerlParams &params)
+{
+    bool res = false;
+    SvOutput sv;
+
+    xml::clearErrors();
+
+    // результат пишется в файл out_file/out_fd, иначе в строку xml выходного хеша
+    const char *path = params["out_file"];
+    int fd = params.GetInt("out_fd", -1);
+
+    if (*path) {
+        int f = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (f == -1) {
+            params.SetString("errmsg", string("Error: can't create output file ") + path);
+            params.SetInt("result", 1);
+            return;
+        }
+        FileOutput out(f, true);
+        res = runCommand(cmd, params, out);
+    } else if (fd >= 0) {
+        FileOutput out(fd, false);
+        res = runCommand(cmd, params, out);
+    } else
+        res = runCommand(cmd, params, sv);
+
+    if (!res)
+        params.SetString("errmsg", xml::getErrors());
+    else if (cmd != CMD_VERIFY && !*path && fd < 0)
+        params.SetSV("xml", sv.release());
     params.SetInt("result", !res);
 }
 
+#define INVOKE_BATCH(type)   dXSARGS; \
+    if (items != 1 || !SvROK(ST(0)) || SvTYPE(SvRV(ST(0))) != SVt_PVHV) { \
+        croak("Args num err. No input hash"); \
+        XSRETURN(0); \
+        return; \
+    } \
+    SV **docs = hv_fetch((HV *) SvRV(ST(0)), "docs", 4, 0); \
+    if (!docs || !SvROK(*docs) || SvTYPE(SvRV(*docs)) != SVt_PVAV) { \
+        croak("No docs array in input hash"); \
+        XSRETURN(0); \
+        return; \
+    } \
+    CPerlParams params(ST(0)); \
+    AV *results = newAV(); \
+    callBatch(type, params, (AV *) SvRV(*docs), results); \
+    ST(0) = sv_2mortal(newRV_noinc((SV *) results)); \
+    XSRETURN(1);
+
+static void setResult(HV *hash, const char *name, const string &val)
+{
+    hv_store(hash, name, strlen(name), newSVpvn(val.data(), val.size()), 0);
+}
+
+// общие параметры и документы пакета; рабочие потоки обращаются только к этой структуре,
+// Perl API из них не вызывается
+struct Batch
+{
+    cmnds cmd;
+    string sigpath, xsd, cert, signer, key, pwd, cipher;
+    map<string, string> xmlns;
+    vector<string> certs;
+
+    vector<xml::Input> docs;    // указывают прямо в буферы строк Perl
+    vector<string> outs;
+    vector<string> errors;
+    vector<char> results;
+};
+
+static void runBatchItem(void *arg, size_t i)
+{
+    Batch &b = *(Batch *) arg;
+    // xml:: принимает неконстантные ссылки, поэтому у каждой задачи свои копии xmlns и certs
+    map<string, string> xmlns(b.xmlns);
+    vector<string> certs(b.certs);
+    xml::StringOutput out(b.outs[i]);
+    bool res = false;
+
+    xml::clearErrors();
+
+    if (b.cmd == CMD_SIGN)
+        res = xml::sign(b.docs[i], out, b.key, b.cert, b.pwd, b.sigpath, xmlns);
+    else if (b.cmd == CMD_VERIFY)
+        res = xml::verify(b.docs[i], b.xsd, b.cert, b.signer, b.sigpath, xmlns);
+    else if (b.cmd == CMD_ENCRYPT)
+        res = xml::encrypt(b.docs[i], certs, b.sigpath, xmlns, b.cipher, out);
+    else if (b.cmd == CMD_DECRYPT)
+        res = xml::decrypt(b.docs[i], b.key, b.pwd, b.sigpath, xmlns, out);
+
+    if (!res)
+        b.errors[i] = xml::getErrors();
+    b.results[i] = res;
+}
+
+// пакетный вызов: ключи, сертификаты, схема, sigpath и xmlns общие для всех документов
+// и разбираются один раз, документы передаются массивом docs и обрабатываются параллельно
+// в threads потоках (0 или нет параметра - по числу процессоров);
+// результат - массив хешей {result, xml, errmsg} в том же порядке, что и docs
+void callBatch(cmnds cmd, CPerlParams &params, AV *docs, AV *results)
+{
+    Batch b;
+    b.cmd = cmd;
+    b.sigpath = params["sigpath"];
+    b.xsd = params["xsd"];
+    b.cert = params["cert"];
+    b.signer = params["signer"];
+    b.key = params["key"];
+    b.pwd = params["pwd"];
+    b.cipher = params["cipher"];
+    params.GetHash("xmlns", b.xmlns);
+    if (cmd == CMD_ENCRYPT)
+        params.GetVector("certs", b.certs);
+
+    I32 upper = av_len(docs);
+    size_t n = upper + 1;
+
+    b.docs.reserve(n);
+    b.outs.resize(n);
+    b.errors.resize(n);
+    b.results.resize(n);
+
+    for (I32 i = 0; i <= upper; i++) {
+        SV **val = av_fetch(docs, i, 0);
+        STRLEN len = 0;
+        const char *p = (val && SvOK(*val)) ? SvPV(*val, len) : "";
+        b.docs.push_back(xml::Input(p, len));
+    }
+
+    xml::pool::run(runBatchItem, &b, n, params.GetInt("threads"));
+
+    av_extend(results, upper);
+    for (size_t i = 0; i < n; i++) {
+        HV *hash = newHV();
+
+        if (b.results[i] && cmd != CMD_VERIFY)
+            setResult(hash, "xml", b.outs[i]);
+        else if (!b.results[i])
+            setResult(hash, "errmsg", b.errors[i]);
+        hv_store(hash, "result", 6, newSViv(!b.results[i]), 0);
+
+        av_push(results, newRV_noinc((SV *) hash));
+    }
+}
+
 XS(XS_sign)
 {
     INVOKE_FUNC(CMD_SIGN)
@@ -75,6 +273,100 @@ XS(XS_decrypt)
     INVOKE_FUNC(CMD_DECRYPT)
 }
 
+XS(XS_sign_batch)
+{
+    INVOKE_BATCH(CMD_SIGN)
+}
+
+XS(XS_verify_batch)
+{
+    INVOKE_BATCH(CMD_VERIFY)
+}
+
+XS(XS_encrypt_batch)
+{
+    INVOKE_BATCH(CMD_ENCRYPT)
+}
+
+XS(XS_decrypt_batch)
+{
+    INVOKE_BATCH(CMD_DECRYPT)
+}
+
+// счетчики кэшей ключей/сертификатов: xmldsig::cache_stats() -> {verify_hits => ..., ...}
+XS(XS_cache_stats)
+{
+    dXSARGS;
+    PERL_UNUSED_VAR(items);
+
+    map<string, unsigned long> stats;
+    xml::cache::getStats(stats);
+
+    HV *hash = (HV *) sv_2mortal((SV *) newHV());
+    for (map<string, unsigned long>::iterator it = stats.begin(); it != stats.end(); ++it)
+        hv_store(hash, it->first.c_str(), it->first.size(), newSVuv(it->second), 0);
+
+    ST(0) = sv_2mortal(newRV((SV *) hash));
+    XSRETURN(1);
+}
+
+// сбросить закэшированные ключи, сертификаты и схемы (например, после смены ключей на диске
+// с тем же mtime или для освобождения памяти)
+XS(XS_cache_clear)
+{
+    dXSARGS;
+    PERL_UNUSED_VAR(items);
+
+    xml::cache::clear();
+    XSRETURN_YES;
+}
+
+// настройка кэша результатов verify:
+// xmldsig::cache_config({verify_results => 10000, verify_ttl => 300})
+XS(XS_cache_config)
+{
+    dXSARGS;
+    if (items != 1 || !SvROK(ST(0)) || SvTYPE(SvRV(ST(0))) != SVt_PVHV) {
+        croak("Args num err. No input hash");
+        XSRETURN(0);
+        return;
+    }
+    CPerlParams params(ST(0));
+
+    int results = params.GetInt("verify_results", 0);
+    int ttl = params.GetInt("verify_ttl", 0);
+    xml::cache::configure(results > 0 ? results : 0, ttl > 0 ? ttl : 0);
+    XSRETURN_YES;
+}
+
+// загрузить/обновить хранилище сертификатов для verify без cert:
+// xmldsig::cert_store({dir => "/path/certs"}) -> {result, certs, loaded, errmsg}
+XS(XS_cert_store)
+{
+    dXSARGS;
+    if (items != 1 || !SvROK(ST(0)) || SvTYPE(SvRV(ST(0))) != SVt_PVHV) {
+        croak("Args num err. No input hash");
+        XSRETURN(0);
+        return;
+    }
+    CPerlParams params(ST(0));
+
+    xml::clearErrors();
+    size_t loaded = 0;
+    int certs = xml::cache::loadCertStore(params["dir"], loaded);
+
+    // ошибки отдельных файлов не мешают загрузке остальных, но возвращаются в errmsg
+    string errors = xml::getErrors();
+    if (!errors.empty())
+        params.SetString("errmsg", errors);
+    params.SetInt("certs", certs < 0 ? 0 : certs);
+    params.SetInt("loaded", loaded);
+    params.SetInt("result", certs < 0);
+
+    ST(0) = newRV_noinc(params.GetOutput());
+    XSRETURN(1);
+}
+
 extern "C"
 XS(boot_xmldsig)
 {
@@ -89,6 +381,14 @@ XS(boot_xmldsig)
 	newXS("xmldsig::verify", XS_verify, __FILE__);
 	newXS("xmldsig::encrypt", XS_encrypt, __FILE__);
 	newXS("xmldsig::decrypt", XS_decrypt, __FILE__);
+	newXS("xmldsig::sign_batch", XS_sign_batch, __FILE__);
+	newXS("xmldsig::verify_batch", XS_verify_batch, __FILE__);
+	newXS("xmldsig::encrypt_batch", XS_encrypt_batch, __FILE__);
+	newXS("xmldsig::decrypt_batch", XS_decrypt_batch, __FILE__);
+	newXS("xmldsig::cache_stats", XS_cache_stats, __FILE__);
+	newXS("xmldsig::cache_clear", XS_cache_clear, __FILE__);
+	newXS("xmldsig::cache_config", XS_cache_config, __FILE__);
+	newXS("xmldsig::cert_store", XS_cert_store, __FILE__);
 
 	XSRETURN_YES;
 }
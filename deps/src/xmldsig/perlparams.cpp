@@ -23,6 +23,21 @@ const char *CPerlParams::GetString(const char *path, const char *def)
 	return result;
 }
 
+// указатель прямо на буфер строки из хеша (без копирования) и ее длина
+const char *CPerlParams::GetBuffer(const char *path, STRLEN &len)
+{
+	const char *result = "";
+	len = 0;
+
+	if (_in && path) {
+		int path_len = strlen(path);
+		SV **par = hv_fetch((HV *) SvRV(_in), path, path_len, 0);
+		if (par && SvOK(*par))
+			result = SvPV(*par, len);
+	}
+	return result;
+}
+
 int CPerlParams::GetInt(const char *path, int def)
 {
 	int result = def;
@@ -50,6 +65,15 @@ void CPerlParams::SetInt(const char *name, int val)
 		hv_store((HV *) _out, name, strlen(name), newSViv(val), 0);
 }
 
+// сохранить готовое значение, хеш забирает ссылку на него
+void CPerlParams::SetSV(const char *name, SV *val)
+{
+	if (_out)
+		hv_store((HV *) _out, name, strlen(name), val, 0);
+	else
+		SvREFCNT_dec(val);
+}
+
 void CPerlParams::SetArray(const char *name, ArrayOfHash &in_array)
 {
 	if (!_out || in_array.empty()) return;
@@ -28,10 +28,12 @@ public:
 	const char *GetString(const char *path, const char *def = "");
 	int GetInt(const char *path, int def = 0);
 	const char *operator[](const char *path) { return GetString(path); }
+	const char *GetBuffer(const char *path, STRLEN &len);
 
 	void SetString(const char *name, const char *val);
 	void SetString(const char *name, std::string val) { SetString(name, val.c_str()); }
 	void SetInt(const char *name, int val);
+	void SetSV(const char *name, SV *val);
 
 	void SetArray(const char *name, ArrayOfHash &ar);
 	void GetArray(const char *name, ArrayOfHash &ar);
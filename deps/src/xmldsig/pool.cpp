@@ -0,0 +1,163 @@
+/*
+    Worker threads for batch signing/verifying
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include "pool.h"
+
+using namespace std;
+
+namespace xml
+{
+    void initThread();
+}
+
+namespace
+{
+    // больше потоков не создаем независимо от количества процессоров
+    const int MAX_THREADS = 64;
+
+    pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;   // один пакет за раз
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+
+    vector<pthread_t> workers;
+    pid_t owner = 0;            // процесс, создавший потоки (после fork их уже нет)
+
+    xml::pool::Task task = NULL;
+    void *arg = NULL;
+    size_t total = 0;
+    size_t nextItem = 0;
+    unsigned long generation = 0;
+    int wanted = 0;             // сколько рабочих потоков еще может присоединиться к пакету
+    int busy = 0;               // рабочие потоки, занятые текущим пакетом
+    bool stopping = false;
+
+    // поток уже выполняет задачу пакета: вложенный пакет (например, шифрование для нескольких
+    // получателей внутри encrypt_batch) выполняется в нем же последовательно
+    __thread bool inside = false;
+
+    // выполнять задачи текущего пакета, пока они есть; вызывается под lock
+    void drain()
+    {
+        while (nextItem < total) {
+            size_t i = nextItem++;
+            pthread_mutex_unlock(&lock);
+            task(arg, i);
+            pthread_mutex_lock(&lock);
+        }
+    }
+
+    void *worker(void *)
+    {
+        // у libxml2 настройки и обработчик ошибок свои для каждого потока
+        xml::initThread();
+        inside = true;
+
+        unsigned long seen = 0;
+
+        pthread_mutex_lock(&lock);
+        for (;;) {
+            while (!stopping && generation == seen)
+                pthread_cond_wait(&wake, &lock);
+            if (stopping)
+                break;
+            seen = generation;
+            if (wanted <= 0)
+                continue;
+
+            wanted--;
+            busy++;
+            drain();
+            if (--busy == 0)
+                pthread_cond_signal(&idle);
+        }
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    int cpuCount()
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int) n : 1;
+    }
+
+    // дозапустить рабочие потоки до нужного количества
+    void spawn(int count)
+    {
+        if (owner != getpid()) {
+            // после fork потоков родителя в процессе нет
+            workers.clear();
+            owner = getpid();
+        }
+        while ((int) workers.size() < count) {
+            pthread_t t;
+            if (pthread_create(&t, NULL, worker, NULL))
+                break;
+            workers.push_back(t);
+        }
+    }
+}
+
+void xml::pool::run(Task t, void *a, size_t n, int threads)
+{
+    if (threads <= 0)
+        threads = cpuCount();
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if ((size_t) threads > n)
+        threads = n;
+
+    if (threads <= 1 || inside) {
+        for (size_t i = 0; i < n; i++)
+            t(a, i);
+        return;
+    }
+
+    pthread_mutex_lock(&runLock);
+    spawn(threads - 1);
+
+    pthread_mutex_lock(&lock);
+    task = t;
+    arg = a;
+    total = n;
+    nextItem = 0;
+    wanted = threads - 1;
+    generation++;
+    pthread_cond_broadcast(&wake);
+
+    inside = true;
+    drain();
+    inside = false;
+    while (busy > 0)
+        pthread_cond_wait(&idle, &lock);
+
+    wanted = 0;
+    task = NULL;
+    arg = NULL;
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&runLock);
+}
+
+void xml::pool::shutdown()
+{
+    pthread_mutex_lock(&runLock);
+    if (owner == getpid()) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_broadcast(&wake);
+        pthread_mutex_unlock(&lock);
+
+        for (size_t i = 0; i < workers.size(); i++)
+            pthread_join(workers[i], NULL);
+
+        pthread_mutex_lock(&lock);
+        stopping = false;
+        pthread_mutex_unlock(&lock);
+    }
+    workers.clear();
+    pthread_mutex_unlock(&runLock);
+}
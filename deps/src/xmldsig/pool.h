@@ -0,0 +1,24 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+
+namespace xml
+{
+    // пул рабочих потоков для пакетной обработки документов
+    namespace pool
+    {
+        // задача для элемента пакета с номером i
+        typedef void (*Task)(void *arg, size_t i);
+
+        // выполнить task(arg, 0..n-1) не более чем в threads потоках (0 - по числу процессоров),
+        // вызывающий поток тоже участвует; возвращает управление после завершения всех задач;
+        // вызов из задачи другого пакета выполняется последовательно в текущем потоке
+        void run(Task task, void *arg, size_t n, int threads = 0);
+
+        // остановить рабочие потоки
+        void shutdown();
+    }
+}
+
+#endif
@@ -17,8 +17,13 @@
 #include <sstream>
 #include <iostream>
 #include <strings.h>
+#include <limits.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
 #include "xml.h"
+#include "cache.h"
+#include "pool.h"
 
 // максимальное количество сертификатов/ключей, которыми можно
 // одновременно зашифровать сессионный ключ при шифровании XML
@@ -38,7 +43,48 @@ string toHex(const string &s)
 } 
 
 namespace xml {
-    string xmlErrors;
+    // текст ошибок копится отдельно для каждого потока
+    pthread_key_t errorsKey;
+    pthread_once_t errorsOnce = PTHREAD_ONCE_INIT;
+
+    void freeErrors(void *p)
+    {
+        delete (string *) p;
+    }
+
+    void makeErrorsKey()
+    {
+        pthread_key_create(&errorsKey, freeErrors);
+    }
+
+    string &xmlErrors()
+    {
+        pthread_once(&errorsOnce, makeErrorsKey);
+        string *s = (string *) pthread_getspecific(errorsKey);
+        if (!s) {
+            s = new string;
+            pthread_setspecific(errorsKey, s);
+        }
+        return *s;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    // OpenSSL до 1.1 потокобезопасен только с внешними блокировками
+    pthread_mutex_t *sslLocks = NULL;
+
+    void sslLock(int mode, int n, const char *file, int line)
+    {
+        if (mode & CRYPTO_LOCK)
+            pthread_mutex_lock(&sslLocks[n]);
+        else
+            pthread_mutex_unlock(&sslLocks[n]);
+    }
+
+    unsigned long sslThreadId()
+    {
+        return (unsigned long) pthread_self();
+    }
+#endif
 
     const xmlChar* ids[2]=
     {
@@ -64,7 +110,7 @@ namespace xml {
         va_end(ap);
 
         if (size <= 0) {
-            xmlErrors.append("Error in format string. ");
+            xmlErrors().append("Error in format string. ");
             return;
         }
         if ((buf = (char *) malloc(size+1)) == NULL)
@@ -73,21 +119,37 @@ namespace xml {
         va_start(ap, msg);
         size = vsnprintf(buf, size+1, msg, ap);
         va_end(ap);
-        xmlErrors.append(buf, size);
+        xmlErrors().append(buf, size);
         free(buf);
 #endif
     }
 }
 
-bool xml::init()
+// libxml2 keeps these settings per thread, so every worker thread must call this too
+void xml::initThread()
 {
-    LIBXML_TEST_VERSION     // calls xmlInitParser() internally
     xmlGenericErrorFunc handler = (xmlGenericErrorFunc) errorFunc;
     initGenericErrorDefaultFunc(&handler);
     xmlLoadExtDtdDefaultValue = XML_DETECT_IDS | XML_COMPLETE_ATTRS;
     xmlSubstituteEntitiesDefault(1);
 
     xmlIndentTreeOutput = 1; 
+}
+
+bool xml::init()
+{
+    LIBXML_TEST_VERSION     // calls xmlInitParser() internally
+    initThread();
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (!CRYPTO_get_locking_callback()) {
+        sslLocks = new pthread_mutex_t[CRYPTO_num_locks()];
+        for (int i = 0; i < CRYPTO_num_locks(); i++)
+            pthread_mutex_init(&sslLocks[i], NULL);
+        CRYPTO_set_id_callback(sslThreadId);
+        CRYPTO_set_locking_callback(sslLock);
+    }
+#endif
 
     if (xmlSecInit() < 0) {
         errorFunc(stderr, "Error: xmlsec initialization failed.\n");
@@ -123,6 +185,9 @@ bool xml::init()
 
 void xml::done()
 {
+    pool::shutdown();
+    cache::clear();
+
     xmlSecCryptoShutdown();
     xmlSecCryptoAppShutdown();
     xmlSecShutdown();
@@ -131,37 +196,44 @@ void xml::done()
     xmlMemoryDump();
 }
 
-int registerNS(xmlXPathContextPtr context, map<string, string> &xmlns)
+// разобрать документ прямо из переданного буфера
+static xmlDocPtr readDoc(const xml::Input &in)
 {
-    int result = 0;
-
-    for (map<string, string>::const_iterator it = xmlns.begin(); it != xmlns.end(); ++it) {
-        if (xmlXPathRegisterNs(context, (const xmlChar*) it->first.c_str(), (const xmlChar*) it->second.c_str())) {
-            xml::errorFunc(NULL, "can't register namespace '%s' ", it->first.c_str());
-            result = -1;
-        }
+    if (in.size > INT_MAX) {
+        xml::errorFunc(NULL, "Error: document is too large. ");
+        return NULL;
     }
-    return result;
+    return xmlReadMemory(in.data, (int) in.size, NULL, NULL, 0);
 }
 
-
-static xmlXPathObjectPtr getXPathNodes(xmlDocPtr doc, xmlChar *xpath, map<string, string> &xmlns, bool checkSingle = false)
+static int writeOutput(void *ctx, const char *buffer, int len)
 {
-    xmlXPathContextPtr context = NULL;
-    xmlXPathObjectPtr result = NULL;
+    return ((xml::Output *) ctx)->write(buffer, len) ? len : -1;
+}
 
-    context = xmlXPathNewContext(doc);
-    if (context == NULL) {
-        xml::errorFunc(NULL, "Error in xmlXPathNewContext. ");
-        goto err;
+// сериализовать документ (как xmlDocDumpFormatMemory без форматирования) сразу в приемник
+static bool saveDoc(xmlDocPtr doc, xml::Output &out)
+{
+    xmlOutputBufferPtr buf = xmlOutputBufferCreateIO(writeOutput, NULL, &out, NULL);
+    if (!buf) {
+        xml::errorFunc(NULL, "Error: can't create output buffer. ");
+        return false;
     }
-    if (registerNS(context, xmlns))
-        goto err;
-    result = xmlXPathEvalExpression(xpath, context);
-    if (result == NULL) {
-        xml::errorFunc(NULL, "Error in xmlXPathEvalExpression. ");
-        goto err;
+    // буфер закрывается внутри xmlSaveFormatFileTo
+    if (xmlSaveFormatFileTo(buf, doc, NULL, 0) <= 0) {
+        xml::errorFunc(NULL, "Error: can't write document. ");
+        return false;
     }
+    return true;
+}
+
+static xmlXPathObjectPtr getXPathNodes(xmlDocPtr doc, xmlChar *xpath, map<string, string> &xmlns, bool checkSingle = false)
+{
+    // выражение и контекст с пространствами имен берутся из кэша
+    xmlXPathObjectPtr result = xml::cache::evalXPath(doc, (const char *) xpath, xmlns);
+    if (result == NULL)
+        return NULL;
+
     if (xmlXPathNodeSetIsEmpty(result->nodesetval)){
         xml::errorFunc(NULL, "XPath returned empty result. ");
         goto err;
@@ -170,16 +242,10 @@ static xmlXPathObjectPtr getXPathNodes(xmlDocPtr doc, xmlChar *xpath, map<string
         xml::errorFunc(NULL, "More than one node selected. ");
         goto err;
     }
-
-    if (context)
-        xmlXPathFreeContext(context);
     return result;
 
 err:
-    if (context)
-        xmlXPathFreeContext(context);
-    if (result)
-        xmlXPathFreeObject(result);
+    xmlXPathFreeObject(result);
     return NULL;
 }
 
@@ -188,7 +254,26 @@ static xmlXPathObjectPtr getSingleXPathNode(xmlDocPtr doc, xmlChar *xpath, std::
     return getXPathNodes(doc, xpath, xmlns, true);
 }
 
-bool xml::verify(const string &msg, const string &xsd_filename, const string &cert, const string &sigpath, map<string, string> &xmlns)
+// содержимое KeyInfo/KeyName подписи без пробелов по краям
+static string getKeyName(xmlNodePtr sig)
+{
+    string result;
+    xmlNodePtr keyInfo = xmlSecFindChild(sig, xmlSecNodeKeyInfo, xmlSecDSigNs);
+    xmlNodePtr keyName = keyInfo ? xmlSecFindChild(keyInfo, xmlSecNodeKeyName, xmlSecDSigNs) : NULL;
+    if (!keyName)
+        return result;
+
+    xmlChar *content = xmlNodeGetContent(keyName);
+    if (content) {
+        result = (const char *) content;
+        xmlFree(content);
+    }
+    string::size_type b = result.find_first_not_of(" \t\r\n");
+    string::size_type e = result.find_last_not_of(" \t\r\n");
+    return b == string::npos ? string() : result.substr(b, e - b + 1);
+}
+
+bool xml::verify(const Input &msg, const string &xsd_filename, const string &cert, const string &signer, const string &sigpath, map<string, string> &xmlns)
 {
     bool result = false;
     string SD, AP, OP;
@@ -196,11 +281,19 @@ bool xml::verify(const string &msg, const string &xsd_filename, const string &ce
     xmlDocPtr doc = NULL;
     xmlXPathObjectPtr object = NULL;
     xmlSecKeysMngrPtr xmlSecKeyMngr = NULL;
-    xmlSecKeyPtr pkey = NULL;
     xmlSecDSigCtxPtr dsigCtx = NULL;
+    bool final = false;     // результат не зависит от окружения и его можно закэшировать
+
+    // the same bytes were already verified with the same certificate and schema
+    string resultId = cache::verifyResultId(msg, xsd_filename, cert, signer, sigpath, xmlns);
+    if (!resultId.empty()) {
+        int cached = cache::findVerifyResult(resultId);
+        if (cached >= 0)
+            return cached > 0;
+    }
 
     // load document
-    doc = xmlReadMemory(msg.c_str(), msg.size(), NULL, NULL, 0);
+    doc = readDoc(msg);
     if (!doc) {
         errorFunc(stderr, "Could not parse input message. ");
         goto err;
@@ -208,21 +301,11 @@ bool xml::verify(const string &msg, const string &xsd_filename, const string &ce
     xmlSecAddIDs(doc, xmlDocGetRootElement(doc), ids);
 
     if (!xsd_filename.empty()) {
-        // load xml schema
-        // to load additional files from memory we should use xmlRegisterInputCallbacks()
-        xmlSchemaParserCtxtPtr ctxtParser = xmlSchemaNewParserCtxt(xsd_filename.c_str());
-        xmlSchemaSetParserErrors(ctxtParser, (xmlSchemaValidityErrorFunc) errorFunc, (xmlSchemaValidityWarningFunc) errorFunc, NULL);
-        xmlSchemaPtr schema = xmlSchemaParse(ctxtParser);
-        xmlSchemaFreeParserCtxt(ctxtParser);
-
-        // validate document against schema
-        xmlSchemaValidCtxtPtr ctxt = xmlSchemaNewValidCtxt(schema);
-        xmlSchemaSetValidErrors(ctxt, (xmlSchemaValidityErrorFunc) errorFunc, (xmlSchemaValidityWarningFunc) errorFunc, NULL);
-        int ret = xmlSchemaValidateDoc(ctxt, doc);
-        xmlSchemaFreeValidCtxt(ctxt);
-        xmlSchemaFree(schema);
+        // validate document against schema (compiled schema is cached between calls)
+        int ret = cache::validateSchema(doc, xsd_filename);
         if (ret != 0) {
             errorFunc(NULL, "error validating schema. ");
+            final = ret > 0;
             goto err;
         }
     }
@@ -234,24 +317,24 @@ bool xml::verify(const string &msg, const string &xsd_filename, const string &ce
         goto err;
     }
 
-    // create keys manager
-    xmlSecKeyMngr = xmlSecKeysMngrCreate();
-    if (!xmlSecKeyMngr) {
-        errorFunc(stderr, "Error: failed to create keys manager. ");
-        goto err;
-    }
-    if (xmlSecCryptoAppDefaultKeysMngrInit(xmlSecKeyMngr) < 0) {
-        errorFunc(stderr, "Error: failed to initialize keys manager. ");
+    // keys manager with trusted x509 certificate (cached between calls);
+    // without certificate it is taken from the certificate store by signer and KeyName
+    // (signer is required: KeyName alone would accept a signature of any store member)
+    if (!cert.empty())
+        xmlSecKeyMngr = cache::verifyKeysMngr(cert);
+    else if (signer.empty()) {
+        errorFunc(NULL, "Error: neither certificate nor signer given. ");
         goto err;
+    } else {
+        string keyName = getKeyName(object->nodesetval->nodeTab[0]);
+        if (keyName.empty()) {
+            errorFunc(NULL, "Error: no certificate given and signature has no KeyName. ");
+            goto err;
+        }
+        xmlSecKeyMngr = cache::storeKeysMngr(signer, keyName);
     }
-
-    // load trusted x509 certificate
-    pkey = xmlSecCryptoAppKeyLoadMemory((xmlChar *) cert.c_str(), cert.size(), xmlSecKeyDataFormatCertPem, NULL, NULL, NULL);
-    if (!pkey) {
-        errorFunc(stderr, "Error: can not load certificate. ");
+    if (!xmlSecKeyMngr)
         goto err;
-    }
-    xmlSecCryptoAppDefaultKeysMngrAdoptKey(xmlSecKeyMngr, pkey);
 
     // verify signature
     dsigCtx = xmlSecDSigCtxCreate(xmlSecKeyMngr);
@@ -265,6 +348,7 @@ bool xml::verify(const string &msg, const string &xsd_filename, const string &ce
         goto err;
     }
 
+    final = true;
     if (dsigCtx->status != xmlSecDSigStatusSucceeded) {
         errorFunc(stderr, "Error: signature is INVALID. ");
         goto err;
@@ -273,10 +357,11 @@ bool xml::verify(const string &msg, const string &xsd_filename, const string &ce
     result = true;
 
 err:
+    if (final && !resultId.empty())
+        cache::storeVerifyResult(resultId, result, result ? string() : getErrors());
     if (dsigCtx)
         xmlSecDSigCtxDestroy(dsigCtx);
-    if (xmlSecKeyMngr)
-        xmlSecKeysMngrDestroy(xmlSecKeyMngr);
+    cache::release(xmlSecKeyMngr);
     if (object)
         xmlXPathFreeObject(object);
     if (doc)
@@ -284,17 +369,15 @@ err:
     return result;
 }
 
-bool xml::sign(const string &in, string &out, const string &key, const string &cert, const string &pwd, const string &sigpath, map<string, string> &xmlns)
+bool xml::sign(const Input &in, Output &out, const string &key, const string &cert, const string &pwd, const string &sigpath, map<string, string> &xmlns)
 {
     bool result = false;
     xmlDocPtr doc = NULL;
     xmlXPathObjectPtr object = NULL;
     xmlSecDSigCtxPtr dsigCtx = NULL;
-    xmlChar *mem = NULL;
-    int size = 0;
 
     // load document from memory
-    doc = xmlReadMemory(in.c_str(), in.size(), NULL, NULL, 0);
+    doc = readDoc(in);
     if ((doc == NULL) || (xmlDocGetRootElement(doc) == NULL)){
         errorFunc(NULL, "Error: unable to parse file. ");
         goto done;      
@@ -321,18 +404,10 @@ bool xml::sign(const string &in, string &out, const string &key, const string &c
     }
     dsigCtx->flags |= XMLSEC_DSIG_FLAGS_STORE_SIGNATURE | XMLSEC_DSIG_FLAGS_STORE_SIGNEDINFO_REFERENCES | XMLSEC_DSIG_FLAGS_STORE_MANIFEST_REFERENCES;
 
-    // load private key
-    dsigCtx->signKey = xmlSecCryptoAppKeyLoad(key.c_str(), xmlSecKeyDataFormatPem, pwd.c_str(), NULL, NULL);
-    if (!dsigCtx->signKey) {
-        errorFunc(NULL,"Error: failed to load private pem key from \"%s\". ", key.c_str());
+    // private key with certificate (decrypted key is cached between calls)
+    dsigCtx->signKey = cache::signKey(key, pwd, cert);
+    if (!dsigCtx->signKey)
         goto done;
-    }
-
-    // load certificate and add to the key
-    if (xmlSecCryptoAppKeyCertLoad(dsigCtx->signKey, cert.c_str(), xmlSecKeyDataFormatPem) < 0) {
-        errorFunc(NULL,"Error: failed to load pem certificate \"%s\". ", cert.c_str());
-        goto done;
-    }
 
     // sign the template
     if (xmlSecDSigCtxSign(dsigCtx, object->nodesetval->nodeTab[0]) < 0) {
@@ -340,12 +415,7 @@ bool xml::sign(const string &in, string &out, const string &key, const string &c
         goto done;
     }
 
-    xmlDocDumpFormatMemory(doc, &mem, &size, 0);
-    if (size > 0) {
-        result = true;
-        out.assign((const char *) mem, size);
-    }
-    xmlFree(mem);
+    result = saveDoc(doc, out);
 
 done:
     if (dsigCtx)
@@ -376,6 +446,17 @@ static xmlSecTransformId getCipher(const string &s, xmlSecKeyDataId &dataId, xml
         dataId = xmlSecKeyDataAesId;
         sizeBits = 256;
         return xmlSecTransformAes256CbcId;
+#ifdef xmlSecTransformAes128GcmId
+    // AES-GCM (xmlsec >= 1.2.27): аппаратное ускорение AES-NI и отдельный MAC не нужен
+    } else if (s == "aes128-gcm") {
+        dataId = xmlSecKeyDataAesId;
+        sizeBits = 128;
+        return xmlSecTransformAes128GcmId;
+    } else if (s == "aes256-gcm") {
+        dataId = xmlSecKeyDataAesId;
+        sizeBits = 256;
+        return xmlSecTransformAes256GcmId;
+#endif
     } else {
         dataId = xmlSecKeyDataDesId;
         sizeBits = 0;
@@ -383,72 +464,138 @@ static xmlSecTransformId getCipher(const string &s, xmlSecKeyDataId &dataId, xml
     }
 }
 
-static bool getCertInfo(const string &path, string &fingerprint, string &serial, string &errmsg)
+// поддерживаемые алгоритмы шифрования сессионного ключа сертификатами получателей
+static xmlSecTransformId getKeyTransport(const string &s)
 {
-    FILE *fp = fopen(path.c_str(), "r");
-    if (!fp) {
-        errmsg = "Can't open file ";
-        errmsg.append(path);
-        return false;
-    }
-    X509 *x = PEM_read_X509(fp, NULL, NULL, NULL);
-    fclose(fp);
-    if (!x) {
-        errmsg = "Can't read certificate. ";
-        errmsg.append(ERR_error_string(ERR_get_error(), NULL));
-        return false;
-    }
+    if (s.empty() || s == "rsa-1_5")
+        return xmlSecTransformRsaPkcs1Id;
+    else if (s == "rsa-oaep" || s == "rsa-oaep-mgf1p")
+        return xmlSecTransformRsaOaepId;
+    else
+        return xmlSecTransformIdUnknown;
+}
 
-    BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(x), NULL);
-    if (!bn) {
-        errmsg = "Can't get serial number. ";
-        errmsg.append(ERR_error_string(ERR_get_error(), NULL));
-        X509_free(x);
-        return false;
+// сессионный ключ документа, зашифрованный сертификатом одного получателя;
+// выполняется в потоках пула, поэтому узел EncryptedKey строится в своем отдельном документе
+struct Recipient
+{
+    xmlSecKeysMngrPtr mngr;
+    xmlSecTransformId transportId;
+    const xmlSecByte *key;
+    xmlSecSize keySize;
+    string name;
+
+    xmlDocPtr doc;
+    xmlNodePtr encKeyNode;
+    bool ok;
+    string errors;
+
+    Recipient() : mngr(NULL), transportId(NULL), key(NULL), keySize(0), doc(NULL), encKeyNode(NULL), ok(false) {}
+};
+
+static void wrapSessionKey(void *arg, size_t i)
+{
+    Recipient &r = (*(vector<Recipient> *) arg)[i];
+    string &errors = xml::xmlErrors();
+    size_t mark = errors.size();
+    xmlNodePtr root = NULL;
+    xmlNodePtr keyInfoNode = NULL;
+    xmlNodePtr x509DataNode = NULL;
+    xmlSecEncCtxPtr encCtx = NULL;
+
+    r.doc = xmlNewDoc(BAD_CAST "1.0");
+    if (!r.doc || !(root = xmlNewDocNode(r.doc, NULL, xmlSecNodeKeyInfo, NULL))) {
+        xml::errorFunc(NULL, "Error: failed to create key info. ");
+        goto done;
     }
-    char *ser = BN_bn2dec(bn);
-    serial.assign(ser);
-    OPENSSL_free(ser);
-    BN_free(bn);
+    xmlDocSetRootElement(r.doc, root);
+    xmlSetNs(root, xmlNewNs(root, xmlSecDSigNs, NULL));
 
-    unsigned char md[EVP_MAX_MD_SIZE];
-    unsigned len = sizeof md;
-    const EVP_MD *digest = EVP_sha1();
+    r.encKeyNode = xmlSecTmplKeyInfoAddEncryptedKey(root, r.transportId, NULL, NULL, NULL);
+    if (r.encKeyNode == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add key info. ");
+        goto done;
+    }
+    if (xmlSecTmplEncDataEnsureCipherValue(r.encKeyNode) == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add CipherValue node. ");
+        goto done;
+    }
+    keyInfoNode = xmlSecTmplEncDataEnsureKeyInfo(r.encKeyNode, NULL);
+    if(keyInfoNode == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add key info. ");
+        goto done;
+    }
+    if (xmlSecTmplKeyInfoAddKeyName(keyInfoNode, BAD_CAST r.name.c_str()) == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add key name. ");
+        goto done;
+    }
+    if ((x509DataNode = xmlSecTmplKeyInfoAddX509Data(keyInfoNode)) == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add X509DATA. ");
+        goto done;
+    }
+    if (xmlSecTmplX509DataAddIssuerSerial(x509DataNode) == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add serial. ");
+        goto done;
+    }
+    if (xmlSecTmplX509DataAddSubjectName(x509DataNode) == NULL) {
+        xml::errorFunc(NULL, "Error: failed to add subject name. ");
+        goto done;
+    }
 
-    if (!X509_digest(x, digest, md, &len)) {
-        errmsg = "Can't calculate fingerprint. ";
-        errmsg.append(ERR_error_string(ERR_get_error(), NULL));
-        X509_free(x);
-        return false;
+    // ключ получателя находится в keys manager по KeyName (отпечатку сертификата)
+    encCtx = xmlSecEncCtxCreate(r.mngr);
+    if (encCtx == NULL) {
+        xml::errorFunc(NULL, "Error: failed to create encryption context. ");
+        goto done;
     }
-    fingerprint.assign((char *) md, len);
-    fingerprint = toHex(fingerprint);
+    encCtx->mode = xmlEncCtxModeEncryptedKey;
+    if (xmlSecEncCtxBinaryEncrypt(encCtx, r.encKeyNode, r.key, r.keySize) < 0) {
+        xml::errorFunc(NULL, "Error: failed to encrypt session key for \"%s\". ", r.name.c_str());
+        goto done;
+    }
+    r.ok = true;
 
-    X509_free(x);
-    return true;
+done:
+    if (encCtx)
+        xmlSecEncCtxDestroy(encCtx);
+    if (!r.ok) {
+        // ошибки переносятся в вызывающий поток
+        r.errors = errors.substr(mark);
+        errors.resize(mark);
+    }
 }
 
-bool xml::encrypt(const string &msg, vector<string> &certs, const string &sigpath, map<string, string> &xmlns, const string &cipher, string &out)
+bool xml::encrypt(const Input &msg, vector<string> &certs, const string &sigpath, map<string, string> &xmlns, const string &cipher, Output &out)
 {
     bool result = false;
     xmlDocPtr doc = NULL;
     xmlXPathObjectPtr object = NULL;
     xmlSecKeysMngrPtr xmlSecKeyMngr = NULL;
-    xmlSecKeyPtr pkey = NULL;
+    xmlSecKeyPtr sessionKey = NULL;
+    xmlSecBufferPtr sessionKeyValue = NULL;
     xmlNodePtr encDataNode = NULL;
+    xmlNodePtr encryptedNode = NULL;
+    xmlNodePtr cipherDataNode = NULL;
     xmlNodePtr keyInfoNode = NULL;
-    xmlNodePtr encKeyNode = NULL;
-    xmlNodePtr keyInfoNode2 = NULL;
-    xmlNodePtr x509DataNode = NULL;
     xmlSecEncCtxPtr encCtx = NULL;
-    xmlChar *mem = NULL;
     int size = 0;
     xmlSecKeyDataId dataId;
     xmlSecSize sizeBits;
+    xmlSecTransformId cipherId, transportId;
     vector<string> certNames;
+    vector<Recipient> recipients;
+
+    // cipher - "шифр данных[,шифрование сессионного ключа]", например "aes256-gcm,rsa-oaep"
+    string::size_type comma = cipher.find(',');
+    cipherId = getCipher(cipher.substr(0, comma), dataId, sizeBits);
+    transportId = getKeyTransport(comma == string::npos ? string() : cipher.substr(comma + 1));
+    if (cipherId == xmlSecTransformIdUnknown || transportId == xmlSecTransformIdUnknown) {
+        errorFunc(NULL, "Error: unsupported cipher \"%s\". ", cipher.c_str());
+        return false;
+    }
 
     // разобрать входной XML
-    doc = xmlReadMemory(msg.c_str(), msg.size(), NULL, NULL, 0);
+    doc = readDoc(msg);
     if ((doc == NULL) || (xmlDocGetRootElement(doc) == NULL)){
         errorFunc(NULL, "Error: unable to parse file. ");
         goto done;      
@@ -461,53 +608,50 @@ bool xml::encrypt(const string &msg, vector<string> &certs, const string &sigpat
         goto done;
     }
 
-    // создать keys manager  по умолчанию для хранения сертификатов шифрования
-    xmlSecKeyMngr = xmlSecKeysMngrCreate();
-    if (!xmlSecKeyMngr) {
-        errorFunc(stderr, "Error: failed to create keys manager. ");
+    // прочитать все сертификаты и получить keys manager, где они лежат под именами-отпечатками
+    size = certs.size();
+    if (size > MAX_KEY_NUM) {
+        errorFunc(NULL, "Error: too many certificates (>%i)", MAX_KEY_NUM);
         goto done;
     }
-    if (xmlSecCryptoAppDefaultKeysMngrInit(xmlSecKeyMngr) < 0) {
-        errorFunc(stderr, "Error: failed to initialize keys manager. ");
+    xmlSecKeyMngr = cache::encryptKeysMngr(certs, certNames);
+    if (!xmlSecKeyMngr)
         goto done;
-    }
 
-    // прочитать все сертификаты и добавить их в manager с нужным именем
-    size = certs.size();
-    if (size > MAX_KEY_NUM) {
-        errorFunc(NULL, "Error: too many certificates (>%i)", MAX_KEY_NUM);
+    // один сессионный ключ на весь документ
+    sessionKey = xmlSecKeyGenerate(dataId, sizeBits, xmlSecKeyDataTypeSession);
+    if (sessionKey == NULL) {
+        errorFunc(NULL, "Error: failed to generate session des key. ");
+        goto done;
+    }
+    sessionKeyValue = xmlSecKeyDataBinaryValueGetBuffer(xmlSecKeyGetValue(sessionKey));
+    if (sessionKeyValue == NULL) {
+        errorFunc(NULL, "Error: failed to get session key value. ");
         goto done;
     }
-    for (int i = 0; i < size; i++) {
-        string s = certs[i];
-        if (!(pkey = xmlSecCryptoAppKeyLoad(s.c_str(), xmlSecKeyDataFormatCertPem, NULL, NULL, NULL))) {
-            errorFunc(NULL, "Error: failed to load pem certificate \"%s\". ", s.c_str());
-            goto done;
-        }
 
-        string fingerprint, serial, errmsg;
-        if (!getCertInfo(s, fingerprint, serial, errmsg)) {
-            errorFunc(NULL, "Error: getCertInfo \"%s\". ", errmsg.c_str());
-            goto done;
-        }
-        certNames.push_back(fingerprint);
+    // сессионный ключ шифруется сертификатом каждого получателя один раз, параллельно
+    recipients.resize(size);
+    for (int i = 0; i < size; i++) {
+        recipients[i].mngr = xmlSecKeyMngr;
+        recipients[i].transportId = transportId;
+        recipients[i].key = xmlSecBufferGetData(sessionKeyValue);
+        recipients[i].keySize = xmlSecBufferGetSize(sessionKeyValue);
+        recipients[i].name = certNames[i];
+    }
+    pool::run(wrapSessionKey, &recipients, size);
 
-        if (xmlSecKeySetName(pkey, BAD_CAST fingerprint.c_str()) < 0) {
-            errorFunc(NULL, "Error: failed to set key name for cert from \"%s\". ", s.c_str());
-            goto done;
-        }
-        if (xmlSecCryptoAppDefaultKeysMngrAdoptKey(xmlSecKeyMngr, pkey)) {
-            errorFunc(NULL, "Error: failed to add key %s. ", s.c_str());
+    for (int i = 0; i < size; i++) {
+        if (!recipients[i].ok) {
+            xmlErrors().append(recipients[i].errors);
             goto done;
         }
-        pkey = NULL; // добавленные ключи удалятся при уничтожении keys manager
     }
 
-    // цикл по тегам, которые надо зашифровать
+    // цикл по тегам, которые надо зашифровать: все используют один сессионный ключ,
+    // в каждый EncryptedData кладется копия готовых EncryptedKey всех получателей
     for (int j=0; j < object->nodesetval->nodeNr; j++) {
-        // создать программно шаблон шифрования с несколькими RSA ключами
-        // которыми шифруется сессионный ключ
-        encDataNode = xmlSecTmplEncDataCreate(doc, getCipher(cipher, dataId, sizeBits), NULL, xmlSecTypeEncElement, NULL, NULL); // or xmlSecTypeEncContent
+        encDataNode = xmlSecTmplEncDataCreate(doc, cipherId, NULL, xmlSecTypeEncElement, NULL, NULL); // or xmlSecTypeEncContent
         if (!encDataNode) {
             errorFunc(NULL, "Error: failed to create encryption template. ");
             goto done;
@@ -516,105 +660,75 @@ bool xml::encrypt(const string &msg, vector<string> &certs, const string &sigpat
             errorFunc(NULL, "Error: failed to add CipherValue node. ");
             goto done;
         }
-        keyInfoNode = xmlSecTmplEncDataEnsureKeyInfo(encDataNode, NULL);
-        if(keyInfoNode == NULL) {
-            errorFunc(NULL, "Error: failed to add key info. ");
-            goto done;
-        }
-
-        // цикл по переданным сертификатам различных клиентов
-        for (int i = 0; i < size; i++) {
-            encKeyNode = xmlSecTmplKeyInfoAddEncryptedKey(keyInfoNode, xmlSecTransformRsaPkcs1Id, NULL, NULL, NULL);
-            if (encKeyNode == NULL) {
-                errorFunc(NULL, "Error: failed to add key info. ");
-                goto done;
-            }
-            if (xmlSecTmplEncDataEnsureCipherValue(encKeyNode) == NULL) {
-                errorFunc(NULL, "Error: failed to add CipherValue node. ");
-                goto done;
-            }
-            keyInfoNode2 = xmlSecTmplEncDataEnsureKeyInfo(encKeyNode, NULL);
-            if(keyInfoNode2 == NULL) {
-                errorFunc(NULL, "Error: failed to add key info. ");
-                goto done;
-            }
-            if (xmlSecTmplKeyInfoAddKeyName(keyInfoNode2, BAD_CAST certNames[i].c_str()) == NULL) {
-                errorFunc(NULL, "Error: failed to add key name. ");
-                goto done;
-            }
-            if ((x509DataNode = xmlSecTmplKeyInfoAddX509Data(keyInfoNode2)) == NULL) {
-                errorFunc(NULL, "Error: failed to add X509DATA. ");
-                goto done;
-            }
-            if (xmlSecTmplX509DataAddIssuerSerial(x509DataNode) == NULL) {
-                errorFunc(NULL, "Error: failed to add serial. ");
-                goto done;
-            }
-            if (xmlSecTmplX509DataAddSubjectName(x509DataNode) == NULL) {
-                errorFunc(NULL, "Error: failed to add subject name. ");
-                goto done;
-            }
-        }
 
-        encCtx = xmlSecEncCtxCreate(xmlSecKeyMngr);
+        encCtx = xmlSecEncCtxCreate(NULL);
         if (encCtx == NULL) {
             errorFunc(NULL, "Error: failed to create encryption context. ");
             goto done;
         }
-        encCtx->encKey = xmlSecKeyGenerate(dataId, sizeBits, xmlSecKeyDataTypeSession);
+        encCtx->encKey = xmlSecKeyDuplicate(sessionKey);
         if (encCtx->encKey == NULL) {
-            errorFunc(NULL, "Error: failed to generate session des key. ");
+            errorFunc(NULL, "Error: failed to duplicate session key. ");
             goto done;
         }
         if (xmlSecEncCtxXmlEncrypt(encCtx, encDataNode, object->nodesetval->nodeTab[j]) < 0) {
             errorFunc(NULL, "Error: encryption failed. ");
             goto done;
         }
+        encryptedNode = encDataNode;
+        encDataNode = NULL; // теперь в документе вместо зашифрованного тега
         xmlSecEncCtxDestroy(encCtx);
         encCtx = NULL;
-        encDataNode = NULL; // удалится при удалении encCtx
-    }
 
-    xmlDocDumpFormatMemory(doc, &mem, &size, 0);
-    if (size > 0) {
-        result = true;
-        out.assign((const char *) mem, size);
+        // KeyInfo по схеме идет перед CipherData
+        cipherDataNode = xmlSecFindChild(encryptedNode, xmlSecNodeCipherData, xmlSecEncNs);
+        if (cipherDataNode == NULL || (keyInfoNode = xmlSecAddPrevSibling(cipherDataNode, xmlSecNodeKeyInfo, xmlSecDSigNs)) == NULL) {
+            errorFunc(NULL, "Error: failed to add key info. ");
+            goto done;
+        }
+        for (int i = 0; i < size; i++) {
+            xmlNodePtr copy = xmlDocCopyNode(recipients[i].encKeyNode, doc, 1);
+            if (copy == NULL || xmlAddChild(keyInfoNode, copy) == NULL) {
+                errorFunc(NULL, "Error: failed to add encrypted key. ");
+                if (copy)
+                    xmlFreeNode(copy);
+                goto done;
+            }
+        }
     }
-    xmlFree(mem);
+
+    result = saveDoc(doc, out);
 
 done:
     if (encCtx)
         xmlSecEncCtxDestroy(encCtx);
+    for (size_t i = 0; i < recipients.size(); i++) {
+        if (recipients[i].doc)
+            xmlFreeDoc(recipients[i].doc);
+    }
+    if (sessionKey)
+        xmlSecKeyDestroy(sessionKey);
+    cache::release(xmlSecKeyMngr);
     if (encDataNode)
         xmlFreeNode(encDataNode);
-    if (xmlSecKeyMngr)
-        xmlSecKeysMngrDestroy(xmlSecKeyMngr);
-    if (pkey)
-        xmlSecKeyDestroy(pkey);
     if (object)
         xmlXPathFreeObject(object);
     if (doc)
         xmlFreeDoc(doc); 
 
-    if (out.empty())
-        out = getErrors();
-
     return result;
 }
 
-bool xml::decrypt(const string &in, const string &key, const string &pwd, const string &sigpath, map<string, string> &xmlns, string &out)
+bool xml::decrypt(const Input &in, const string &key, const string &pwd, const string &sigpath, map<string, string> &xmlns, Output &out)
 {
     bool result = false;
     xmlDocPtr doc = NULL;
-    xmlSecKeyPtr pkey = NULL;
     xmlXPathObjectPtr object = NULL;
     xmlSecKeysMngrPtr xmlSecKeyMngr = NULL;
     xmlSecEncCtxPtr encCtx = NULL;
-    xmlChar *mem = NULL;
-    int size = 0;
 
     // разобрать входной XML
-    doc = xmlReadMemory(in.c_str(), in.size(), NULL, NULL, 0);
+    doc = readDoc(in);
     if ((doc == NULL) || (xmlDocGetRootElement(doc) == NULL)){
         errorFunc(NULL, "Error: unable to parse file. ");
         goto done;      
@@ -627,24 +741,10 @@ bool xml::decrypt(const string &in, const string &key, const string &pwd, const
         goto done;
     }
 
-    // создать keys manager  по умолчанию для хранения ключа расшифровки сессионного ключа
-    xmlSecKeyMngr = xmlSecKeysMngrCreate();
-    if (!xmlSecKeyMngr) {
-        errorFunc(stderr, "Error: failed to create keys manager. ");
-        goto done;
-    }
-    if (xmlSecCryptoAppDefaultKeysMngrInit(xmlSecKeyMngr) < 0) {
-        errorFunc(stderr, "Error: failed to initialize keys manager. ");
-        goto done;
-    }
-
-    pkey = xmlSecCryptoAppKeyLoad(key.c_str(), xmlSecKeyDataFormatPem, pwd.c_str(), NULL, NULL);
-    if (!pkey) {
-        errorFunc(NULL,"Error: failed to load private key \"%s\". ", key.c_str());
+    // keys manager с ключом расшифровки сессионного ключа (кэшируется между вызовами)
+    xmlSecKeyMngr = cache::decryptKeysMngr(key, pwd);
+    if (!xmlSecKeyMngr)
         goto done;
-    }
-    xmlSecCryptoAppDefaultKeysMngrAdoptKey(xmlSecKeyMngr, pkey);
-    pkey = NULL;
 
     // цикл по тегам, которые надо расшифровать
     for (int i=0; i < object->nodesetval->nodeNr; i++) {
@@ -665,37 +765,26 @@ bool xml::decrypt(const string &in, const string &key, const string &pwd, const
         encCtx = NULL;
     }
 
-    xmlDocDumpFormatMemory(doc, &mem, &size, 0);
-    if (size > 0) {
-        result = true;
-        out.assign((const char *) mem, size);
-    }
-    xmlFree(mem);
+    result = saveDoc(doc, out);
 
 done:
     if (encCtx)
         xmlSecEncCtxDestroy(encCtx);
-    if (xmlSecKeyMngr)
-        xmlSecKeysMngrDestroy(xmlSecKeyMngr);
-    if (pkey)
-        xmlSecKeyDestroy(pkey);
+    cache::release(xmlSecKeyMngr);
     if (object)
         xmlXPathFreeObject(object);
     if (doc)
         xmlFreeDoc(doc); 
-
-    if (out.empty())
-        out = getErrors();
     return result;
 }
 
 string xml::getErrors()
 {
-    return xmlErrors;
+    return xmlErrors();
 }
 
 void xml::clearErrors()
 {
-    xmlErrors.clear();
+    xmlErrors().clear();
 }
 
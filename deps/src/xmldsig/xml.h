@@ -4,6 +4,7 @@
 #include <map>
 #include <string>
 #include <xmlsec/xmldsig.h>
+#include "io.h"
 
 using namespace std;
 
@@ -13,12 +14,15 @@ typedef bool (*CallbackType)(const string &fingerprint, string &cert, string &SD
 namespace xml
 {
     bool init();
+    void initThread();
     void done();
 
-    bool verify(const string &msg, const string &xsd_filename, const string &cert, const string &sigpath, map<string, string> &xmlns);
-    bool sign(const string &in, string &out, const string &key, const string &cert, const string &pwd, const string &sigpath, map<string, string> &xmlns);
-    bool encrypt(const string &msg, vector<string> &cert, const string &sigpath, map<string, string> &xmlns, const string &cipher, string &out);
-    bool decrypt(const string &in, const string &key, const string &pwd, const string &sigpath, map<string, string> &xmlns, string &out);
+    // cert - PEM доверенного сертификата; пустой - сертификат ищется в хранилище (cache::loadCertStore)
+    // по signer (member_id) и KeyName подписи, без signer проверка не выполняется
+    bool verify(const Input &msg, const string &xsd_filename, const string &cert, const string &signer, const string &sigpath, map<string, string> &xmlns);
+    bool sign(const Input &in, Output &out, const string &key, const string &cert, const string &pwd, const string &sigpath, map<string, string> &xmlns);
+    bool encrypt(const Input &msg, vector<string> &cert, const string &sigpath, map<string, string> &xmlns, const string &cipher, Output &out);
+    bool decrypt(const Input &in, const string &key, const string &pwd, const string &sigpath, map<string, string> &xmlns, Output &out);
 
     string getErrors();
     void clearErrors();
@@ -14,6 +14,16 @@ require AutoLoader;
     encrypt
     decrypt
 );
+@EXPORT_OK = qw(
+    sign_batch
+    verify_batch
+    encrypt_batch
+    decrypt_batch
+    cache_stats
+    cache_clear
+    cache_config
+    cert_store
+);
 $VERSION = '0.01';
 
 